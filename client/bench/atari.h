@@ -0,0 +1,25 @@
+/* sim65 stand-in for cc65's <atari.h>: just what mmconn.c uses. OS lives
+ * in ordinary RAM here, so rtclok can be advanced by the bench. */
+#ifndef BENCH_ATARI_H
+#define BENCH_ATARI_H
+
+#include <stdint.h>
+
+struct __os
+{
+    unsigned char rtclok[3];
+    void (*vvblki)(void);
+    unsigned char sdmctl;
+    unsigned char *savmsc;
+};
+
+extern struct __os OS;
+
+#define AT_NTSC 0
+#define AT_PAL 1
+
+#define KEY_HELP 0x11
+
+unsigned char get_tv(void);
+
+#endif
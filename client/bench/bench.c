@@ -0,0 +1,235 @@
+/* Cycle counts of the client's pure-logic routines under sim65.
+ *
+ * Built and run by `make bench`. mmconn.c is compiled as is, against the
+ * stand-in headers in this directory. Screen RAM is a plain buffer, FujiNet
+ * calls are no-ops, and network_read_nb() serves canned lobby replies in
+ * BENCH_CHUNK pieces, the way the N: device hands them over. Each figure
+ * is the average over the iterations shown, loop overhead included. */
+
+#define main mmconn_main
+#include "mmconn.c"
+#undef main
+
+/* sim65 peripheral registers: writing the latch freezes every counter,
+ * select picks one, and value reads it back (low 32 bits). */
+#define SIM65_COUNTER_LATCH (*(volatile unsigned char *)0xFFC0)
+#define SIM65_COUNTER_SELECT (*(volatile unsigned char *)0xFFC1)
+#define SIM65_COUNTER_VALUE (*(volatile unsigned long *)0xFFC2)
+#define SIM65_CLOCK_CYCLES 0x00
+
+#define BENCH_CHUNK 128
+#define BENCH_REPLY_MAX 3072
+
+struct __os OS;
+
+static const char *g_canned = NULL;
+static uint16_t g_canned_left = 0;
+static unsigned long g_bench_start = 0;
+static unsigned long g_bench_overhead = 0;
+static char g_body[BENCH_REPLY_MAX];
+static char g_reply_list8[BENCH_REPLY_MAX];
+static char g_reply_list32[BENCH_REPLY_MAX];
+static char g_reply_hello[160];
+static char g_reply_wait[160];
+static char g_reply_start[160];
+static char g_reply_batch[160];
+static char g_bench_out[32];
+static uint8_t g_bench_screen[SCREEN_ROWS * SCREEN_COLS];
+
+unsigned char get_tv(void) { return AT_NTSC; }
+char cgetc(void) { return 0; }
+unsigned char kbhit(void) { return 0; }
+
+bool fuji_get_adapter_config(AdapterConfig *ac) { (void)ac; return false; }
+void fuji_set_appkey_details(uint16_t creator_id, uint8_t app_id, AppKeySize keysize) { (void)creator_id; (void)app_id; (void)keysize; }
+bool fuji_read_appkey(uint8_t key_id, uint16_t *count, uint8_t *data) { (void)key_id; (void)count; (void)data; return false; }
+bool fuji_write_appkey(uint8_t key_id, uint16_t count, uint8_t *data) { (void)key_id; (void)count; (void)data; return false; }
+bool fuji_enable_udpstream(uint16_t port, char *host) { (void)port; (void)host; return false; }
+bool fuji_unmount_disk_image(uint8_t slot) { (void)slot; return false; }
+bool fuji_mount_all(void) { return false; }
+
+uint8_t network_init(void) { return 0; }
+uint8_t network_open(const char *devicespec, uint8_t mode, uint8_t trans) { (void)devicespec; (void)mode; (void)trans; return 0; }
+uint8_t network_close(const char *devicespec) { (void)devicespec; return 0; }
+uint8_t network_write(const char *devicespec, const uint8_t *buf, uint16_t len) { (void)devicespec; (void)buf; (void)len; return 0; }
+
+/* The lobby channel stays connected, as it does with a keep-alive server. */
+uint8_t network_status(const char *devicespec, uint16_t *bw, uint8_t *c, uint8_t *err)
+{
+    (void)devicespec;
+    *bw = g_canned_left;
+    *c = 1;
+    *err = 1;
+    return 0;
+}
+
+/* Hands out the next piece of the canned reply. Once it is used up, the
+ * clock moves on so a reply the parser never finishes still times out. */
+int16_t network_read_nb(const char *devicespec, uint8_t *buf, uint16_t len)
+{
+    uint16_t n = g_canned_left;
+
+    (void)devicespec;
+    if (n == 0)
+    {
+        if (++OS.rtclok[2] == 0)
+            ++OS.rtclok[1];
+        return 0;
+    }
+    if (n > len)
+        n = len;
+    if (n > BENCH_CHUNK)
+        n = BENCH_CHUNK;
+    memcpy(buf, g_canned, n);
+    g_canned += n;
+    g_canned_left -= n;
+    return (int16_t)n;
+}
+
+static unsigned long cycles(void)
+{
+    SIM65_COUNTER_LATCH = 0;
+    SIM65_COUNTER_SELECT = SIM65_CLOCK_CYCLES;
+    return SIM65_COUNTER_VALUE;
+}
+
+static void bench_begin(void)
+{
+    g_bench_start = cycles();
+}
+
+static void bench_end(const char *name, unsigned iterations, unsigned bytes)
+{
+    unsigned long total = cycles() - g_bench_start - g_bench_overhead;
+
+    printf("%-26s %5u x %8lu cycles", name, iterations, total / iterations);
+    if (bytes)
+        printf("  %4lu/byte", total / iterations / bytes);
+    printf("\n");
+}
+
+static void make_reply(char *out, const char *body)
+{
+    sprintf(out, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %u\r\n\r\n%s",
+            (unsigned)strlen(body), body);
+}
+
+static void make_list(char *out, uint8_t games)
+{
+    uint8_t i;
+    size_t used;
+
+    strcpy(g_body, "{\"ok\":true,\"games\":[");
+    used = strlen(g_body);
+    for (i = 0; i < games; ++i)
+    {
+        used += sprintf(g_body + used, "%s{\"id\":\"G%07u\",\"name\":\"Ring %u\",\"players\":%u,\"max\":8,\"active\":%s}",
+                        i ? "," : "", (unsigned)i, (unsigned)i, (unsigned)(i % 8), (i & 1) ? "true" : "false");
+    }
+    strcpy(g_body + used, "]}");
+    make_reply(out, g_body);
+}
+
+static void bench_reply(const char *name, const char *reply, unsigned iterations)
+{
+    unsigned i;
+    uint16_t len = (uint16_t)strlen(reply);
+
+    bench_begin();
+    for (i = 0; i < iterations; ++i)
+    {
+        g_canned = reply;
+        g_canned_left = len;
+        request_start(REQ_LIST, "/list?client_id=ABC12345");
+        while (g_req.state == REQ_READING)
+            request_poll();
+    }
+    bench_end(name, iterations, len);
+    if (g_req.state != REQ_DONE)
+        printf("  %s: reply not parsed\n", name);
+}
+
+int main(void)
+{
+    unsigned i;
+    uint16_t port;
+
+    OS.savmsc = g_bench_screen;
+    g_screen = OS.savmsc;
+    strcpy(g_state.cfg.lobby_host, LOBBY_HOST_DEFAULT);
+    strcpy(g_state.cfg.lobby_port, LOBBY_PORT_DEFAULT);
+    make_list(g_reply_list8, 8);
+    make_list(g_reply_list32, 32);
+    make_reply(g_reply_hello, "{\"ok\":true,\"client_id\":\"ABC12345\",\"name\":\"ALICE\"}");
+    make_reply(g_reply_wait, "{\"ok\":true,\"status\":\"waiting\",\"players\":3,\"max\":8}");
+    make_reply(g_reply_start, "{\"cmd\":\"start\",\"host\":\"fujinet.online\",\"port\":5123,\"token\":\"\"}");
+    make_reply(g_reply_batch, "[{\"ok\":true},{\"ok\":true,\"status\":\"waiting\",\"players\":3,\"max\":8}]");
+
+    /* A sim65 without the counter peripheral, such as the one in the
+     * 2.19 release, treats $FFC0 as plain RAM: every reading is the same
+     * and all the figures below would be zero. */
+    bench_begin();
+    g_bench_overhead = cycles() - g_bench_start;
+    if (g_bench_overhead == 0)
+    {
+        printf("sim65 cycle counter at $FFC0 does not advance.\n"
+               "This sim65 is too old: build one from cc65 sources newer than 2.19.\n");
+        return 1;
+    }
+
+    bench_begin();
+    for (i = 0; i < 100; ++i)
+        url_encode("Ring 1 & Friends!", g_bench_out, sizeof(g_bench_out));
+    bench_end("url_encode", 100, 0);
+
+    bench_begin();
+    for (i = 0; i < 100; ++i)
+        parse_port("5004", &port);
+    bench_end("parse_port", 100, 0);
+
+    bench_begin();
+    for (i = 0; i < 100; ++i)
+        firmware_version_at_least("v1.6.2", MIN_NETSTREAM_FW_MAJOR, MIN_NETSTREAM_FW_MINOR, MIN_NETSTREAM_FW_PATCH);
+    bench_end("firmware_version_at_least", 100, 0);
+
+    bench_reply("reply /hello", g_reply_hello, 20);
+    bench_reply("reply /wait waiting", g_reply_wait, 20);
+    bench_reply("reply /wait start", g_reply_start, 20);
+    bench_reply("reply /batch ping,wait", g_reply_batch, 20);
+    bench_reply("reply /list 8 games", g_reply_list8, 5);
+    bench_reply("reply /list 32 games", g_reply_list32, 2);
+    if (g_reply.game_count != MAX_GAMES)
+        printf("  /list kept %u games, expected %u\n", g_reply.game_count, MAX_GAMES);
+
+    g_game_count = g_reply.game_count;
+    bench_begin();
+    draw_list_screen();
+    render();
+    bench_end("render list, first paint", 1, 0);
+
+    bench_begin();
+    for (i = 0; i < 20; ++i)
+    {
+        draw_list_screen();
+        render();
+    }
+    bench_end("render list, unchanged", 20, 0);
+
+    bench_begin();
+    for (i = 0; i < 20; ++i)
+    {
+        list_select((uint8_t)(i & 7));
+        render();
+    }
+    bench_end("render list, move selection", 20, 0);
+
+    bench_begin();
+    for (i = 0; i < 20; ++i)
+    {
+        set_status((i & 1) ? "Joining..." : "Game is full.");
+        render();
+    }
+    bench_end("render status line", 20, 0);
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+/* sim65 stand-in for <conio.h>. The bench defines these as no-ops. */
+#ifndef BENCH_CONIO_H
+#define BENCH_CONIO_H
+
+#define CH_DEL 0x7E
+#define CH_DELCHR 0xFE
+#define CH_TAB 0x7F
+#define CH_ENTER 0x9B
+#define CH_ESC 0x1B
+#define CH_CURS_UP 0x1C
+#define CH_CURS_DOWN 0x1D
+#define CH_CURS_LEFT 0x1E
+#define CH_CURS_RIGHT 0x1F
+
+char cgetc(void);
+unsigned char kbhit(void);
+
+#endif
@@ -0,0 +1,28 @@
+/* sim65 stand-in for fujinet-lib's fujinet-fuji.h. */
+#ifndef BENCH_FUJINET_FUJI_H
+#define BENCH_FUJINET_FUJI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_APPKEY_LEN 64
+
+typedef enum
+{
+    DEFAULT = 0
+} AppKeySize;
+
+typedef struct
+{
+    char fn_version[15];
+} AdapterConfig;
+
+bool fuji_get_adapter_config(AdapterConfig *ac);
+void fuji_set_appkey_details(uint16_t creator_id, uint8_t app_id, AppKeySize keysize);
+bool fuji_read_appkey(uint8_t key_id, uint16_t *count, uint8_t *data);
+bool fuji_write_appkey(uint8_t key_id, uint16_t count, uint8_t *data);
+bool fuji_enable_udpstream(uint16_t port, char *host);
+bool fuji_unmount_disk_image(uint8_t slot);
+bool fuji_mount_all(void);
+
+#endif
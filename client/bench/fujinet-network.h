@@ -0,0 +1,15 @@
+/* sim65 stand-in for fujinet-lib's fujinet-network.h. The bench serves
+ * canned lobby replies through network_read_nb(). */
+#ifndef BENCH_FUJINET_NETWORK_H
+#define BENCH_FUJINET_NETWORK_H
+
+#include <stdint.h>
+
+uint8_t network_init(void);
+uint8_t network_open(const char *devicespec, uint8_t mode, uint8_t trans);
+int16_t network_read_nb(const char *devicespec, uint8_t *buf, uint16_t len);
+uint8_t network_write(const char *devicespec, const uint8_t *buf, uint16_t len);
+uint8_t network_status(const char *devicespec, uint16_t *bw, uint8_t *c, uint8_t *err);
+uint8_t network_close(const char *devicespec);
+
+#endif
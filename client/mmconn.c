@@ -1,3 +1,4 @@
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -30,8 +31,17 @@
 #define LIST_REFRESH_TICKS 620
 #define HEARTBEAT_TICKS 620
 #define WAIT_POLL_TICKS 124
-
-#define MAX_GAMES 8
+#define REQUEST_TIMEOUT_TICKS 200
+#define LOBBY_UNIT "N1:"
+#define EVENTS_UNIT "N2:"
+#define URL_MAX (GAME_NAME_MAX * 3 + 1)
+#define REQ_LENGTH_UNKNOWN 0xFFFFu
+#define HEADER_LINE_MAX 24
+#define JSON_KEY_MAX 11
+
+/* The list shows one game per row from LIST_FIRST_ROW, above the
+ * firmware warning rows. */
+#define MAX_GAMES 16
 #define GAME_ID_LEN 8
 #define GAME_NAME_MAX 32
 
@@ -42,6 +52,13 @@
 #define NETSTREAM_FW_WARNING_LINE1 "THIS FUJINET FIRMWARE IS TOO OLD"
 #define NETSTREAM_FW_WARNING_LINE2 "UPDATE TO V1.6.0 OR NEWER"
 #define SCREEN_COLS 40
+#define SCREEN_ROWS 24
+#define ALL_ROWS 0xFFFFFFUL
+#define CONFIG_FOCUS_ROW 2
+#define CREATE_FOCUS_ROW 4
+#define LIST_FIRST_ROW 4
+#define WAIT_GAME_ROW 3
+#define WAIT_PLAYERS_ROW 4
 
 // App Key Details
 #define CREATOR_ID 0x3022
@@ -76,6 +93,126 @@ typedef struct
     bool active;
 } GameEntry;
 
+typedef enum
+{
+    REQ_NONE = 0,
+    REQ_HELLO,
+    REQ_LIST,
+    REQ_JOIN,
+    REQ_CREATE,
+    REQ_LEAVE,
+    REQ_PING,
+    REQ_WAIT
+} RequestKind;
+
+typedef enum
+{
+    REQ_IDLE = 0,
+    REQ_READING,
+    REQ_DONE,
+    REQ_FAILED
+} RequestState;
+
+/* The one lobby request in flight on N1. It is advanced by request_poll()
+ * from the main loop, so keys and screen updates are never held up. Each
+ * chunk read into g_line is consumed at once: header lines through the
+ * small line window, body bytes through the JSON stream. The reply is
+ * complete once Content-Length body bytes are in, or, for a reply without
+ * headers, once its outer JSON object closes. */
+typedef struct
+{
+    RequestKind kind;
+    RequestState state;
+    uint32_t started;  /* tick of the last data received */
+    uint16_t length;   /* Content-Length, or REQ_LENGTH_UNKNOWN */
+    uint16_t received; /* body bytes consumed */
+    uint16_t status;   /* HTTP status, 0 if no status line was seen */
+    char line[HEADER_LINE_MAX + 1];
+    uint8_t line_len;
+    bool replied;      /* any byte of the reply has arrived */
+    bool headers;      /* still inside the response headers */
+    bool truncated;
+} LobbyRequest;
+
+typedef enum
+{
+    JF_NONE = 0,
+    JF_GAMES,
+    JF_PORT,
+    JF_PLAYERS,
+    JF_MAX,
+    JF_GAME_PLAYERS,
+    JF_GAME_MAX,
+    JF_GAME_ACTIVE
+} JsonField;
+
+/* Single-pass tokenizer state. String values are written straight into
+ * the field they belong to, so only the current key is ever buffered. */
+typedef struct
+{
+    char key[JSON_KEY_MAX + 1];
+    uint8_t key_len;
+    char *out;         /* destination of the current string value, or NULL */
+    uint8_t out_room;  /* bytes left in out, including the NUL */
+    JsonField field;   /* destination of the current bare value */
+    uint16_t number;
+    bool truth;
+    uint8_t depth;
+    uint8_t arrays;    /* bit n set when nesting level n is an array */
+    bool in_games;
+    bool in_string;
+    bool in_key;
+    bool escaped;
+    bool expect_key;
+    bool in_bare;
+    bool done;
+    bool batch;        /* inside the top-level array of a /batch reply */
+    bool events;       /* an /events line: its fields describe one game */
+    GameEntry entry;   /* games[] element being filled */
+} JsonStream;
+
+/* The top-level fields of the last lobby reply. */
+typedef struct
+{
+    char id[GAME_ID_LEN + 1]; /* client_id or game_id */
+    char error[16];
+    char cmd[16];
+    char host[HOSTNAME_MAX_LEN + 1];
+    uint16_t port;
+    uint8_t players;
+    uint8_t max_players;
+    bool has_players;
+    bool has_max;
+    uint8_t game_count;
+} LobbyReply;
+
+/* The /events stream on N2. While it is open the lobby pushes game
+ * changes and the start command, and the list and wait screens stop
+ * polling. Its lines go through the same JSON tokenizer, whose state is
+ * swapped with the request's while they are fed. */
+typedef struct
+{
+    bool open;
+    bool unsupported;  /* the lobby has no /events, so keep polling */
+    bool headers;      /* still inside the response headers */
+    bool syncing;      /* the current games are still arriving */
+    bool blank;        /* the header line so far is empty */
+    uint8_t count;     /* games received while syncing */
+    uint32_t opened;   /* tick of the last open attempt, 0 to retry at once */
+    uint32_t heard;    /* tick of the last data or status check */
+    JsonStream json;
+    LobbyReply reply;
+} EventStream;
+
+/* A screen: its static text, one entry per row (NULL for none), and the
+ * function that writes the changing parts of a row into g_row. */
+typedef struct
+{
+    const char *const *rows;
+    void (*fill)(uint8_t y);
+    bool has_status;
+} Layout;
+
 typedef struct
 {
     LobbyConfig cfg;
@@ -91,36 +228,37 @@ typedef struct
 } AppState;
 
 static AppState g_state;
+static LobbyRequest g_req;
+static JsonStream g_json;
+static LobbyReply g_reply;
+static EventStream g_events;
 static GameEntry g_games[MAX_GAMES];
 static uint8_t g_game_count = 0;
 static uint8_t g_selected = 0;
 static char g_game_name[GAME_NAME_MAX + 1] = "Game";
 static char g_game_max[3] = "2";
+/* Request arena: holds the devicespec while the channel opens, then
+ * each request as it is written and the read window for its reply. */
 static char g_line[256];
-static char g_cmd[16];
+/* N1 stays connected to the lobby between requests. */
+static bool g_channel_open = false;
+/* The lobby has no /batch, so each operation is its own request. */
+static bool g_batch_unsupported = false;
 static uint32_t g_last_refresh = 0;
 static uint32_t g_last_heartbeat = 0;
 static uint32_t g_last_wait_poll = 0;
 static uint32_t g_now = 0;
-static int g_port = 0;
 static char g_key = 0;
-static char g_id[GAME_ID_LEN + 1];
-static char g_name_buf[GAME_NAME_MAX + 1];
-static int g_players = 0;
-static int g_max_players = 0;
-static bool g_active = false;
-static char g_slice[256];
-static size_t g_slice_len = 0;
-static const char *g_p = NULL;
-static const char *g_idp = NULL;
-static const char *g_obj_start = NULL;
-static const char *g_obj_end = NULL;
-static char g_devicespec[96];
-static char g_url[128];
+static char g_url[URL_MAX];
 static const char g_hex[] = "0123456789ABCDEF";
 static uint8_t g_wait_players = 0;
 static uint8_t g_wait_max = 0;
 static bool g_has_supported_firmware = true;
+static uint8_t *g_screen = NULL;
+static const Layout *g_layout = NULL;
+static uint32_t g_dirty = 0;
+static char g_row[SCREEN_COLS];
+static char g_status_text[SCREEN_COLS + 1];
 
 static uint8_t status_line_y(void)
 {
@@ -136,22 +274,6 @@ static uint8_t centered_x(const char *text)
     return (uint8_t)((SCREEN_COLS - len) / 2);
 }
 
-static void draw_inverse_centered(uint8_t y, const char *text)
-{
-    gotoxy(centered_x(text), y);
-    revers(1);
-    cprintf("%s", text);
-    revers(0);
-}
-
-static void draw_netstream_warning(void)
-{
-    if (g_has_supported_firmware)
-        return;
-    draw_inverse_centered(UI_WARNING_Y, NETSTREAM_FW_WARNING_LINE1);
-    draw_inverse_centered(UI_WARNING_Y + 1, NETSTREAM_FW_WARNING_LINE2);
-}
-
 static bool parse_version_part(const char **version, uint8_t *part)
 {
     uint16_t value = 0;
@@ -253,39 +375,6 @@ static void build_host_buffer(const char *hostname, uint8_t flags, uint8_t audf3
     }
 }
 
-static void set_status(const char *msg)
-{
-    uint8_t i;
-    uint8_t y = status_line_y();
-    gotoxy(0, y);
-    for (i = 0; i < 40; ++i)
-        cputc(' ');
-    gotoxy(0, y);
-    cprintf("%s", msg);
-}
-
-static void draw_field_value(uint8_t x, uint8_t y, const char *value, uint8_t width)
-{
-    uint8_t i = 0;
-    size_t len = strlen(value);
-    const char *start = value;
-
-    if (len > width)
-        start = value + (len - width);
-
-    gotoxy(x, y);
-    while (start[i] != '\0' && i < width)
-    {
-        cprintf("%c", start[i]);
-        ++i;
-    }
-    while (i < width)
-    {
-        cprintf(" ");
-        ++i;
-    }
-}
-
 static bool is_printable(char c)
 {
     return (c >= 32 && c <= 126);
@@ -321,126 +410,303 @@ static void handle_text_input(char *buf, size_t max_len, char key, bool alnum_on
     buf[len + 1] = '\0';
 }
 
-static void draw_config_screen(const AppState *state)
+static const char *const g_config_rows[SCREEN_ROWS] = {
+    "MIDIMaze Lobby", NULL,
+    "  Host: ", NULL,
+    "  Port: ", NULL,
+    "  Name: ", NULL,
+    "  [ CONNECT ]"
+};
+
+static const char *const g_connect_rows[SCREEN_ROWS] = {
+    "Connecting lobby..."
+};
+
+static const char *const g_list_rows[SCREEN_ROWS] = {
+    "MIDI Maze Game Lobby", NULL,
+    "\xD4\xC1\xC2 move  \xD2=Refresh  \xC3=Create  \xC8=Help"
+};
+
+static const char *const g_create_rows[SCREEN_ROWS] = {
+    "Create Game",
+    "\xD4\xC1\xC2 move  \xC5\xCE\xD4\xC5\xD2 select", NULL, NULL,
+    "  Name: ", NULL,
+    "  Max Players: ", NULL,
+    "  [ CREATE ]", NULL,
+    "  [ BACK ]"
+};
+
+static const char *const g_wait_rows[SCREEN_ROWS] = {
+    "Waiting for Players...", NULL, NULL,
+    "Game: ",
+    "Players: ", NULL, NULL,
+    "Press \xC5\xD3\xC3 to cancel"
+};
+
+static const char *const g_start_rows[SCREEN_ROWS] = {
+    "Starting game..."
+};
+
+static const char *const g_help_rows[SCREEN_ROWS] = {
+    "MIDI Maze Connect Help - \xC5\xD3\xC3 go back",
+    "----------------------------------------",
+    "Lobby can create new game or join them.",
+    "Game list shows how many players are in",
+    "game. (1/2) means you can join game and",
+    "(5/5)* game is full. The game can't",
+    "begin until all players are ready. When",
+    "joining, the app will wait for full",
+    "roster then start game. After the game",
+    "finishes loading choose MIDIMATE from",
+    "menu. Last player to choose it becomes",
+    "master and chooses game options. If a",
+    "timeout error occurs in game you can",
+    "select MIDIMATE again to start over",
+    "without returning to lobby.", NULL,
+    "MIDIMaze loaded from disk requires at",
+    "least 256K of RAM."
+};
+
+static void mark_row(uint8_t y)
 {
-    clrscr();
-    gotoxy(0, UI_TITLE_Y);
-    cprintf("MIDIMaze Lobby");
+    g_dirty |= (uint32_t)1 << y;
+}
 
-    gotoxy(0, 2);
-    cprintf(state->focus == 0 ? "> Host: " : "  Host: ");
-    draw_field_value(8, 2, state->cfg.lobby_host, FIELD_WIDTH_HOST);
+static void show_layout(const Layout *layout)
+{
+    g_layout = layout;
+    g_dirty = ALL_ROWS;
+}
 
-    gotoxy(0, 4);
-    cprintf(state->focus == 1 ? "> Port: " : "  Port: ");
-    draw_field_value(8, 4, state->cfg.lobby_port, FIELD_WIDTH_PORT);
+static void set_status(const char *msg)
+{
+    strncpy(g_status_text, msg, SCREEN_COLS);
+    g_status_text[SCREEN_COLS] = '\0';
+    mark_row(status_line_y());
+}
 
-    gotoxy(0, 6);
-    cprintf(state->focus == 2 ? "> Name: " : "  Name: ");
-    draw_field_value(8, 6, state->cfg.player_name, FIELD_WIDTH_NAME);
+static void set_list_status(void)
+{
+    set_status(g_game_count ? "\xC5\xCE\xD4\xC5\xD2=Join  \xC5\xD3\xC3=Back" : "No games yet");
+}
 
-    gotoxy(0, 8);
-    cprintf(state->focus == 3 ? "> [ CONNECT ]" : "  [ CONNECT ]");
+/* Moves the "> " marker between the rows of a form, two rows apart. */
+static void set_focus(uint8_t focus, uint8_t first_row)
+{
+    mark_row((uint8_t)(first_row + 2 * g_state.focus));
+    g_state.focus = focus;
+    mark_row((uint8_t)(first_row + 2 * g_state.focus));
+}
 
-    draw_netstream_warning();
-    set_status(state->status);
+static void list_select(uint8_t index)
+{
+    mark_row((uint8_t)(LIST_FIRST_ROW + g_selected));
+    g_selected = index;
+    mark_row((uint8_t)(LIST_FIRST_ROW + g_selected));
 }
 
-static void draw_list_screen(const GameEntry *games, uint8_t game_count, uint8_t selected)
+/* Puts game e in list slot i, redrawing its row only if it changed. */
+static void list_store(uint8_t i, GameEntry *e)
 {
-    uint8_t i;
-    uint8_t y;
-    clrscr();
-    gotoxy(0, UI_TITLE_Y);
-    cprintf("MIDI Maze Game Lobby");
-    gotoxy(0, 2);
-    cprintf("\xD4\xC1\xC2 move  \xD2=Refresh  \xC3=Create  \xC8=Help");
+    if (!e->name[0])
+        strcpy(e->name, "Game");
+    if (memcmp(&g_games[i], e, sizeof(GameEntry)) != 0)
+    {
+        g_games[i] = *e;
+        mark_row((uint8_t)(LIST_FIRST_ROW + i));
+    }
+}
 
-    for (i = 0; i < game_count; i++)
+static uint8_t row_text(uint8_t x, const char *text)
+{
+    while (*text && x < SCREEN_COLS)
+        g_row[x++] = *text++;
+    return x;
+}
+
+static uint8_t row_number(uint8_t x, uint8_t value)
+{
+    char digits[3];
+    uint8_t n = 0;
+
+    do
     {
-        y = 4 + i;
-        gotoxy(0, y);
-        if (i == selected)
-            cprintf("> ");
-        else
-            cprintf("  ");
-        cprintf("%s (%u/%u)%s", games[i].name, games[i].players, games[i].max_players,
-                games[i].active ? "*" : "");
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n && x < SCREEN_COLS)
+        g_row[x++] = digits[--n];
+    return x;
+}
+
+/* Shows the last width characters of value, so the cursor end of a text
+ * field stays visible. */
+static void row_field(uint8_t x, const char *value, uint8_t width)
+{
+    size_t len = strlen(value);
+
+    if (len > width)
+        value += len - width;
+    while (*value && width--)
+        g_row[x++] = *value++;
+}
+
+static void row_inverse_centered(const char *text)
+{
+    uint8_t x = centered_x(text);
+
+    while (*text && x < SCREEN_COLS)
+        g_row[x++] = (char)(*text++ | 0x80);
+}
+
+static void config_fill(uint8_t y)
+{
+    if (y < CONFIG_FOCUS_ROW || y > CONFIG_FOCUS_ROW + 6 || (y & 1))
+        return;
+    if (y == CONFIG_FOCUS_ROW + 2 * g_state.focus)
+        g_row[0] = '>';
+    if (y == 2)
+        row_field(8, g_state.cfg.lobby_host, FIELD_WIDTH_HOST);
+    else if (y == 4)
+        row_field(8, g_state.cfg.lobby_port, FIELD_WIDTH_PORT);
+    else if (y == 6)
+        row_field(8, g_state.cfg.player_name, FIELD_WIDTH_NAME);
+}
+
+static void list_fill(uint8_t y)
+{
+    uint8_t i = (uint8_t)(y - LIST_FIRST_ROW);
+    uint8_t x;
+
+    if (y < LIST_FIRST_ROW || i >= g_game_count)
+        return;
+    if (i == g_selected)
+        g_row[0] = '>';
+    x = row_text(2, g_games[i].name);
+    x = row_text(x, " (");
+    x = row_number(x, g_games[i].players);
+    x = row_text(x, "/");
+    x = row_number(x, g_games[i].max_players);
+    x = row_text(x, ")");
+    if (g_games[i].active)
+        row_text(x, "*");
+}
+
+static void create_fill(uint8_t y)
+{
+    if (y < CREATE_FOCUS_ROW || y > CREATE_FOCUS_ROW + 6 || (y & 1))
+        return;
+    if (y == CREATE_FOCUS_ROW + 2 * g_state.focus)
+        g_row[0] = '>';
+    if (y == 4)
+        row_field(8, g_game_name, FIELD_WIDTH_GAME);
+    else if (y == 6)
+        row_field(15, g_game_max, 2);
+}
+
+static void wait_fill(uint8_t y)
+{
+    uint8_t x;
+
+    if (y == WAIT_GAME_ROW)
+    {
+        row_text(6, g_state.current_game_name);
+    }
+    else if (y == WAIT_PLAYERS_ROW)
+    {
+        x = row_number(9, g_wait_players);
+        x = row_text(x, " of ");
+        row_number(x, g_wait_max);
     }
-    draw_netstream_warning();
-    set_status(game_count ? "\xC5\xCE\xD4\xC5\xD2=Join  \xC5\xD3\xC3=Back" : "No games yet");
 }
 
-static void draw_create_screen(const AppState *state, const char *game_name, const char *max_players, uint8_t focus)
+static const Layout g_config_layout = { g_config_rows, config_fill, true };
+static const Layout g_connect_layout = { g_connect_rows, NULL, true };
+static const Layout g_list_layout = { g_list_rows, list_fill, true };
+static const Layout g_create_layout = { g_create_rows, create_fill, true };
+static const Layout g_wait_layout = { g_wait_rows, wait_fill, true };
+static const Layout g_start_layout = { g_start_rows, NULL, true };
+static const Layout g_help_layout = { g_help_rows, NULL, false };
+
+/* Writes g_row to screen row y as ANTIC screen codes, storing only the
+ * bytes that differ from what is already shown. */
+static void emit_row(uint8_t y)
 {
-    clrscr();
-    gotoxy(0, UI_TITLE_Y);
-    cprintf("Create Game");
-    gotoxy(0, 1);
-    cprintf("\xD4\xC1\xC2 move  \xC5\xCE\xD4\xC5\xD2 select");
+    uint8_t *dst = g_screen + (uint16_t)y * SCREEN_COLS;
+    uint8_t x;
+    uint8_t c;
+    uint8_t code;
 
-    gotoxy(0, 4);
-    cprintf(focus == 0 ? "> Name: " : "  Name: ");
-    draw_field_value(8, 4, game_name, FIELD_WIDTH_GAME);
+    for (x = 0; x < SCREEN_COLS; ++x)
+    {
+        c = (uint8_t)g_row[x];
+        code = c & 0x7F;
+        if (code < 0x20)
+            code += 0x40;
+        else if (code < 0x60)
+            code -= 0x20;
+        code |= c & 0x80;
+        if (dst[x] != code)
+            dst[x] = code;
+    }
+}
 
-    gotoxy(0, 6);
-    cprintf(focus == 1 ? "> Max Players: " : "  Max Players: ");
-    draw_field_value(15, 6, max_players, 2);
+/* Rebuilds the rows marked since the last call from the layout template,
+ * its fill function, the firmware warning and the status line. */
+static void render(void)
+{
+    uint8_t y;
+    uint32_t bit = 1;
 
-    gotoxy(0, 8);
-    cprintf(focus == 2 ? "> [ CREATE ]" : "  [ CREATE ]");
+    if (!g_dirty || !g_layout)
+        return;
+    for (y = 0; y < SCREEN_ROWS; ++y, bit <<= 1)
+    {
+        if (!(g_dirty & bit))
+            continue;
+        memset(g_row, ' ', sizeof(g_row));
+        if (g_layout->rows[y])
+            row_text(0, g_layout->rows[y]);
+        if (g_layout->fill)
+            g_layout->fill(y);
+        if (!g_has_supported_firmware && y == UI_WARNING_Y)
+            row_inverse_centered(NETSTREAM_FW_WARNING_LINE1);
+        else if (!g_has_supported_firmware && y == UI_WARNING_Y + 1)
+            row_inverse_centered(NETSTREAM_FW_WARNING_LINE2);
+        if (g_layout->has_status && y == status_line_y())
+            row_text(0, g_status_text);
+        emit_row(y);
+    }
+    g_dirty = 0;
+}
+
+static void draw_config_screen(const AppState *state)
+{
+    show_layout(&g_config_layout);
+    set_status(state->status);
+}
 
-    gotoxy(0, 10);
-    cprintf(focus == 3 ? "> [ BACK ]" : "  [ BACK ]");
+static void draw_list_screen(void)
+{
+    show_layout(&g_list_layout);
+    set_list_status();
+}
 
-    draw_netstream_warning();
+static void draw_create_screen(const AppState *state)
+{
+    show_layout(&g_create_layout);
     set_status(state->status);
 }
 
-static void draw_wait_screen(const char *game_name, uint8_t players, uint8_t max_players)
+static void draw_wait_screen(void)
 {
-    clrscr();
-    gotoxy(0, UI_TITLE_Y);
-    cprintf("Waiting for Players...");
-    gotoxy(0, 3);
-    cprintf("Game: %s", game_name);
-    gotoxy(0, 4);
-    cprintf("Players: %u of %u", players, max_players);
-    gotoxy(0, 7);
-    cprintf("Press \xC5\xD3\xC3 to cancel");
-    draw_netstream_warning();
+    show_layout(&g_wait_layout);
     set_status("Waiting for lobby start...");
 }
 
 static void draw_help_screen(void)
 {
-    clrscr();
-    gotoxy(0, UI_TITLE_Y);
-    cprintf("MIDI Maze Connect Help - \xC5\xD3\xC3 go back");
-    gotoxy(0, 1);
-    printf("----------------------------------------");
-    printf("Lobby can create new game or join them.\n");
-    printf("Game list shows how many players are in\n");
-    printf("game. (1/2) means you can join game and\n");
-    printf("(5/5)* game is full. The game can't\n");
-    printf("begin until all players are ready. When\n");
-    printf("joining, the app will wait for full\n");
-    printf("roster then start game. After the game\n");
-    printf("finishes loading choose MIDIMATE from\n");
-    printf("menu. Last player to choose it becomes\n");
-    printf("master and chooses game options. If a\n");
-    printf("timeout error occurs in game you can\n");
-    printf("select MIDIMATE again to start over\n");
-    printf("without returning to lobby. \n");
-    printf("\n");
-    printf("MIDIMaze loaded from disk requires at\n");
-    printf("least 256K of RAM.\n");
-    printf("\n");
-    printf("\n");
-    printf("\n");
-    printf("\n");
-    printf("\n");
-    draw_netstream_warning();
+    show_layout(&g_help_layout);
 }
 
 static void url_encode(const char *src, char *dst, size_t dst_len)
@@ -473,167 +739,451 @@ static void url_encode(const char *src, char *dst, size_t dst_len)
     dst[used] = '\0';
 }
 
-static bool http_get_json(const char *path, char *out, size_t out_len)
+static void json_bind(void)
 {
-    uint32_t start;
-    size_t used = 0;
-    char *body;
-    int16_t r;
+    g_json.out = NULL;
+    g_json.field = JF_NONE;
+    g_json.number = 0;
+    g_json.truth = false;
 
-    snprintf(g_devicespec, sizeof(g_devicespec), "N1:HTTP://%s:%s%s",
-             g_state.cfg.lobby_host, g_state.cfg.lobby_port, path);
+    if ((g_json.in_games && g_json.depth == 3) || (g_json.events && g_json.depth == 1))
+    {
+        if (strcmp(g_json.key, "id") == 0)
+        {
+            g_json.out = g_json.entry.id;
+            g_json.out_room = sizeof(g_json.entry.id);
+        }
+        else if (strcmp(g_json.key, "name") == 0)
+        {
+            g_json.out = g_json.entry.name;
+            g_json.out_room = sizeof(g_json.entry.name);
+        }
+        else if (strcmp(g_json.key, "players") == 0)
+            g_json.field = JF_GAME_PLAYERS;
+        else if (strcmp(g_json.key, "max") == 0)
+            g_json.field = JF_GAME_MAX;
+        else if (strcmp(g_json.key, "active") == 0)
+            g_json.field = JF_GAME_ACTIVE;
+    }
+    if (g_json.depth == 1 && !g_json.out && g_json.field == JF_NONE)
+    {
+        if (strcmp(g_json.key, "client_id") == 0 || strcmp(g_json.key, "game_id") == 0)
+        {
+            g_json.out = g_reply.id;
+            g_json.out_room = sizeof(g_reply.id);
+        }
+        else if (strcmp(g_json.key, "error") == 0)
+        {
+            g_json.out = g_reply.error;
+            g_json.out_room = sizeof(g_reply.error);
+        }
+        else if (strcmp(g_json.key, "cmd") == 0)
+        {
+            g_json.out = g_reply.cmd;
+            g_json.out_room = sizeof(g_reply.cmd);
+        }
+        else if (strcmp(g_json.key, "host") == 0)
+        {
+            g_json.out = g_reply.host;
+            g_json.out_room = sizeof(g_reply.host);
+        }
+        else if (strcmp(g_json.key, "games") == 0)
+            g_json.field = JF_GAMES;
+        else if (strcmp(g_json.key, "port") == 0)
+            g_json.field = JF_PORT;
+        else if (strcmp(g_json.key, "players") == 0)
+            g_json.field = JF_PLAYERS;
+        else if (strcmp(g_json.key, "max") == 0)
+            g_json.field = JF_MAX;
+    }
+    if (g_json.out)
+        g_json.out[0] = '\0';
+}
 
-    if (network_open(g_devicespec, 4, 0) != 0)
-        return false;
+static void json_bare_done(void)
+{
+    if (!g_json.in_bare)
+        return;
+    g_json.in_bare = false;
+    switch (g_json.field)
+    {
+    case JF_PORT:
+        g_reply.port = g_json.number;
+        break;
+    case JF_PLAYERS:
+        g_reply.players = (uint8_t)g_json.number;
+        g_reply.has_players = true;
+        break;
+    case JF_MAX:
+        g_reply.max_players = (uint8_t)g_json.number;
+        g_reply.has_max = true;
+        break;
+    case JF_GAME_PLAYERS:
+        g_json.entry.players = (uint8_t)g_json.number;
+        break;
+    case JF_GAME_MAX:
+        g_json.entry.max_players = (uint8_t)g_json.number;
+        break;
+    case JF_GAME_ACTIVE:
+        g_json.entry.active = g_json.truth;
+        break;
+    default:
+        break;
+    }
+    g_json.field = JF_NONE;
+}
 
-    start = rtclok_now();
-    out[0] = '\0';
+/* The results of a /batch reply come as a top-level array. It is looked
+ * through, so each result is parsed as if it were the whole reply and
+ * their fields all land in g_reply. */
+static void json_open(char c)
+{
+    if (c == '[' && g_json.depth == 0)
+    {
+        g_json.batch = true;
+        return;
+    }
+    if (c == '[' && g_json.field == JF_GAMES)
+        g_json.in_games = true;
+    else if (c == '{' && g_json.in_games && g_json.depth == 2)
+        memset(&g_json.entry, 0, sizeof(g_json.entry));
+    g_json.out = NULL;
+    g_json.field = JF_NONE;
+
+    ++g_json.depth;
+    if (g_json.depth < 8)
+    {
+        if (c == '[')
+            g_json.arrays |= (uint8_t)(1u << g_json.depth);
+        else
+            g_json.arrays &= (uint8_t)~(1u << g_json.depth);
+    }
+    g_json.expect_key = (c == '{');
+}
+
+/* A games[] element is copied into g_games whole when it closes, so the
+ * list never holds a half-parsed entry. Elements past MAX_GAMES are
+ * skipped. */
+static void json_close(char c)
+{
+    json_bare_done();
+    if (g_json.depth == 0)
+    {
+        if (c == ']' && g_json.batch)
+            g_json.done = true;
+        return;
+    }
+    --g_json.depth;
 
-    while (rtclok_diff(rtclok_now(), start) < 200)
+    if (g_json.in_games && g_json.depth == 2 && c == '}')
+    {
+        if (g_json.entry.id[0] && g_reply.game_count < MAX_GAMES)
+            list_store(g_reply.game_count++, &g_json.entry);
+    }
+    else if (g_json.in_games && g_json.depth == 1)
     {
-        r = network_read_nb(g_devicespec, (uint8_t *)out + used, (uint16_t)(out_len - used - 1));
-        if (r > 0)
+        g_json.in_games = false;
+    }
+
+    if (g_json.depth == 0 && !g_json.batch)
+        g_json.done = true;
+    g_json.out = NULL;
+    g_json.field = JF_NONE;
+    g_json.expect_key = false;
+}
+
+static void json_feed(char c)
+{
+    if (g_json.in_string)
+    {
+        if (g_json.escaped)
         {
-            used += (size_t)r;
-            out[used] = '\0';
+            g_json.escaped = false;
+        }
+        else if (c == '\\')
+        {
+            g_json.escaped = true;
+            return;
+        }
+        else if (c == '"')
+        {
+            g_json.in_string = false;
+            if (g_json.in_key)
+            {
+                g_json.key[g_json.key_len <= JSON_KEY_MAX ? g_json.key_len : 0] = '\0';
+                json_bind();
+            }
+            else
+            {
+                g_json.out = NULL;
+            }
+            return;
         }
-        if (r <= 0 && used > 0)
-            break;
-    }
 
-    network_close(g_devicespec);
+        if (g_json.in_key)
+        {
+            if (g_json.key_len < JSON_KEY_MAX)
+                g_json.key[g_json.key_len] = c;
+            if (g_json.key_len <= JSON_KEY_MAX)
+                ++g_json.key_len;
+        }
+        else if (g_json.out && g_json.out_room > 1)
+        {
+            *g_json.out++ = c;
+            *g_json.out = '\0';
+            --g_json.out_room;
+        }
+        return;
+    }
 
-    body = strstr(out, "\r\n\r\n");
-    if (body)
+    switch (c)
     {
-        body += 4;
-        memmove(out, body, strlen(body) + 1);
+    case '"':
+        g_json.in_string = true;
+        g_json.in_key = g_json.expect_key;
+        g_json.key_len = 0;
+        break;
+    case ':':
+        g_json.expect_key = false;
+        break;
+    case ',':
+        json_bare_done();
+        g_json.out = NULL;
+        g_json.field = JF_NONE;
+        g_json.expect_key = g_json.depth < 8 && !(g_json.arrays & (1u << g_json.depth));
+        break;
+    case '{':
+    case '[':
+        json_open(c);
+        break;
+    case '}':
+    case ']':
+        json_close(c);
+        break;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        json_bare_done();
+        break;
+    default:
+        if (!g_json.in_bare)
+        {
+            g_json.in_bare = true;
+            g_json.truth = (c == 't');
+        }
+        if (c >= '0' && c <= '9')
+            g_json.number = (uint16_t)(g_json.number * 10 + (c - '0'));
+        break;
     }
-    return true;
 }
 
-static bool json_get_string(const char *json, const char *key, char *out, size_t out_len)
+static void channel_close(void)
 {
-    char pat[32];
-    const char *p;
-    size_t i;
+    if (g_channel_open)
+        network_close(LOBBY_UNIT);
+    g_channel_open = false;
+}
 
-    snprintf(pat, sizeof(pat), "\"%s\"", key);
-    p = strstr(json, pat);
-    if (!p)
-        return false;
-    p = strchr(p, ':');
-    if (!p)
-        return false;
-    p++;
-    while (*p && (*p == ' ' || *p == '\t'))
-        p++;
-    if (*p != '"')
-        return false;
-    p++;
-    i = 0;
-    while (*p && *p != '"' && i + 1 < out_len)
-        out[i++] = *p++;
-    out[i] = '\0';
-    return *p == '"';
+/* Makes sure N1 holds a TCP connection to the lobby, reopening it if the
+ * server has closed it since the last reply. */
+static bool channel_ready(void)
+{
+    uint16_t waiting;
+    uint8_t connected = 0;
+    uint8_t error;
+
+    if (g_channel_open && (network_status(LOBBY_UNIT, &waiting, &connected, &error) != 0 || !connected))
+        channel_close();
+    if (g_channel_open)
+        return true;
+    snprintf(g_line, sizeof(g_line), LOBBY_UNIT "TCP://%s:%s/", g_state.cfg.lobby_host, g_state.cfg.lobby_port);
+    /* Mode 12 is read/write. */
+    g_channel_open = (network_open(g_line, 12, 0) == 0);
+    return g_channel_open;
 }
 
-static bool json_get_int(const char *json, const char *key, int *out)
+/* Drops the request in flight. Its reply could still arrive and be taken
+ * for the next one, so the channel goes with it. */
+static void request_abort(void)
 {
-    char pat[32];
-    const char *p;
+    if (g_req.state == REQ_READING)
+        channel_close();
+    g_req.kind = REQ_NONE;
+    g_req.state = REQ_IDLE;
+}
 
-    snprintf(pat, sizeof(pat), "\"%s\"", key);
-    p = strstr(json, pat);
-    if (!p)
-        return false;
-    p = strchr(p, ':');
-    if (!p)
-        return false;
-    p++;
-    while (*p && (*p == ' ' || *p == '\t'))
-        p++;
-    *out = atoi(p);
-    return true;
+/* Sends a lobby request for the path printf-formatted from format over
+ * the channel, dropping any request still in flight. The reply is parsed
+ * into g_reply (and g_games for a list) by request_poll(), and a request
+ * that cannot be sent is reported there too. The server keeps the
+ * connection open after replying, so a request costs one round trip. */
+static void request_start(RequestKind kind, const char *format, ...)
+{
+    va_list args;
+    int used;
+
+    request_abort();
+    memset(&g_req, 0, sizeof(g_req));
+    memset(&g_json, 0, sizeof(g_json));
+    memset(&g_reply, 0, sizeof(g_reply));
+    g_req.kind = kind;
+    g_req.length = REQ_LENGTH_UNKNOWN;
+    render();
+    g_req.started = rtclok_now();
+    g_req.state = REQ_FAILED;
+    if (!channel_ready())
+        return;
+
+    strcpy(g_line, "GET ");
+    va_start(args, format);
+    used = 4 + vsnprintf(g_line + 4, sizeof(g_line) - 4, format, args);
+    va_end(args);
+    if (used < (int)sizeof(g_line))
+        used += snprintf(g_line + used, sizeof(g_line) - used, " HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+    if (used >= (int)sizeof(g_line) || network_write(LOBBY_UNIT, (uint8_t *)g_line, (uint16_t)used) != 0)
+    {
+        channel_close();
+        return;
+    }
+    g_req.state = REQ_READING;
 }
 
-static bool json_get_bool(const char *json, const char *key, bool *out)
+static bool request_busy(void)
 {
-    char pat[32];
-    const char *p;
+    return g_req.state == REQ_READING;
+}
 
-    snprintf(pat, sizeof(pat), "\"%s\"", key);
-    p = strstr(json, pat);
-    if (!p)
-        return false;
-    p = strchr(p, ':');
-    if (!p)
-        return false;
-    p++;
-    while (*p && (*p == ' ' || *p == '\t'))
-        p++;
-    if (strncmp(p, "true", 4) == 0)
+/* True while a request the user asked for (hello, join, create, leave) is
+ * in flight, as opposed to a periodic refresh. */
+static bool request_pending(void)
+{
+    return request_busy() && g_req.kind != REQ_LIST && g_req.kind != REQ_PING && g_req.kind != REQ_WAIT;
+}
+
+/* Drops a periodic refresh so the screen can change under it. Returns
+ * false if a request the user asked for is still in flight. */
+static bool request_yield(void)
+{
+    if (request_busy() && !request_pending())
     {
-        *out = true;
-        return true;
+        if (g_req.kind == REQ_LIST)
+            g_last_refresh = 0;
+        else if (g_req.kind == REQ_WAIT)
+            g_last_wait_poll = 0;
+        request_abort();
     }
-    if (strncmp(p, "false", 5) == 0)
+    return !request_busy();
+}
+
+/* Takes one byte of the response headers. Only the status line and
+ * Content-Length are kept; each line is looked at when it ends. */
+static void header_feed(char c)
+{
+    static const char name[] = "content-length:";
+    uint8_t i;
+
+    if (c == '\r')
+        return;
+    if (c != '\n')
     {
-        *out = false;
-        return true;
+        if (g_req.line_len < HEADER_LINE_MAX)
+            g_req.line[g_req.line_len++] = c;
+        return;
     }
-    return false;
+
+    g_req.line[g_req.line_len] = '\0';
+    if (g_req.line_len == 0)
+    {
+        g_req.headers = false;
+        return;
+    }
+    g_req.line_len = 0;
+
+    if (g_req.status == 0 && strncmp(g_req.line, "HTTP/", 5) == 0)
+    {
+        for (i = 5; g_req.line[i] && g_req.line[i] != ' '; ++i)
+            ;
+        g_req.status = (uint16_t)atoi(g_req.line + i);
+        return;
+    }
+    for (i = 0; name[i]; ++i)
+    {
+        if (tolower((unsigned char)g_req.line[i]) != name[i])
+            return;
+    }
+    g_req.length = (uint16_t)atoi(g_req.line + i);
 }
 
-static uint8_t parse_games_list(const char *json, GameEntry *out, uint8_t max_out)
+/* Consumes the n bytes just read into g_line and returns true once the
+ * reply is complete. */
+static bool request_feed(uint16_t n)
 {
-    uint8_t count = 0;
+    uint16_t i;
 
-    g_p = strstr(json, "\"games\"");
-    if (!g_p)
-        return 0;
-    g_p = strchr(g_p, '[');
-    if (!g_p)
-        return 0;
-    g_p++;
-    while (*g_p && count < max_out)
+    for (i = 0; i < n; ++i)
+    {
+        if (g_req.headers)
+        {
+            header_feed(g_line[i]);
+            continue;
+        }
+        if (g_req.length != REQ_LENGTH_UNKNOWN)
+        {
+            if (g_req.received >= g_req.length)
+                return true;
+            ++g_req.received;
+            json_feed(g_line[i]);
+            continue;
+        }
+        json_feed(g_line[i]);
+        if (g_json.done)
+            return true;
+    }
+    return !g_req.headers && g_req.length != REQ_LENGTH_UNKNOWN && g_req.received >= g_req.length;
+}
+
+/* Reads and consumes whatever part of the response has arrived, without
+ * waiting. The request is done as soon as the reply is complete. A reply
+ * that stops short fails with truncated set, and one that sends nothing
+ * for REQUEST_TIMEOUT_TICKS fails without it. */
+static void request_poll(void)
+{
+    int16_t r;
+    bool complete = false;
+
+    if (g_req.state != REQ_READING)
+        return;
+
+    r = network_read_nb(LOBBY_UNIT, (uint8_t *)g_line, (uint16_t)sizeof(g_line));
+    if (r > 0)
+    {
+        if (!g_req.replied)
+        {
+            g_req.replied = true;
+            g_req.headers = (g_line[0] == 'H');
+        }
+        g_req.started = rtclok_now();
+        complete = request_feed((uint16_t)r);
+        if (!complete)
+            return;
+    }
+    else if (r == 0 && rtclok_diff(rtclok_now(), g_req.started) < REQUEST_TIMEOUT_TICKS)
+    {
+        return;
+    }
+
+    /* A reply cut short leaves the channel out of step. */
+    if (!complete)
+        channel_close();
+    json_bare_done();
+    if (complete && (g_req.status == 0 || (g_req.status >= 200 && g_req.status < 300)))
     {
-        g_idp = strstr(g_p, "\"id\"");
-        if (!g_idp)
-            break;
-        g_obj_start = g_idp;
-        g_obj_end = strchr(g_obj_start, '}');
-        if (!g_obj_end)
-            break;
-
-        g_id[0] = '\0';
-        g_name_buf[0] = '\0';
-        g_players = 0;
-        g_max_players = 0;
-        g_active = false;
-
-        g_slice_len = (size_t)(g_obj_end - g_obj_start + 1);
-        if (g_slice_len >= sizeof(g_slice))
-            g_slice_len = sizeof(g_slice) - 1;
-        memcpy(g_slice, g_obj_start, g_slice_len);
-        g_slice[g_slice_len] = '\0';
-
-        json_get_string(g_slice, "id", g_id, sizeof(g_id));
-        json_get_string(g_slice, "name", g_name_buf, sizeof(g_name_buf));
-        json_get_int(g_slice, "players", &g_players);
-        json_get_int(g_slice, "max", &g_max_players);
-        json_get_bool(g_slice, "active", &g_active);
-
-        snprintf(out[count].id, sizeof(out[count].id), "%s", g_id);
-        snprintf(out[count].name, sizeof(out[count].name), "%s", g_name_buf[0] ? g_name_buf : "Game");
-        out[count].players = (uint8_t)g_players;
-        out[count].max_players = (uint8_t)g_max_players;
-        out[count].active = g_active;
-        count++;
-
-        g_p = g_obj_end + 1;
+        g_req.state = REQ_DONE;
+        return;
     }
-    return count;
+    g_req.truncated = !complete && g_req.replied;
+    g_req.state = REQ_FAILED;
 }
 
 static bool parse_port(const char *text, uint16_t *out_port)
@@ -722,6 +1272,284 @@ static void appkey_save_player_name(const char *name)
     fuji_write_appkey(TOKEN_KEY_ID, (uint16_t)(len + 1), data);
 }
 
+/* Sets how many games the list holds, redrawing the rows that appear or
+ * go. */
+static void list_set_count(uint8_t count)
+{
+    uint8_t was = g_game_count;
+
+    g_game_count = count;
+    for (; was < count; ++was)
+        mark_row((uint8_t)(LIST_FIRST_ROW + was));
+    for (; was > count; --was)
+        mark_row((uint8_t)(LIST_FIRST_ROW + was - 1));
+    if (g_selected >= count)
+        list_select(0);
+    if (g_state.screen == SCREEN_LIST)
+        set_list_status();
+}
+
+/* Drops list slot i, keeping the selection on the same game. */
+static void list_remove(uint8_t i)
+{
+    if (i < g_selected)
+        list_select((uint8_t)(g_selected - 1));
+    for (; i + 1 < g_game_count; ++i)
+    {
+        g_games[i] = g_games[i + 1];
+        mark_row((uint8_t)(LIST_FIRST_ROW + i));
+    }
+    list_set_count((uint8_t)(g_game_count - 1));
+}
+
+/* True on the wait screen, or on help shown from it. */
+static bool waiting(void)
+{
+    return g_state.screen == SCREEN_WAIT || (g_state.screen == SCREEN_HELP && g_state.prev_screen == SCREEN_WAIT);
+}
+
+/* The game being waited for has gone: back to the list. */
+static void wait_lost(void)
+{
+    g_state.screen = SCREEN_LIST;
+    strncpy(g_state.status, "Game timed out.", sizeof(g_state.status) - 1);
+    g_last_refresh = 0;
+    draw_list_screen();
+}
+
+static void events_close(void)
+{
+    if (g_events.open)
+        network_close(EVENTS_UNIT);
+    g_events.open = false;
+}
+
+/* Hands the game server named in the start command in g_reply to
+ * NetStream and boots the game. Does not return. */
+static void lobby_start(void)
+{
+    strcpy(g_state.start_host, g_reply.host);
+    g_state.start_port = g_reply.port;
+    channel_close();
+    events_close();
+
+    show_layout(&g_start_layout);
+    set_status("");
+    render();
+    if (start_netstream(g_state.start_host, g_state.start_port))
+    {
+        set_status("Done!");
+        render();
+#ifdef DISK
+        OS.vvblki = saveVVBLKI;
+        exit(0);
+#else
+        atari_reset_warm();
+#endif
+    }
+    else
+    {
+        set_status("NetStream failed");
+        render();
+        exit(1);
+    }
+}
+
+static void swap_bytes(void *a, void *b, uint16_t n)
+{
+    uint8_t *x = (uint8_t *)a;
+    uint8_t *y = (uint8_t *)b;
+    uint8_t t;
+
+    while (n--)
+    {
+        t = *x;
+        *x++ = *y;
+        *y++ = t;
+    }
+}
+
+/* Swaps the tokenizer and reply of the request with the stream's. */
+static void events_swap(void)
+{
+    swap_bytes(&g_json, &g_events.json, sizeof(g_json));
+    swap_bytes(&g_reply, &g_events.reply, sizeof(g_reply));
+}
+
+static void events_next_line(void)
+{
+    memset(&g_json, 0, sizeof(g_json));
+    memset(&g_reply, 0, sizeof(g_reply));
+    g_json.events = true;
+}
+
+/* Applies the event line just parsed. While the stream is syncing, the
+ * current games fill the list from the top and "synced" ends it. After
+ * that, games are matched by id. */
+static void events_apply(void)
+{
+    GameEntry *e = &g_json.entry;
+    uint8_t i;
+
+    if (g_reply.error[0])
+    {
+        /* A lobby without /events calls it unknown. */
+        g_events.unsupported = (strcmp(g_reply.error, "unknown") == 0);
+        events_close();
+        return;
+    }
+    if (strcmp(g_reply.cmd, "start") == 0)
+        lobby_start();
+    if (strcmp(g_reply.cmd, "synced") == 0)
+    {
+        g_events.syncing = false;
+        list_set_count(g_events.count);
+        return;
+    }
+    if (!e->id[0])
+        return;
+    if (g_events.syncing)
+    {
+        if (g_events.count < MAX_GAMES && strcmp(g_reply.cmd, "game") == 0)
+            list_store(g_events.count++, e);
+        return;
+    }
+
+    for (i = 0; i < g_game_count && strcmp(g_games[i].id, e->id) != 0; ++i)
+        ;
+    if (strcmp(g_reply.cmd, "gone") == 0)
+    {
+        if (i < g_game_count)
+            list_remove(i);
+        if (waiting() && strcmp(e->id, g_state.current_game_id) == 0)
+            wait_lost();
+        return;
+    }
+    if (strcmp(g_reply.cmd, "players") == 0 && i < g_game_count)
+    {
+        g_games[i].players = e->players;
+        g_games[i].max_players = e->max_players;
+        mark_row((uint8_t)(LIST_FIRST_ROW + i));
+    }
+    else if (strcmp(g_reply.cmd, "game") == 0 && i < MAX_GAMES)
+    {
+        list_store(i, e);
+        if (i == g_game_count)
+            list_set_count((uint8_t)(i + 1));
+    }
+    if ((waiting() || g_req.kind == REQ_JOIN) && strcmp(e->id, g_state.current_game_id) == 0 &&
+        (g_wait_players != e->players || g_wait_max != e->max_players))
+    {
+        g_wait_players = e->players;
+        g_wait_max = e->max_players;
+        if (g_state.screen == SCREEN_WAIT)
+            mark_row(WAIT_PLAYERS_ROW);
+    }
+}
+
+/* Subscribes to /events on N2. If that fails, polling carries on and the
+ * stream is tried again after LIST_REFRESH_TICKS. */
+static void events_open(void)
+{
+    int used;
+
+    g_events.opened = rtclok_now();
+    g_events.heard = g_events.opened;
+    g_events.headers = true;
+    g_events.blank = false;
+    g_events.syncing = true;
+    g_events.count = 0;
+    memset(&g_events.json, 0, sizeof(g_events.json));
+    memset(&g_events.reply, 0, sizeof(g_events.reply));
+    g_events.json.events = true;
+
+    snprintf(g_line, sizeof(g_line), EVENTS_UNIT "TCP://%s:%s/", g_state.cfg.lobby_host, g_state.cfg.lobby_port);
+    if (network_open(g_line, 12, 0) != 0)
+        return;
+    g_events.open = true;
+    used = snprintf(g_line, sizeof(g_line), "GET /events?client_id=%s HTTP/1.0\r\n\r\n", g_state.client_id);
+    if (used >= (int)sizeof(g_line) || network_write(EVENTS_UNIT, (uint8_t *)g_line, (uint16_t)used) != 0)
+        events_close();
+}
+
+/* Reads and applies whatever the stream has sent, without waiting. A
+ * quiet stream is checked every HEARTBEAT_TICKS and closed once the lobby
+ * has gone, and one that does not get through the current games within
+ * REQUEST_TIMEOUT_TICKS is given up, so polling takes over. */
+static void events_poll(void)
+{
+    int16_t r;
+    int16_t i;
+    uint32_t now = rtclok_now();
+    uint16_t waiting_bytes;
+    uint8_t connected = 0;
+    uint8_t error;
+    char c;
+
+    r = network_read_nb(EVENTS_UNIT, (uint8_t *)g_line, (uint16_t)sizeof(g_line));
+    if (r < 0)
+    {
+        events_close();
+        return;
+    }
+    if (r == 0)
+    {
+        if (g_events.syncing && rtclok_diff(now, g_events.heard) >= REQUEST_TIMEOUT_TICKS)
+        {
+            events_close();
+        }
+        else if (rtclok_diff(now, g_events.heard) >= HEARTBEAT_TICKS)
+        {
+            g_events.heard = now;
+            if (network_status(EVENTS_UNIT, &waiting_bytes, &connected, &error) != 0 || !connected)
+                events_close();
+        }
+        return;
+    }
+
+    g_events.heard = now;
+    events_swap();
+    for (i = 0; i < r && g_events.open; ++i)
+    {
+        c = g_line[i];
+        if (g_events.headers)
+        {
+            if (c == '\n')
+            {
+                g_events.headers = !g_events.blank;
+                g_events.blank = true;
+            }
+            else if (c != '\r')
+            {
+                g_events.blank = false;
+            }
+            continue;
+        }
+        json_feed(c);
+        if (g_json.done)
+        {
+            events_apply();
+            events_next_line();
+        }
+    }
+    events_swap();
+}
+
+/* Keeps the stream open while the list or wait screen is up. */
+static void events_service(void)
+{
+    if (g_events.open)
+    {
+        events_poll();
+        return;
+    }
+    if (g_events.unsupported || request_busy() ||
+        (g_state.screen != SCREEN_LIST && g_state.screen != SCREEN_WAIT))
+        return;
+    if (g_events.opened == 0 || rtclok_diff(rtclok_now(), g_events.opened) >= LIST_REFRESH_TICKS)
+        events_open();
+}
+
 int main(void)
 {
     bool has_saved_name = false;
@@ -744,6 +1572,7 @@ int main(void)
     saveVVBLKI = OS.vvblki;
     OS.vvblki = (void (*)(void))0xE45F;
     OS.sdmctl = 0x22;
+    g_screen = OS.savmsc;
 
     if (has_saved_name)
     {
@@ -758,9 +1587,123 @@ int main(void)
 
     while (1)
     {
+        render();
+        request_poll();
+        if (g_req.state == REQ_DONE || g_req.state == REQ_FAILED)
+        {
+            bool ok = (g_req.state == REQ_DONE);
+            RequestKind kind = g_req.kind;
+            g_req.kind = REQ_NONE;
+            g_req.state = REQ_IDLE;
+
+            if (g_req.truncated && (kind == REQ_HELLO || kind == REQ_LIST || kind == REQ_JOIN || kind == REQ_CREATE))
+            {
+                if (kind == REQ_HELLO && g_state.screen == SCREEN_CONFIG)
+                    draw_config_screen(&g_state);
+                set_status("Lobby reply truncated");
+                continue;
+            }
+
+            if (kind == REQ_HELLO && g_state.screen == SCREEN_CONFIG)
+            {
+                if (!ok)
+                {
+                    set_status("Lobby connect failed");
+                    draw_config_screen(&g_state);
+                    continue;
+                }
+                if (!g_reply.id[0] && !g_batch_unsupported && !g_json.batch)
+                {
+                    /* A lobby without /batch answers with a lone error:
+                     * say hello on its own, then list. */
+                    g_batch_unsupported = true;
+                    request_start(REQ_HELLO, "/hello?name=%s", g_url);
+                    continue;
+                }
+                if (!g_reply.id[0])
+                {
+                    set_status("Lobby response bad");
+                    draw_config_screen(&g_state);
+                    continue;
+                }
+                strcpy(g_state.client_id, g_reply.id);
+                g_events.unsupported = false;
+                g_events.opened = 0;
+
+                g_state.screen = SCREEN_LIST;
+                g_selected = 0;
+                list_set_count(g_reply.game_count);
+                g_last_refresh = g_batch_unsupported ? 0 : rtclok_now();
+                draw_list_screen();
+            }
+            else if (kind == REQ_LIST && g_state.screen == SCREEN_LIST && ok)
+            {
+                list_set_count(g_reply.game_count);
+            }
+            else if (kind == REQ_JOIN && g_state.screen == SCREEN_LIST)
+            {
+                if (!ok)
+                {
+                    set_status("Join failed");
+                    continue;
+                }
+                g_state.screen = SCREEN_WAIT;
+                draw_wait_screen();
+                g_last_heartbeat = rtclok_now();
+                g_last_wait_poll = 0;
+            }
+            else if (kind == REQ_CREATE && g_state.screen == SCREEN_CREATE)
+            {
+                if (!ok)
+                {
+                    set_status("Create failed");
+                    continue;
+                }
+                strcpy(g_state.current_game_id, g_reply.id);
+                snprintf(g_state.current_game_name, sizeof(g_state.current_game_name), "%s", g_game_name);
+                g_wait_players = 1;
+                g_wait_max = (uint8_t)atoi(g_game_max);
+                g_state.screen = SCREEN_WAIT;
+                draw_wait_screen();
+                g_last_heartbeat = rtclok_now();
+                g_last_wait_poll = 0;
+            }
+            else if (kind == REQ_WAIT && g_state.screen == SCREEN_WAIT && ok)
+            {
+                if (strcmp(g_reply.error, "not_found") == 0)
+                {
+                    wait_lost();
+                    continue;
+                }
+                if (strcmp(g_reply.cmd, "start") == 0)
+                    lobby_start();
+                if (g_reply.has_players && g_reply.has_max &&
+                    (g_wait_players != g_reply.players || g_wait_max != g_reply.max_players))
+                {
+                    g_wait_players = g_reply.players;
+                    g_wait_max = g_reply.max_players;
+                    mark_row(WAIT_PLAYERS_ROW);
+                }
+            }
+            continue;
+        }
+
+        events_service();
         if (g_state.screen == SCREEN_CONFIG)
         {
+            if (!kbhit())
+                continue;
             g_key = cgetc();
+            if (request_pending())
+            {
+                if (g_key == CH_ESC)
+                {
+                    request_abort();
+                    set_status("Cancelled");
+                    draw_config_screen(&g_state);
+                }
+                continue;
+            }
             if ((g_key == 'h' || g_key == 'H' || g_key == KEY_HELP) && g_state.focus == 3)
             {
                 g_state.prev_screen = g_state.screen;
@@ -770,14 +1713,12 @@ int main(void)
             }
             if (g_key == CH_TAB || g_key == CH_CURS_DOWN || g_key == CH_CURS_RIGHT)
             {
-                g_state.focus = (g_state.focus + 1) % 4;
-                draw_config_screen(&g_state);
+                set_focus((g_state.focus + 1) % 4, CONFIG_FOCUS_ROW);
                 continue;
             }
             if (g_key == CH_CURS_UP || g_key == CH_CURS_LEFT)
             {
-                g_state.focus = (g_state.focus == 0) ? 3 : (g_state.focus - 1);
-                draw_config_screen(&g_state);
+                set_focus((g_state.focus == 0) ? 3 : (g_state.focus - 1), CONFIG_FOCUS_ROW);
                 continue;
             }
 
@@ -785,13 +1726,12 @@ int main(void)
             {
                 if (g_key == CH_ENTER)
                 {
-                    g_state.focus = 1;
-                    draw_config_screen(&g_state);
+                    set_focus(1, CONFIG_FOCUS_ROW);
                 }
                 else
                 {
                     handle_text_input(g_state.cfg.lobby_host, sizeof(g_state.cfg.lobby_host), g_key, false);
-                    draw_field_value(8, 2, g_state.cfg.lobby_host, FIELD_WIDTH_HOST);
+                    mark_row(2);
                 }
                 continue;
             }
@@ -799,13 +1739,12 @@ int main(void)
             {
                 if (g_key == CH_ENTER)
                 {
-                    g_state.focus = 2;
-                    draw_config_screen(&g_state);
+                    set_focus(2, CONFIG_FOCUS_ROW);
                 }
                 else
                 {
                     handle_text_input(g_state.cfg.lobby_port, sizeof(g_state.cfg.lobby_port), g_key, true);
-                    draw_field_value(8, 4, g_state.cfg.lobby_port, FIELD_WIDTH_PORT);
+                    mark_row(4);
                 }
                 continue;
             }
@@ -813,13 +1752,12 @@ int main(void)
             {
                 if (g_key == CH_ENTER)
                 {
-                    g_state.focus = 3;
-                    draw_config_screen(&g_state);
+                    set_focus(3, CONFIG_FOCUS_ROW);
                 }
                 else
                 {
                     handle_text_input(g_state.cfg.player_name, sizeof(g_state.cfg.player_name), g_key, true);
-                    draw_field_value(8, 6, g_state.cfg.player_name, FIELD_WIDTH_NAME);
+                    mark_row(6);
                 }
                 continue;
             }
@@ -850,53 +1788,39 @@ int main(void)
                     continue;
                 }
 
-                clrscr();
-                cprintf("Connecting lobby...");
-                draw_netstream_warning();
+                show_layout(&g_connect_layout);
+                set_status("\xC5\xD3\xC3=Cancel");
 
                 url_encode(g_state.cfg.player_name, g_url, sizeof(g_url));
-                snprintf(g_line, sizeof(g_line), "/hello?name=%s", g_url);
-                if (!http_get_json(g_line, g_line, sizeof(g_line)))
-                {
-                    set_status("Lobby connect failed");
-                    draw_config_screen(&g_state);
-                    continue;
-                }
-                if (!json_get_string(g_line, "client_id", g_state.client_id, sizeof(g_state.client_id)))
-                {
-                    set_status("Lobby response bad");
-                    draw_config_screen(&g_state);
-                    continue;
-                }
-
-                g_state.screen = SCREEN_LIST;
-                g_last_refresh = 0;
-                g_selected = 0;
-                draw_list_screen(g_games, g_game_count, g_selected);
+                g_batch_unsupported = false;
+                request_start(REQ_HELLO, "/batch?ops=hello,list&name=%s", g_url);
                 continue;
             }
         }
         else if (g_state.screen == SCREEN_LIST)
         {
             g_now = rtclok_now();
-            if (g_last_refresh == 0 || rtclok_diff(g_now, g_last_refresh) >= LIST_REFRESH_TICKS)
+            if (!g_events.open && !request_busy() && (g_last_refresh == 0 || rtclok_diff(g_now, g_last_refresh) >= LIST_REFRESH_TICKS))
             {
-                snprintf(g_line, sizeof(g_line), "/list?client_id=%s", g_state.client_id);
-                if (http_get_json(g_line, g_line, sizeof(g_line)))
-                {
-                    g_game_count = parse_games_list(g_line, g_games, MAX_GAMES);
-                    if (g_selected >= g_game_count)
-                        g_selected = 0;
-                    draw_list_screen(g_games, g_game_count, g_selected);
-                }
+                request_start(REQ_LIST, "/list?client_id=%s", g_state.client_id);
                 g_last_refresh = g_now;
             }
 
             if (!kbhit())
                 continue;
             g_key = cgetc();
+            if (request_pending())
+            {
+                if (g_key == CH_ESC && g_req.kind == REQ_JOIN)
+                {
+                    request_abort();
+                    set_status("Cancelled");
+                }
+                continue;
+            }
             if (g_key == 'h' || g_key == 'H' || g_key == KEY_HELP)
             {
+                request_yield();
                 g_state.prev_screen = g_state.screen;
                 g_state.screen = SCREEN_HELP;
                 draw_help_screen();
@@ -904,45 +1828,43 @@ int main(void)
             }
             if (g_key == 'r' || g_key == 'R')
             {
+                /* With the stream open, a fresh one resends every game. */
+                events_close();
+                g_events.opened = 0;
                 g_last_refresh = 0;
                 continue;
             }
             if (g_key == 'c' || g_key == 'C')
             {
+                request_yield();
                 g_state.screen = SCREEN_CREATE;
                 g_state.focus = 0;
                 strncpy(g_state.status, "Enter game settings", sizeof(g_state.status) - 1);
-                draw_create_screen(&g_state, g_game_name, g_game_max, g_state.focus);
+                draw_create_screen(&g_state);
                 continue;
             }
             if (g_key == CH_TAB)
             {
                 if (g_game_count > 0)
-                {
-                    if (g_selected + 1 < g_game_count)
-                        g_selected++;
-                    else
-                        g_selected = 0;
-                }
-                draw_list_screen(g_games, g_game_count, g_selected);
+                    list_select((g_selected + 1 < g_game_count) ? (uint8_t)(g_selected + 1) : 0);
                 continue;
             }
             if (g_key == CH_CURS_UP)
             {
                 if (g_selected > 0)
-                    g_selected--;
-                draw_list_screen(g_games, g_game_count, g_selected);
+                    list_select((uint8_t)(g_selected - 1));
                 continue;
             }
             if (g_key == CH_CURS_DOWN)
             {
                 if (g_selected + 1 < g_game_count)
-                    g_selected++;
-                draw_list_screen(g_games, g_game_count, g_selected);
+                    list_select((uint8_t)(g_selected + 1));
                 continue;
             }
             if (g_key == CH_ESC)
             {
+                request_yield();
+                events_close();
                 g_state.screen = SCREEN_CONFIG;
                 draw_config_screen(&g_state);
                 continue;
@@ -954,25 +1876,33 @@ int main(void)
                     set_status("Game is full.");
                     continue;
                 }
-                snprintf(g_line, sizeof(g_line), "/join?client_id=%s&game_id=%s", g_state.client_id,
-                         g_games[g_selected].id);
-                if (http_get_json(g_line, g_line, sizeof(g_line)))
-                {
-                    snprintf(g_state.current_game_id, sizeof(g_state.current_game_id), "%s", g_games[g_selected].id);
-                    snprintf(g_state.current_game_name, sizeof(g_state.current_game_name), "%s", g_games[g_selected].name);
-                    g_wait_players = g_games[g_selected].players;
-                    g_wait_max = g_games[g_selected].max_players;
-                    g_state.screen = SCREEN_WAIT;
-                    draw_wait_screen(g_state.current_game_name, g_wait_players, g_wait_max);
-                    g_last_heartbeat = rtclok_now();
-                    g_last_wait_poll = 0;
-                }
+                request_yield();
+                /* Taken now: events may move or drop the row before the
+                 * join comes back. */
+                strcpy(g_state.current_game_id, g_games[g_selected].id);
+                strcpy(g_state.current_game_name, g_games[g_selected].name);
+                g_wait_players = g_games[g_selected].players;
+                g_wait_max = g_games[g_selected].max_players;
+                set_status("Joining...");
+                request_start(REQ_JOIN, "/join?client_id=%s&game_id=%s", g_state.client_id,
+                              g_state.current_game_id);
                 continue;
             }
         }
         else if (g_state.screen == SCREEN_CREATE)
         {
+            if (!kbhit())
+                continue;
             g_key = cgetc();
+            if (request_pending())
+            {
+                if (g_key == CH_ESC && g_req.kind == REQ_CREATE)
+                {
+                    request_abort();
+                    set_status("Cancelled");
+                }
+                continue;
+            }
             if ((g_key == 'h' || g_key == 'H' || g_key == KEY_HELP) && g_state.focus >= 2)
             {
                 g_state.prev_screen = g_state.screen;
@@ -982,27 +1912,24 @@ int main(void)
             }
             if (g_key == CH_TAB || g_key == CH_CURS_DOWN || g_key == CH_CURS_RIGHT)
             {
-                g_state.focus = (g_state.focus + 1) % 4;
-                draw_create_screen(&g_state, g_game_name, g_game_max, g_state.focus);
+                set_focus((g_state.focus + 1) % 4, CREATE_FOCUS_ROW);
                 continue;
             }
             if (g_key == CH_CURS_UP || g_key == CH_CURS_LEFT)
             {
-                g_state.focus = (g_state.focus == 0) ? 3 : (g_state.focus - 1);
-                draw_create_screen(&g_state, g_game_name, g_game_max, g_state.focus);
+                set_focus((g_state.focus == 0) ? 3 : (g_state.focus - 1), CREATE_FOCUS_ROW);
                 continue;
             }
             if (g_state.focus == 0)
             {
                 if (g_key == CH_ENTER)
                 {
-                    g_state.focus = 1;
-                    draw_create_screen(&g_state, g_game_name, g_game_max, g_state.focus);
+                    set_focus(1, CREATE_FOCUS_ROW);
                 }
                 else
                 {
                     handle_text_input(g_game_name, sizeof(g_game_name), g_key, false);
-    draw_field_value(8, 4, g_game_name, FIELD_WIDTH_GAME);
+                    mark_row(4);
                 }
                 continue;
             }
@@ -1010,38 +1937,27 @@ int main(void)
             {
                 if (g_key == CH_ENTER)
                 {
-                    g_state.focus = 2;
-                    draw_create_screen(&g_state, g_game_name, g_game_max, g_state.focus);
+                    set_focus(2, CREATE_FOCUS_ROW);
                 }
                 else
                 {
                     handle_text_input(g_game_max, sizeof(g_game_max), g_key, true);
-                    draw_field_value(15, 6, g_game_max, 2);
+                    mark_row(6);
                 }
                 continue;
             }
             if (g_state.focus == 2 && g_key == CH_ENTER)
             {
+                set_status("Creating...");
                 url_encode(g_game_name, g_url, sizeof(g_url));
-                snprintf(g_line, sizeof(g_line), "/create?client_id=%s&name=%s&max_players=%s",
-                         g_state.client_id, g_url, g_game_max);
-                if (http_get_json(g_line, g_line, sizeof(g_line)))
-                {
-                    json_get_string(g_line, "game_id", g_state.current_game_id, sizeof(g_state.current_game_id));
-                    snprintf(g_state.current_game_name, sizeof(g_state.current_game_name), "%s", g_game_name);
-                    g_wait_players = 1;
-                    g_wait_max = (uint8_t)atoi(g_game_max);
-                    g_state.screen = SCREEN_WAIT;
-                    draw_wait_screen(g_state.current_game_name, g_wait_players, g_wait_max);
-                    g_last_heartbeat = rtclok_now();
-                    g_last_wait_poll = 0;
-                }
+                request_start(REQ_CREATE, "/create?client_id=%s&name=%s&max_players=%s",
+                              g_state.client_id, g_url, g_game_max);
                 continue;
             }
             if (g_state.focus == 3 && g_key == CH_ENTER)
             {
                 g_state.screen = SCREEN_LIST;
-                draw_list_screen(g_games, g_game_count, g_selected);
+                draw_list_screen();
                 continue;
             }
         }
@@ -1053,6 +1969,7 @@ int main(void)
                 g_key = cgetc();
                 if (g_key == 'h' || g_key == 'H' || g_key == KEY_HELP)
                 {
+                    request_yield();
                     g_state.prev_screen = g_state.screen;
                     g_state.screen = SCREEN_HELP;
                     draw_help_screen();
@@ -1060,73 +1977,47 @@ int main(void)
                 }
                 if (g_key == CH_ESC)
                 {
-                    snprintf(g_line, sizeof(g_line), "/leave?client_id=%s&game_id=%s",
-                             g_state.client_id, g_state.current_game_id);
-                    http_get_json(g_line, g_line, sizeof(g_line));
+                    /* The leave reply is not needed, so the list shows at once. */
+                    request_start(REQ_LEAVE, "/leave?client_id=%s&game_id=%s",
+                                  g_state.client_id, g_state.current_game_id);
                     g_state.screen = SCREEN_LIST;
-                    draw_list_screen(g_games, g_game_count, g_selected);
+                    draw_list_screen();
                     continue;
                 }
             }
 
-            if (rtclok_diff(g_now, g_last_heartbeat) >= HEARTBEAT_TICKS)
-            {
-                snprintf(g_line, sizeof(g_line), "/ping?client_id=%s", g_state.client_id);
-                http_get_json(g_line, g_line, sizeof(g_line));
-                g_last_heartbeat = g_now;
-            }
+            /* The stream keeps the client alive and brings the start. */
+            if (request_busy() || g_events.open)
+                continue;
 
+            /* A heartbeat that falls due rides along with the wait poll. */
             if (g_last_wait_poll == 0 || rtclok_diff(g_now, g_last_wait_poll) >= WAIT_POLL_TICKS)
             {
-            snprintf(g_line, sizeof(g_line), "/wait?client_id=%s&game_id=%s", g_state.client_id, g_state.current_game_id);
-            if (http_get_json(g_line, g_line, sizeof(g_line)))
-            {
-                if (json_get_string(g_line, "error", g_cmd, sizeof(g_cmd)) && strcmp(g_cmd, "not_found") == 0)
+                if (!g_batch_unsupported && rtclok_diff(g_now, g_last_heartbeat) >= HEARTBEAT_TICKS)
                 {
-                    g_state.screen = SCREEN_LIST;
-                    strncpy(g_state.status, "Game timed out.", sizeof(g_state.status) - 1);
-                    g_last_refresh = 0;
-                    draw_list_screen(g_games, g_game_count, g_selected);
-                    continue;
+                    request_start(REQ_WAIT, "/batch?ops=ping,wait&client_id=%s&game_id=%s",
+                                  g_state.client_id, g_state.current_game_id);
+                    g_last_heartbeat = g_now;
                 }
-                if (json_get_string(g_line, "cmd", g_cmd, sizeof(g_cmd)) && strcmp(g_cmd, "start") == 0)
-                {
-                    json_get_string(g_line, "host", g_state.start_host, sizeof(g_state.start_host));
-                    g_port = 0;
-                        json_get_int(g_line, "port", &g_port);
-                        g_state.start_port = (uint16_t)g_port;
-
-                        clrscr();
-                        cprintf("Starting game...");
-                        draw_netstream_warning();
-                    if (start_netstream(g_state.start_host, g_state.start_port))
-                    {
-                        cprintf("Done!\n");
-#ifdef DISK
-                        OS.vvblki = saveVVBLKI;
-                        return 0;
-#else
-                        atari_reset_warm();
-#endif
-                    }
-                    else
-                    {
-                        cprintf("NetStream failed\n");
-                        return 1;
-                    }
-                }
-                if (json_get_int(g_line, "players", &g_players) && json_get_int(g_line, "max", &g_max_players))
+                else
                 {
-                    g_wait_players = (uint8_t)g_players;
-                    g_wait_max = (uint8_t)g_max_players;
-                    draw_wait_screen(g_state.current_game_name, g_wait_players, g_wait_max);
+                    request_start(REQ_WAIT, "/wait?client_id=%s&game_id=%s", g_state.client_id,
+                                  g_state.current_game_id);
                 }
-            }
                 g_last_wait_poll = g_now;
+                continue;
+            }
+
+            if (rtclok_diff(g_now, g_last_heartbeat) >= HEARTBEAT_TICKS)
+            {
+                request_start(REQ_PING, "/ping?client_id=%s", g_state.client_id);
+                g_last_heartbeat = g_now;
             }
         }
         else if (g_state.screen == SCREEN_HELP)
         {
+            if (!kbhit())
+                continue;
             g_key = cgetc();
             if (g_key == CH_ESC || g_key == 'h' || g_key == 'H' || g_key == KEY_HELP)
             {
@@ -1134,11 +2025,11 @@ int main(void)
                 if (g_state.screen == SCREEN_CONFIG)
                     draw_config_screen(&g_state);
                 else if (g_state.screen == SCREEN_LIST)
-                    draw_list_screen(g_games, g_game_count, g_selected);
+                    draw_list_screen();
                 else if (g_state.screen == SCREEN_CREATE)
-                    draw_create_screen(&g_state, g_game_name, g_game_max, g_state.focus);
+                    draw_create_screen(&g_state);
                 else if (g_state.screen == SCREEN_WAIT)
-                    draw_wait_screen(g_state.current_game_name, g_wait_players, g_wait_max);
+                    draw_wait_screen();
             }
         }
     }
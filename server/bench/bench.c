@@ -0,0 +1,267 @@
+/* Timings of the server's hot paths, run on the build host.
+ *
+ * Built and run by `make bench`. main.c is compiled as is and its
+ * routines are called directly, without a lobby process. Each figure is
+ * the average wall time per call over the iterations shown. */
+
+#define main mmsrv_main
+#include "../main.c"
+#undef main
+
+#define BENCH_CHUNK 16
+#define BENCH_PORT_MIN 20000
+#define BENCH_PORTS 10000
+
+static uint64_t g_bench_start = 0;
+static volatile size_t g_bench_sink = 0;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_begin(void)
+{
+    g_bench_start = bench_now_ns();
+}
+
+static void bench_end(const char *name, unsigned long iterations, size_t bytes)
+{
+    double ns = (double)(bench_now_ns() - g_bench_start) / (double)iterations;
+
+    printf("%-34s %8lu x %9.1f ns", name, iterations, ns);
+    if (bytes)
+        printf("  %5.2f ns/byte", ns / (double)bytes);
+    printf("\n");
+}
+
+/* Parses req as serve_lobby_conn would when it arrives whole, or in
+ * chunk-byte reads with a parse after each. */
+static void bench_parse(const char *name, const char *req, size_t chunk, unsigned long iterations)
+{
+    size_t len = strlen(req);
+    HttpRequest parsed;
+
+    bench_begin();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        size_t scanned = 0;
+        size_t have = chunk ? 0 : len;
+        HttpParseResult rc;
+        do
+        {
+            if (chunk)
+                have = have + chunk < len ? have + chunk : len;
+            rc = http_parse(req, have, &scanned, &parsed);
+        } while (rc == HTTP_INCOMPLETE && have < len);
+        g_bench_sink += (size_t)parsed.param_count + scanned;
+    }
+    bench_end(name, iterations, len);
+}
+
+static void release_all_ports(void)
+{
+    for (int port = BENCH_PORT_MIN; port < BENCH_PORT_MIN + BENCH_PORTS; port++)
+        release_game_port(port);
+    g_shared->port_cursor = 0;
+}
+
+/* acquire_game_port over a BENCH_PORTS pool: filling it from empty, churn
+ * with the pool 99% full, and the worst case, where the only free port is
+ * just behind the cursor and the search wraps around the whole pool. */
+static void bench_ports(void)
+{
+    static int used[BENCH_PORTS];
+    unsigned long iterations = 0;
+    uint64_t spent = 0;
+
+    for (int round = 0; round < 20; round++)
+    {
+        release_all_ports();
+        bench_begin();
+        for (int i = 0; i < BENCH_PORTS; i++)
+            g_bench_sink += (size_t)acquire_game_port();
+        spent += bench_now_ns() - g_bench_start;
+        iterations += BENCH_PORTS;
+    }
+    /* Only the acquires count, not emptying the pool between rounds. */
+    g_bench_start = bench_now_ns() - spent;
+    bench_end("acquire_game_port, fill 10k pool", iterations, 0);
+
+    release_all_ports();
+    int held = BENCH_PORTS - BENCH_PORTS / 100;
+    for (int i = 0; i < held; i++)
+        used[i] = acquire_game_port();
+    uint32_t rng = 1;
+    bench_begin();
+    for (unsigned long i = 0; i < 1000000; i++)
+    {
+        rng = rng * 1103515245u + 12345u;
+        int k = (int)((rng >> 8) % (uint32_t)held);
+        release_game_port(used[k]);
+        used[k] = acquire_game_port();
+    }
+    bench_end("release+acquire, pool 99% full", 1000000, 0);
+
+    release_all_ports();
+    for (int i = 0; i < BENCH_PORTS; i++)
+        acquire_game_port();
+    int last = BENCH_PORT_MIN + BENCH_PORTS - 1;
+    bench_begin();
+    for (unsigned long i = 0; i < 1000000; i++)
+    {
+        release_game_port(last - 1);
+        g_shared->port_cursor = last;
+        g_bench_sink += (size_t)acquire_game_port();
+    }
+    bench_end("acquire, wrap to last free port", 1000000, 0);
+    release_all_ports();
+}
+
+static void *bench_thread_exit(void *arg)
+{
+    return arg;
+}
+
+/* What start_game_locked does before a game's port is listening. Cold:
+ * take a port, bind its listener and start a relay thread (here, one that
+ * exits at once). Prewarmed: hand the game to an idle relay whose listener
+ * is already bound. */
+static void bench_start(void)
+{
+    Game *game = &g_games[0];
+    uint64_t spent = 0;
+
+    memset(game, 0, sizeof(*game));
+    game->in_use = true;
+    for (unsigned long i = 0; i < 2000; i++)
+    {
+        bench_begin();
+        int port = acquire_game_port();
+        RelayState *rs = port < 0 ? NULL : relay_open(port, MAX_PLAYERS_LIMIT, config_acquire_locked());
+        if (!rs)
+        {
+            fprintf(stderr, "cold start: cannot listen on port %d: %s\n", port, strerror(errno));
+            return;
+        }
+        assign_worker_locked(game);
+        cpu_set_t set;
+        all_cpus(&set);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        pthread_t thread;
+        pthread_create(&thread, &attr, bench_thread_exit, NULL);
+        pthread_attr_destroy(&attr);
+        spent += bench_now_ns() - g_bench_start;
+        relay_free(rs);
+        release_game_port(port);
+    }
+    g_bench_start = bench_now_ns() - spent;
+    bench_end("start to listen, cold bind", 2000, 0);
+
+    PrewarmSlot *slot = &g_prewarm[0];
+    int port = acquire_game_port();
+    slot->rs = port < 0 ? NULL : relay_open(port, MAX_PLAYERS_LIMIT, config_acquire_locked());
+    if (!slot->rs)
+    {
+        fprintf(stderr, "prewarmed start: cannot listen on port %d: %s\n", port, strerror(errno));
+        return;
+    }
+    pthread_cond_init(&slot->cond, NULL);
+    slot->thread = pthread_self();
+    slot->port = port;
+    g_prewarm_count = 1;
+    spent = 0;
+    for (unsigned long i = 0; i < 100000; i++)
+    {
+        reserve_prewarm_port_locked(port);
+        slot->idle = true;
+        bench_begin();
+        claim_prewarmed_relay_locked(game);
+        spent += bench_now_ns() - g_bench_start;
+        config_release(slot->cfg);
+        slot->cfg = NULL;
+        slot->game = NULL;
+        atomic_store(&g_relay_starting[0], false);
+    }
+    g_bench_start = bench_now_ns() - spent;
+    bench_end("start to listen, prewarmed", 100000, 0);
+
+    g_prewarm_count = 0;
+    relay_free(slot->rs);
+    slot->rs = NULL;
+    release_game_port(port);
+    memset(game, 0, sizeof(*game));
+}
+
+/* The rate check each lobby request makes, state lock included: one
+ * address over and over, as many addresses as the table holds in turn,
+ * and a flood of new addresses that each take over a bucket. The clock
+ * moves 1 ms per call, so the expiry wheel turns as it does in use. */
+static void bench_rate(void)
+{
+    static const struct
+    {
+        const char *name;
+        uint32_t addresses; /* 0 for a new one each call */
+    } cases[] = {
+        {"rate check, one address", 1},
+        {"rate check, 1024 addresses", RATE_SETS * RATE_WAYS},
+        {"rate check, new address each", 0},
+    };
+    uint32_t now_ms = 1000;
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        memset(&g_shared->rate, 0, sizeof(g_shared->rate));
+        g_shared->rate.tick_ms = now_ms;
+        bench_begin();
+        for (uint32_t i = 0; i < 1000000; i++)
+        {
+            uint32_t ip = 0x0a000000u + (cases[c].addresses ? i % cases[c].addresses : i);
+            state_lock();
+            g_bench_sink += rate_allow_locked(ip, g_cfg->rate_ip_per_sec, g_cfg->rate_ip_burst, now_ms++);
+            state_unlock();
+        }
+        bench_end(cases[c].name, 1000000, 0);
+    }
+    memset(&g_shared->rate, 0, sizeof(g_shared->rate));
+}
+
+int main(void)
+{
+    static const char hello[] = "GET /hello?name=ALICE HTTP/1.1\r\nHost: lobby\r\n\r\n";
+    static const char wait[] = "GET /batch?ops=ping,wait&client_id=ABC12345&game_id=XYZ98765 HTTP/1.1\r\n"
+                               "Host: lobby\r\nConnection: keep-alive\r\n\r\n";
+    static const char browser[] =
+        "GET /list?client_id=ABC12345 HTTP/1.1\r\nHost: lobby.example.net:8080\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\nAccept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\nUpgrade-Insecure-Requests: 1\r\n\r\n";
+    static ServerConfig cfg;
+
+    if (!create_shared_state() || !load_config("/dev/null", &cfg))
+    {
+        fprintf(stderr, "bench setup failed: %s\n", strerror(errno));
+        return 1;
+    }
+    cfg.game_port_min = BENCH_PORT_MIN;
+    cfg.game_port_max = BENCH_PORT_MIN + BENCH_PORTS - 1;
+    atomic_init(&cfg.refs, 1);
+    g_cfg = &cfg;
+
+    bench_parse("http_parse /hello", hello, 0, 1000000);
+    bench_parse("http_parse /batch ping,wait", wait, 0, 1000000);
+    bench_parse("http_parse browser /list", browser, 0, 1000000);
+    bench_parse("http_parse browser /list, 16B", browser, BENCH_CHUNK, 1000000);
+    bench_ports();
+    bench_start();
+    bench_rate();
+
+    return 0;
+}
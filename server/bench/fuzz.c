@@ -0,0 +1,283 @@
+/* Randomized check of the incremental HTTP parser.
+ *
+ * Built and run by `make fuzz`. main.c is compiled as is. Each round
+ * makes up a request stream (well formed, malformed, pipelined, cut short
+ * or plain noise) and feeds it to http_parse the way serve_lobby_conn
+ * does: into a REQ_BUF buffer, consuming each parsed request before the
+ * next. It is fed once in whole and once split at random points, and both
+ * runs must see the same requests at the same offsets. */
+
+#define main mmsrv_main
+#include "../main.c"
+#undef main
+
+#define FUZZ_STREAM_MAX (REQ_BUF * 3)
+/* Every parse that does not ask for more consumes at least one byte. */
+#define FUZZ_MAX_EVENTS FUZZ_STREAM_MAX
+
+/* One parse that did not ask for more data. Offsets are from the start
+ * of the stream, so runs that moved their buffers differently compare. */
+typedef struct
+{
+    HttpParseResult rc;
+    size_t end;
+    size_t method[2];
+    size_t path[2];
+    int param_count;
+    size_t keys[MAX_QUERY_PARAMS][2];
+    size_t values[MAX_QUERY_PARAMS][2];
+} FuzzEvent;
+
+typedef struct
+{
+    FuzzEvent events[FUZZ_MAX_EVENTS];
+    int count;
+    size_t delivered;
+    size_t buffered;
+    bool overran; /* a parse consumed nothing, or more than was buffered */
+} FuzzRun;
+
+static uint64_t g_rng;
+
+static uint32_t rnd(uint32_t n)
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return (uint32_t)(g_rng % n);
+}
+
+static void put(char *s, size_t *len, const char *text)
+{
+    size_t n = strlen(text);
+    if (*len + n > FUZZ_STREAM_MAX)
+        n = FUZZ_STREAM_MAX - *len;
+    memcpy(s + *len, text, n);
+    *len += n;
+}
+
+static void put_token(char *s, size_t *len)
+{
+    static const char chars[] = "abcXYZ019_-.%2F+=&? \r\n";
+    int n = (int)rnd(12);
+    for (int i = 0; i < n && *len < FUZZ_STREAM_MAX; i++)
+    {
+        /* Mostly plain characters; separators and line ends now and then. */
+        size_t pick = rnd(8) ? rnd(13) : rnd(sizeof(chars) - 1);
+        s[(*len)++] = chars[pick];
+    }
+}
+
+static void put_request(char *s, size_t *len)
+{
+    static const char *const methods[] = {"GET", "POST", "", "get", "G\tET"};
+    static const char *const paths[] = {"/hello", "/list", "/batch", "/wait", "/", "", "hello", "//x"};
+    static const char *const ends[] = {"\r\n", "\n", "\r", ""};
+
+    put(s, len, methods[rnd(8) ? 0 : rnd(5)]);
+    put(s, len, rnd(16) ? " " : "  ");
+    put(s, len, paths[rnd(8)]);
+    if (rnd(4))
+    {
+        put(s, len, "?");
+        int params = (int)rnd(MAX_QUERY_PARAMS + 4);
+        for (int i = 0; i < params; i++)
+        {
+            if (i)
+                put(s, len, "&");
+            put_token(s, len);
+            if (rnd(4))
+            {
+                put(s, len, "=");
+                put_token(s, len);
+            }
+        }
+    }
+    if (rnd(8))
+        put(s, len, " HTTP/1.1");
+    const char *eol = ends[rnd(8) ? rnd(2) : rnd(4)];
+    put(s, len, eol);
+    int headers = (int)rnd(4);
+    for (int i = 0; i < headers; i++)
+    {
+        put(s, len, rnd(2) ? "Host: lobby" : "Connection: keep-alive");
+        put(s, len, eol);
+    }
+    if (rnd(8))
+        put(s, len, eol);
+}
+
+static size_t make_stream(char *s)
+{
+    size_t len = 0;
+    switch (rnd(8))
+    {
+    case 0:
+        /* Noise, heavy on line ends. */
+        len = rnd(REQ_BUF + 64);
+        for (size_t i = 0; i < len; i++)
+            s[i] = rnd(4) ? (char)rnd(256) : (rnd(2) ? '\n' : '\r');
+        return len;
+    case 1:
+        /* A request line that never ends, up to and past the buffer. */
+        put(s, &len, "GET /hello?name=");
+        while (len < REQ_BUF - 8 + rnd(16))
+            s[len++] = 'x';
+        return len;
+    default:
+        break;
+    }
+    int requests = 1 + (int)rnd(4);
+    for (int i = 0; i < requests; i++)
+        put_request(s, &len);
+    return len;
+}
+
+static void view_offsets(size_t out[2], StrView v, const char *buf, size_t base)
+{
+    out[0] = base + (size_t)(v.ptr - buf);
+    out[1] = v.len;
+}
+
+/* Feeds the stream through a REQ_BUF buffer, max_chunk bytes per read at
+ * most (0 for as much as fits), and records every parse that completes. */
+static void replay(const char *stream, size_t total, size_t max_chunk, FuzzRun *run)
+{
+    static char buf[REQ_BUF];
+    size_t len = 0;
+    size_t scanned = 0;
+    size_t base = 0;
+    size_t pos = 0;
+
+    run->count = 0;
+    run->overran = false;
+    while (pos < total && len < sizeof(buf))
+    {
+        size_t n = sizeof(buf) - len;
+        if (n > total - pos)
+            n = total - pos;
+        if (max_chunk && n > 1)
+            n = 1 + rnd((uint32_t)(n < max_chunk ? n : max_chunk));
+        memcpy(buf + len, stream + pos, n);
+        len += n;
+        pos += n;
+
+        while (1)
+        {
+            HttpRequest req;
+            HttpParseResult rc = http_parse(buf, len, &scanned, &req);
+            if (rc == HTTP_INCOMPLETE)
+                break;
+            if (scanned == 0 || scanned > len || run->count == FUZZ_MAX_EVENTS)
+            {
+                run->overran = true;
+                goto done;
+            }
+            FuzzEvent *e = &run->events[run->count++];
+            memset(e, 0, sizeof(*e));
+            e->rc = rc;
+            e->end = base + scanned;
+            if (rc == HTTP_COMPLETE)
+            {
+                view_offsets(e->method, req.method, buf, base);
+                view_offsets(e->path, req.path, buf, base);
+                e->param_count = req.param_count;
+                for (int k = 0; k < req.param_count; k++)
+                {
+                    view_offsets(e->keys[k], req.keys[k], buf, base);
+                    view_offsets(e->values[k], req.values[k], buf, base);
+                }
+            }
+            else
+            {
+                goto done;
+            }
+            len -= scanned;
+            memmove(buf, buf + scanned, len);
+            base += scanned;
+            scanned = 0;
+        }
+    }
+done:
+    run->delivered = pos;
+    run->buffered = len;
+}
+
+/* Every view of a completed request lies inside the bytes it consumed. */
+static bool run_in_bounds(const FuzzRun *run)
+{
+    size_t start = 0;
+    for (int i = 0; i < run->count; i++)
+    {
+        const FuzzEvent *e = &run->events[i];
+        if (e->rc != HTTP_COMPLETE)
+            break;
+        const size_t(*views[2])[2] = {e->keys, e->values};
+        if (e->method[0] < start || e->method[0] + e->method[1] > e->end || e->path[0] + e->path[1] > e->end ||
+            e->param_count < 0 || e->param_count > MAX_QUERY_PARAMS)
+            return false;
+        for (int v = 0; v < 2; v++)
+        {
+            for (int k = 0; k < e->param_count; k++)
+            {
+                if (views[v][k][0] < start || views[v][k][0] + views[v][k][1] > e->end)
+                    return false;
+            }
+        }
+        start = e->end;
+    }
+    return true;
+}
+
+static void dump(const char *stream, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)stream[i];
+        if (c >= 0x20 && c < 0x7f && c != '\\')
+            putchar(c);
+        else
+            printf("\\x%02x", c);
+    }
+    putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+    static char stream[FUZZ_STREAM_MAX];
+    static FuzzRun whole;
+    static FuzzRun split;
+    unsigned long rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    unsigned long completed = 0;
+
+    for (unsigned long r = 0; r < rounds; r++)
+    {
+        g_rng = (seed + r) * 0x9e3779b97f4a7c15ull | 1;
+        size_t len = make_stream(stream);
+        replay(stream, len, 0, &whole);
+        size_t chunk = rnd(3) ? 1 + rnd(16) : 1 + rnd(REQ_BUF);
+        replay(stream, len, chunk, &split);
+
+        /* After a bad request the connection is closed, so how much had
+         * been read by then does not matter. */
+        bool closed = whole.count > 0 && whole.events[whole.count - 1].rc == HTTP_BAD;
+        if (whole.count != split.count ||
+            (!closed && (whole.delivered != split.delivered || whole.buffered != split.buffered)) ||
+            memcmp(whole.events, split.events, sizeof(whole.events[0]) * (size_t)whole.count) != 0 ||
+            whole.overran || split.overran || !run_in_bounds(&whole))
+        {
+            printf("mismatch in round %lu (seed %llu), chunks of up to %zu bytes:\n", r,
+                   (unsigned long long)seed, chunk);
+            printf("  whole: %d parses, %zu delivered, %zu buffered\n", whole.count, whole.delivered,
+                   whole.buffered);
+            printf("  split: %d parses, %zu delivered, %zu buffered\n", split.count, split.delivered,
+                   split.buffered);
+            dump(stream, len);
+            return 1;
+        }
+        completed += (unsigned long)whole.count;
+    }
+    printf("http_parse: %lu rounds, %lu parses, whole and split runs agree\n", rounds, completed);
+    return 0;
+}
@@ -1,21 +1,44 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #define LINE_BUF 512
+#define LIST_BODY_MAX 16384
 #define REQ_BUF 1024
-#define NAME_MAX 8
+#define MAX_QUERY_PARAMS 16
+#define LOBBY_MAX_CONNS 256
+#define LOBBY_REQUEST_TIMEOUT_MS 5000
+#define LOBBY_KEEPALIVE_IDLE_MS 30000
+#define EVENT_LINE_MAX 320
+#define BATCH_MAX_OPS 4
+#define PLAYER_NAME_MAX 8
 #define GAME_NAME_MAX 32
 #define GAME_ID_LEN 8
 #define TOKEN_LEN 16
@@ -27,6 +50,53 @@
 #define DEFAULT_JOIN_TIMEOUT_SEC 600
 #define DEFAULT_DROP_TIMEOUT_SEC 15
 #define DEFAULT_IDLE_TIMEOUT_SEC 600
+#define DEFAULT_HANDSHAKE_TIMEOUT_SEC 5
+#define HANDSHAKE_BUF 32
+#define REGISTER_MSG "REGISTER"
+#define REGISTER_LEN 8
+#define LINK_BUF_SIZE 8192
+#define MAX_COALESCE_DELAY_US 100000
+#define MAX_CPU_LIST 256
+#define PORT_WORDS (65536 / 64)
+#define MAX_LOBBY_PROCESSES 64
+#define RESPAWN_BACKOFF_SEC 1
+#define DEFAULT_PREWARM_RELAYS 2
+#define MAX_PREWARM_RELAYS 8
+#define PREWARM_RETRY_SEC 1
+#define LOG_RING_SIZE 128
+#define LOG_EVENT_MAX 24
+#define LOG_FIELDS_MAX 384
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_MS 20
+#define DEFAULT_LOG_RATE_PER_SEC 100
+#define ADMIN_TOKEN_MAX 64
+#define ADMIN_BUF (256 * 1024)
+#define DEFAULT_DRAIN_TIMEOUT_SEC 600
+#define DRAIN_POLL_MS 500
+#define JOURNAL_STOP_TIMEOUT_MS 2000
+#define CLIENT_EXPIRE_SEC 3600
+#define EXPIRY_TICK_MS 1000
+#define EXPIRY_SLOTS 64
+#define EXPIRY_TIMERS (MAX_GAMES_LIMIT + MAX_CLIENTS_LIMIT)
+#define RATE_SETS 256
+#define RATE_WAYS 4
+#define RATE_WHEEL_SLOTS 64
+#define RATE_BURST_MAX 60
+#define DEFAULT_RATE_IP_PER_SEC 20
+#define DEFAULT_RATE_IP_BURST 60
+#define DEFAULT_RATE_CLIENT_PER_SEC 5
+#define DEFAULT_RATE_CLIENT_BURST 20
+#define HANDOFF_MAGIC 0x4D4D5550u
+#define HANDOFF_VERSION 1
+#define HANDOFF_PARK_TIMEOUT_SEC 2
+#define HANDOFF_ACK_TIMEOUT_SEC 5
+#define HANDOFF_MAX_FDS (1 + 2 * MAX_PLAYERS_LIMIT)
+#define DEFAULT_SNAPSHOT_INTERVAL_SEC 60
+#define DEFAULT_JOURNAL_FSYNC_MS 50
+#define JOURNAL_RING_SIZE 2048
+#define JOURNAL_BATCH 128
+#define SNAPSHOT_MAGIC 0x4D4D534Eu
+#define SNAPSHOT_VERSION 1
 
 typedef struct
 {
@@ -39,19 +109,129 @@ typedef struct
     int join_timeout_sec;
     int drop_timeout_sec;
     int idle_timeout_sec;
+    int handshake_timeout_sec;
+    bool forward_batch;
+    int coalesce_delay_us;
+    int lobby_cpus[MAX_CPU_LIST];
+    int lobby_cpu_count;
+    int relay_cpus[MAX_CPU_LIST];
+    int relay_cpu_count;
+    int nic_irq_cpus[MAX_CPU_LIST];
+    int nic_irq_cpu_count;
+    int lobby_processes;
+    int prewarm_relays;
+    char upgrade_socket[108];
+    char journal_path[256];
+    int snapshot_interval_sec;
+    int journal_fsync_ms;
+    int log_level;
+    int log_rate_per_sec;
+    char admin_token[ADMIN_TOKEN_MAX + 1];
+    int drain_timeout_sec;
+    int rate_ip_per_sec;
+    int rate_ip_burst;
+    int rate_client_per_sec;
+    int rate_client_burst;
+    /* A loaded config is never modified; reload publishes a new one and the
+     * old copy is freed when its last reference is released. */
+    atomic_int refs;
 } ServerConfig;
 
 typedef struct
 {
     bool in_use;
     char id[GAME_ID_LEN + 1];
-    char name[NAME_MAX + 1];
+    char name[PLAYER_NAME_MAX + 1];
+    /* Address of the /hello that created it, or 0 if restored. */
+    uint32_t ip;
     time_t last_seen;
     bool pending_start;
     int start_port;
     char start_host[256];
+    /* Lobby process holding the client's /events stream, or 0. A client
+     * with a stream open does not expire. */
+    pid_t events_owner;
 } LobbyClient;
 
+typedef struct
+{
+    const char *ptr;
+    size_t len;
+} StrView;
+
+/* A parsed request line. The views point into the connection's receive
+ * buffer; values are only copied and decoded when a handler asks. */
+typedef struct
+{
+    StrView method;
+    StrView path;
+    StrView keys[MAX_QUERY_PARAMS];
+    StrView values[MAX_QUERY_PARAMS];
+    int param_count;
+} HttpRequest;
+
+typedef enum
+{
+    HTTP_INCOMPLETE,
+    HTTP_COMPLETE,
+    HTTP_BAD
+} HttpParseResult;
+
+/* A lobby connection whose request has not fully arrived yet, or a
+ * keep-alive connection waiting for its next request. */
+typedef struct
+{
+    int fd;
+    uint32_t ip;
+    uint64_t deadline_ms;
+    size_t len;
+    /* Bytes already searched for the end of the headers. */
+    size_t scanned;
+    char buf[REQ_BUF];
+} LobbyConn;
+
+/* The replies of a /batch request's operations, collected instead of
+ * being sent one by one. */
+typedef struct
+{
+    char buf[BATCH_MAX_OPS * LINE_BUF + 4];
+    size_t used;
+    char client_id[GAME_ID_LEN + 1]; /* from a hello op, for the ops after it */
+} HttpBatch;
+
+/* A client subscribed to /events on this lobby process. */
+typedef struct
+{
+    int fd;
+    int client; /* index into g_clients */
+    char client_id[GAME_ID_LEN + 1];
+} EventSub;
+
+/* A game slot as /events subscribers were last told about it. */
+typedef struct
+{
+    bool in_use;
+    bool active;
+    char id[GAME_ID_LEN + 1];
+    char name[GAME_NAME_MAX + 1];
+    int players;
+    int max_players;
+} EventGame;
+
+/* Per-slot relay counters. Only the game's relay thread writes them, using
+ * relaxed atomics, and the admin API reads them without taking any lock. */
+typedef struct
+{
+    atomic_bool connected;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+    atomic_uint_fast64_t last_activity_ms;
+    atomic_uint_fast32_t queue_bytes;
+    atomic_uint_fast64_t sends;
+    atomic_uint_fast64_t latency_total_us;
+    atomic_uint_fast32_t latency_max_us;
+} SlotStats;
+
 typedef struct
 {
     bool in_use;
@@ -64,23 +244,363 @@ typedef struct
     int port;
     time_t created_at;
     char player_ids[MAX_PLAYERS_LIMIT][GAME_ID_LEN + 1];
-    char player_names[MAX_PLAYERS_LIMIT][NAME_MAX + 1];
+    char player_names[MAX_PLAYERS_LIMIT][PLAYER_NAME_MAX + 1];
     char tokens[MAX_PLAYERS_LIMIT][TOKEN_LEN + 1];
+    int worker;
+    pid_t owner;
     pthread_t thread;
+    /* Admin requests to the relay, which may run in another lobby process. */
+    atomic_bool end_requested;
+    atomic_uint kick_mask;
+    SlotStats stats[MAX_PLAYERS_LIMIT];
 } Game;
 
+typedef struct RelayState RelayState;
+
 typedef struct
 {
     Game *game;
     ServerConfig *cfg;
+    RelayState *rs;
 } GameThreadArgs;
 
-static ServerConfig g_cfg;
-static Game g_games[MAX_GAMES_LIMIT];
-static LobbyClient g_clients[MAX_CLIENTS_LIMIT];
-static bool *g_port_used = NULL;
-static int g_port_range = 0;
-static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+typedef struct
+{
+    int fd;
+    size_t len;
+    uint64_t deadline_ms;
+    char buf[HANDSHAKE_BUF];
+} PendingHandshake;
+
+typedef struct
+{
+    size_t len;
+    uint64_t first_us;
+    bool blocked;
+    unsigned char data[LINK_BUF_SIZE];
+} LinkBuf;
+
+/* Everything a game's relay loop owns, kept together so a hot upgrade can
+ * hand a running ring to the next binary. */
+struct RelayState
+{
+    ServerConfig *cfg;
+    SlotStats *stats;
+    unsigned cfg_generation;
+    int listen_fd;
+    int fds[MAX_PLAYERS_LIMIT];
+    bool connected[MAX_PLAYERS_LIMIT];
+    PendingHandshake pending[MAX_PLAYERS_LIMIT];
+    LinkBuf *links;
+    uint64_t drop_deadline;
+    uint64_t last_activity_ms;
+    bool parked;
+};
+
+/* Hot upgrade wire format. The old process sends a header carrying the lobby
+ * listener, then the client and game tables, then one HandoffRelay (with its
+ * sockets attached) per running ring, each followed by its non-empty link
+ * buffers. Bump HANDOFF_VERSION whenever any of these change. */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t client_count;
+    uint32_t game_count;
+    uint32_t relay_count;
+} HandoffHeader;
+
+typedef struct
+{
+    char id[GAME_ID_LEN + 1];
+    char name[PLAYER_NAME_MAX + 1];
+    int64_t last_seen;
+    uint8_t pending_start;
+    int32_t start_port;
+    char start_host[256];
+} HandoffClient;
+
+typedef struct
+{
+    uint32_t slot;
+    uint8_t active;
+    char id[GAME_ID_LEN + 1];
+    char name[GAME_NAME_MAX + 1];
+    int32_t max_players;
+    int32_t player_count;
+    int32_t port;
+    int64_t created_at;
+    char player_ids[MAX_PLAYERS_LIMIT][GAME_ID_LEN + 1];
+    char player_names[MAX_PLAYERS_LIMIT][PLAYER_NAME_MAX + 1];
+    char tokens[MAX_PLAYERS_LIMIT][TOKEN_LEN + 1];
+} HandoffGame;
+
+typedef struct
+{
+    uint32_t slot;
+    uint32_t player_mask;
+    uint32_t pending_mask;
+    uint64_t drop_deadline;
+    uint64_t last_activity_ms;
+    uint64_t pending_deadline[MAX_PLAYERS_LIMIT];
+    uint32_t pending_len[MAX_PLAYERS_LIMIT];
+    char pending_buf[MAX_PLAYERS_LIMIT][HANDSHAKE_BUF];
+    uint32_t link_len[MAX_PLAYERS_LIMIT];
+} HandoffRelay;
+
+/* Lobby journal. Every mutation is appended as one fixed-size record; the
+ * file is compacted into journal_path.snap on a timer. Both are replayed at
+ * startup so a crash keeps pending games and registered clients. */
+enum
+{
+    JOURNAL_HELLO = 1,
+    JOURNAL_CREATE,
+    JOURNAL_JOIN,
+    JOURNAL_LEAVE,
+    JOURNAL_START,
+    JOURNAL_EXPIRE_GAME,
+    JOURNAL_EXPIRE_CLIENT,
+    JOURNAL_END
+};
+
+typedef struct
+{
+    uint64_t seq;
+    int64_t time;
+    uint8_t op;
+    uint8_t max_players;
+    char client_id[GAME_ID_LEN + 1];
+    char client_name[PLAYER_NAME_MAX + 1];
+    char game_id[GAME_ID_LEN + 1];
+    char game_name[GAME_NAME_MAX + 1];
+    char token[TOKEN_LEN + 1];
+    uint32_t check;
+} JournalRecord;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;
+    uint32_t client_count;
+    uint32_t game_count;
+} SnapshotHeader;
+
+/* A game port held by an idle prewarmed listener, so the supervisor can
+ * return it to the pool if its lobby process dies. */
+typedef struct
+{
+    pid_t owner;
+    int port;
+} PrewarmPort;
+
+/* Event log. Each thread formats its events into its own single-producer
+ * ring; one writer thread drains every ring and writes JSON lines to
+ * stdout, so logging never blocks on I/O. */
+enum
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+typedef struct
+{
+    uint64_t ts_us;
+    uint8_t level;
+    char event[LOG_EVENT_MAX];
+    char fields[LOG_FIELDS_MAX];
+} LogEntry;
+
+typedef struct LogRing
+{
+    struct LogRing *next;
+    atomic_uint_fast32_t head;
+    atomic_uint_fast32_t tail;
+    atomic_uint dropped;
+    atomic_bool closed;
+    /* Per-thread rate limit, touched only by the owning thread. */
+    double tokens;
+    uint64_t refill_us;
+    unsigned suppressed;
+    LogEntry entries[LOG_RING_SIZE];
+} LogRing;
+
+/* One token bucket, keyed by IPv4 address or by the 8 bytes of a client id.
+ * Tokens are in thousandths. next links the bucket into a timing wheel slot;
+ * 0 ends the list, so slot and link values are entry index + 1. */
+typedef struct
+{
+    uint64_t key;
+    uint32_t last_ms;
+    uint16_t tokens;
+    uint16_t next;
+} RateEntry;
+
+/* Set-associative bucket table: a key hashes to one set of RATE_WAYS
+ * buckets, which share a cache line. Buckets idle long enough to have
+ * refilled are freed as the one-second wheel turns. */
+typedef struct
+{
+    _Alignas(64) RateEntry entries[RATE_SETS * RATE_WAYS];
+    uint16_t wheel[RATE_WHEEL_SLOTS];
+    int wheel_pos;
+    uint32_t tick_ms;
+    unsigned long limited;
+} RateTable;
+
+/* Expiry timers for pending games (timer i is g_games[i]) and clients
+ * (timer MAX_GAMES_LIMIT + i). Level 0 has one-second slots, level 1 has
+ * EXPIRY_SLOTS-second slots that cascade into level 0. Links are timer
+ * index + 1, with 0 ending a list. */
+typedef struct
+{
+    uint8_t next[EXPIRY_TIMERS];
+    bool linked[EXPIRY_TIMERS];
+    uint8_t slots[2][EXPIRY_SLOTS];
+    /* Last second processed, in time(NULL) seconds. */
+    int64_t now_sec;
+} ExpiryWheel;
+
+/* Lobby state shared by every lobby process. It lives in one MAP_SHARED
+ * mapping created before the lobby processes are forked and is guarded by a
+ * robust process-shared mutex. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    Game games[MAX_GAMES_LIMIT];
+    LobbyClient clients[MAX_CLIENTS_LIMIT];
+    int worker_games[MAX_CPU_LIST];
+    /* Game port pool: one bit per port number, plus the round-robin cursor
+     * and counters reported when the pool runs dry. */
+    uint64_t port_bits[PORT_WORDS];
+    int port_cursor;
+    int ports_in_use;
+    unsigned long port_exhausted;
+    bool draining;
+    /* Counts game starts, so /events streams only look for start commands
+     * after one. */
+    unsigned long starts;
+    ExpiryWheel expiry;
+    RateTable rate;
+    PrewarmPort prewarm_ports[MAX_LOBBY_PROCESSES * MAX_PREWARM_RELAYS];
+} SharedState;
+
+/* Current config. Only the lobby thread replaces it, and only while holding
+ * the state lock; other threads read it under the lock or through a
+ * reference from config_acquire(). */
+static ServerConfig *g_cfg = NULL;
+static atomic_uint g_cfg_generation = 0;
+static const char *g_config_path = NULL;
+static int g_reload_pipe[2] = {-1, -1};
+/* Lobby connections receiving a request or kept open for the next one. */
+static LobbyConn g_lobby_conns[LOBBY_MAX_CONNS];
+static int g_lobby_conn_count = 0;
+/* Set while serving a request that asked to keep its connection open. */
+static bool g_http_keep_alive = false;
+/* Set when a handler has taken the connection over, as /events does. */
+static bool g_http_detached = false;
+/* Set while the operations of a /batch request run. */
+static HttpBatch *g_http_batch = NULL;
+static EventSub g_event_subs[MAX_CLIENTS_LIMIT];
+static int g_event_sub_count = 0;
+static EventGame g_event_games[MAX_GAMES_LIMIT];
+static unsigned long g_event_starts = 0;
+static volatile sig_atomic_t g_reload_requested = 0;
+static volatile sig_atomic_t g_shutdown_requested = 0;
+static SharedState *g_shared = NULL;
+static Game *g_games = NULL;
+static LobbyClient *g_clients = NULL;
+static uint64_t *g_port_bits = NULL;
+/* Relay workers are the CPUs in relay_cpus; game threads are pinned to one. */
+static int g_worker_node[MAX_CPU_LIST];
+static bool g_worker_near_nic[MAX_CPU_LIST];
+static int *g_worker_games = NULL;
+/* Relays running in this process, indexed like g_games. */
+static pthread_mutex_t g_relay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_relay_cond = PTHREAD_COND_INITIALIZER;
+static RelayState *g_relays[MAX_GAMES_LIMIT];
+/* Set from handing a game to a relay thread until that thread registers
+ * (or gives up), so a hot upgrade can wait for relays still starting. */
+static atomic_bool g_relay_starting[MAX_GAMES_LIMIT];
+static atomic_bool g_upgrading = false;
+/* Idle relay threads, each holding a bound game listener, that
+ * start_game_locked hands new games to. */
+typedef struct
+{
+    pthread_t thread;
+    pthread_cond_t cond;
+    bool idle;
+    int port;
+    RelayState *rs;
+    Game *game;
+    ServerConfig *cfg;
+    int cpu;
+} PrewarmSlot;
+
+static pthread_mutex_t g_prewarm_lock = PTHREAD_MUTEX_INITIALIZER;
+static PrewarmSlot g_prewarm[MAX_PREWARM_RELAYS];
+static int g_prewarm_count = 0;
+static int g_wake_pipe[2] = {-1, -1};
+
+/* g_log_lock only guards the flush handshake with the writer thread; it
+ * is never held across a write. Rings are pushed onto g_log_rings without
+ * a lock, and only the writer thread unlinks them. */
+static pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_log_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic(LogRing *) g_log_rings = NULL;
+static pthread_key_t g_log_key;
+static __thread LogRing *t_log_ring = NULL;
+static atomic_int g_log_level = LOG_INFO;
+static atomic_int g_log_rate = DEFAULT_LOG_RATE_PER_SEC;
+static bool g_log_running = false;
+static int g_log_pid = 0;
+static unsigned g_log_flush_requested = 0;
+static unsigned g_log_flush_done = 0;
+
+static JournalRecord g_journal_ring[JOURNAL_RING_SIZE];
+static atomic_uint_fast64_t g_journal_head = 0;
+static atomic_uint_fast64_t g_journal_tail = 0;
+static atomic_bool g_journal_overflow = false;
+static atomic_bool g_journal_stop = false;
+static atomic_bool g_journal_stopped = false;
+static uint64_t g_journal_seq = 0;
+static bool g_journal_enabled = false;
+static int g_journal_fd = -1;
+
+static void state_lock(void)
+{
+    /* A lobby process that dies holding the lock leaves it EOWNERDEAD. The
+     * state is only updated field by field, so it is safe to carry on. */
+    if (pthread_mutex_lock(&g_shared->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&g_shared->lock);
+}
+
+static void state_unlock(void)
+{
+    pthread_mutex_unlock(&g_shared->lock);
+}
+
+static ServerConfig *config_acquire_locked(void)
+{
+    atomic_fetch_add(&g_cfg->refs, 1);
+    return g_cfg;
+}
+
+static ServerConfig *config_acquire(void)
+{
+    state_lock();
+    ServerConfig *cfg = config_acquire_locked();
+    state_unlock();
+    return cfg;
+}
+
+static void config_release(ServerConfig *cfg)
+{
+    if (cfg && atomic_fetch_sub(&cfg->refs, 1) == 1)
+        free(cfg);
+}
 
 static void str_trim(char *s)
 {
@@ -122,895 +642,4693 @@ static void gen_id(char *out, size_t len)
     out[len - 1] = '\0';
 }
 
-static bool parse_int(const char *value, int *out)
+static uint64_t monotonic_us(void)
 {
-    char *end = NULL;
-    long v = strtol(value, &end, 10);
-    if (end == value || *end != '\0')
-        return false;
-    if (v < 0 || v > INT32_MAX)
-        return false;
-    *out = (int)v;
-    return true;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
 }
 
-static bool load_config(const char *path, ServerConfig *cfg)
+static uint64_t monotonic_ms(void)
 {
-    FILE *f = fopen(path, "r");
-    if (!f)
-        return false;
+    return monotonic_us() / 1000u;
+}
 
-    cfg->host_name[0] = '\0';
-    cfg->lobby_port = 0;
-    cfg->game_port_min = 0;
-    cfg->game_port_max = 0;
-    cfg->max_games = DEFAULT_MAX_GAMES;
-    cfg->max_players_default = DEFAULT_MAX_PLAYERS;
-    cfg->join_timeout_sec = DEFAULT_JOIN_TIMEOUT_SEC;
-    cfg->drop_timeout_sec = DEFAULT_DROP_TIMEOUT_SEC;
-    cfg->idle_timeout_sec = DEFAULT_IDLE_TIMEOUT_SEC;
+static const char *const LOG_LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
 
-    char line[512];
-    while (fgets(line, sizeof(line), f))
+static int parse_log_level(const char *value)
+{
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
     {
-        char *hash = strchr(line, '#');
-        if (hash)
-            *hash = '\0';
-        char *eq = strchr(line, '=');
-        if (!eq)
-            continue;
-        *eq = '\0';
-        char *key = line;
-        char *value = eq + 1;
-        str_trim(key);
-        str_trim(value);
-        if (*key == '\0' || *value == '\0')
-            continue;
+        if (strcmp(value, LOG_LEVEL_NAMES[i]) == 0)
+            return i;
+    }
+    return -1;
+}
 
-        if (strcmp(key, "host_name") == 0)
-            snprintf(cfg->host_name, sizeof(cfg->host_name), "%s", value);
-        else if (strcmp(key, "lobby_port") == 0)
-            parse_int(value, &cfg->lobby_port);
-        else if (strcmp(key, "game_port_min") == 0)
-            parse_int(value, &cfg->game_port_min);
-        else if (strcmp(key, "game_port_max") == 0)
-            parse_int(value, &cfg->game_port_max);
-        else if (strcmp(key, "max_games") == 0)
-        {
-            int v = 0;
-            if (parse_int(value, &v))
-                cfg->max_games = v;
-        }
-        else if (strcmp(key, "max_players_default") == 0)
-        {
-            int v = 0;
-            if (parse_int(value, &v))
-                cfg->max_players_default = v;
-        }
-        else if (strcmp(key, "join_timeout_sec") == 0)
+static uint64_t realtime_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/* Escapes s for use inside a JSON string. */
+static const char *json_escape(const char *s, char *out, size_t out_len)
+{
+    size_t used = 0;
+    for (; *s && used + 7 < out_len; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
         {
-            int v = 0;
-            if (parse_int(value, &v))
-                cfg->join_timeout_sec = v;
+            out[used++] = '\\';
+            out[used++] = (char)c;
         }
-        else if (strcmp(key, "drop_timeout_sec") == 0)
+        else if (c < 0x20)
         {
-            int v = 0;
-            if (parse_int(value, &v))
-                cfg->drop_timeout_sec = v;
+            used += (size_t)snprintf(out + used, out_len - used, "\\u%04x", c);
         }
-        else if (strcmp(key, "idle_timeout_sec") == 0)
+        else
         {
-            int v = 0;
-            if (parse_int(value, &v))
-                cfg->idle_timeout_sec = v;
+            out[used++] = (char)c;
         }
     }
+    out[used] = '\0';
+    return out;
+}
 
-    fclose(f);
-    return true;
+static void log_thread_exit(void *arg)
+{
+    atomic_store(&((LogRing *)arg)->closed, true);
 }
 
-static bool validate_config(const ServerConfig *cfg)
+static LogRing *log_ring(void)
 {
-    if (cfg->host_name[0] == '\0')
-        return false;
-    if (cfg->lobby_port <= 0 || cfg->lobby_port > 65535)
-        return false;
-    if (cfg->game_port_min <= 0 || cfg->game_port_min > 65535)
-        return false;
-    if (cfg->game_port_max <= 0 || cfg->game_port_max > 65535)
-        return false;
-    if (cfg->game_port_min > cfg->game_port_max)
-        return false;
-    if (cfg->max_games <= 0 || cfg->max_games > MAX_GAMES_LIMIT)
-        return false;
-    if (cfg->max_players_default <= 0 || cfg->max_players_default > MAX_PLAYERS_LIMIT)
-        return false;
-    if (cfg->join_timeout_sec <= 0)
-        return false;
-    if (cfg->drop_timeout_sec <= 0)
-        return false;
-    if (cfg->idle_timeout_sec <= 0)
+    if (t_log_ring)
+        return t_log_ring;
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring)
+        return NULL;
+    ring->tokens = atomic_load(&g_log_rate);
+    ring->refill_us = monotonic_us();
+    LogRing *head = atomic_load_explicit(&g_log_rings, memory_order_relaxed);
+    do
+        ring->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&g_log_rings, &head, ring, memory_order_release,
+                                                  memory_order_relaxed));
+    pthread_setspecific(g_log_key, ring);
+    t_log_ring = ring;
+    return ring;
+}
+
+static bool log_rate_allow(LogRing *ring)
+{
+    int rate = atomic_load_explicit(&g_log_rate, memory_order_relaxed);
+    if (rate <= 0)
+        return true;
+    uint64_t now = monotonic_us();
+    ring->tokens += (double)(now - ring->refill_us) * rate / 1000000.0;
+    if (ring->tokens > rate)
+        ring->tokens = rate;
+    ring->refill_us = now;
+    if (ring->tokens < 1.0)
         return false;
+    ring->tokens -= 1.0;
     return true;
 }
 
-static int acquire_game_port(void)
+static void log_push(LogRing *ring, int level, const char *event, const char *fmt, va_list ap)
 {
-    for (int i = 0; i < g_port_range; i++)
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SIZE)
     {
-        if (!g_port_used[i])
-        {
-            g_port_used[i] = true;
-            return g_cfg.game_port_min + i;
-        }
+        atomic_fetch_add(&ring->dropped, 1);
+        return;
     }
-    return -1;
+    LogEntry *e = &ring->entries[head % LOG_RING_SIZE];
+    e->ts_us = realtime_us();
+    e->level = (uint8_t)level;
+    snprintf(e->event, sizeof(e->event), "%s", event);
+    vsnprintf(e->fields, sizeof(e->fields), fmt, ap);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-static void release_game_port(int port)
+static void log_push_fields(LogRing *ring, int level, const char *event, const char *fmt, ...)
 {
-    if (port < g_cfg.game_port_min || port > g_cfg.game_port_max)
-        return;
-    int idx = port - g_cfg.game_port_min;
-    if (idx >= 0 && idx < g_port_range)
-        g_port_used[idx] = false;
+    va_list ap;
+    va_start(ap, fmt);
+    log_push(ring, level, event, fmt, ap);
+    va_end(ap);
 }
 
-static LobbyClient *find_client_by_id_locked(const char *id)
+/* Records one event. fmt formats the rest of the JSON object, for example
+ * "\"id\":\"%s\",\"port\":%d"; string values that may hold arbitrary text
+ * must go through json_escape(). Takes no lock and does no I/O, so it is
+ * safe to call with any lock held. */
+static void log_event(int level, const char *event, const char *fmt, ...)
 {
-    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    if (level < atomic_load_explicit(&g_log_level, memory_order_relaxed))
+        return;
+    LogRing *ring = log_ring();
+    if (!ring)
+        return;
+    if (!log_rate_allow(ring))
     {
-        if (g_clients[i].in_use && strcmp(g_clients[i].id, id) == 0)
-            return &g_clients[i];
+        ring->suppressed++;
+        return;
     }
-    return NULL;
+    if (ring->suppressed > 0)
+    {
+        log_push_fields(ring, LOG_WARN, "log_suppressed", "\"count\":%u", ring->suppressed);
+        ring->suppressed = 0;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    log_push(ring, level, event, fmt, ap);
+    va_end(ap);
 }
 
-static LobbyClient *create_client_locked(const char *name)
+/* Logs the current errno the way perror() would. */
+static void log_errno(const char *event)
 {
-    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    int err = errno;
+    char buf[128];
+    log_event(LOG_ERROR, event, "\"error\":\"%s\"", strerror_r(err, buf, sizeof(buf)));
+    errno = err;
+}
+
+static void log_write(const char *buf, size_t len)
+{
+    while (len > 0)
     {
-        if (!g_clients[i].in_use)
+        ssize_t w = write(STDOUT_FILENO, buf, len);
+        if (w < 0)
         {
-            g_clients[i].in_use = true;
-            gen_id(g_clients[i].id, sizeof(g_clients[i].id));
-            snprintf(g_clients[i].name, sizeof(g_clients[i].name), "%s", name);
-            g_clients[i].last_seen = time(NULL);
-            g_clients[i].pending_start = false;
-            g_clients[i].start_port = 0;
-            g_clients[i].start_host[0] = '\0';
-            return &g_clients[i];
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+/* Appends one JSON line to out, flushing first if it would not fit. Lines
+ * are written in batches of at most PIPE_BUF bytes so processes sharing a
+ * pipe never interleave partial lines. */
+static void log_format(char *out, size_t *used, const LogEntry *e, time_t *cached_sec, char *cached_ts)
+{
+    time_t sec = (time_t)(e->ts_us / 1000000u);
+    if (sec != *cached_sec)
+    {
+        struct tm tm_now;
+        localtime_r(&sec, &tm_now);
+        strftime(cached_ts, 32, "%Y-%m-%d %H:%M:%S", &tm_now);
+        *cached_sec = sec;
+    }
+
+    char line[LOG_LINE_MAX];
+    int n = snprintf(line, sizeof(line), "{\"ts\":\"%s.%06u\",\"level\":\"%s\",\"pid\":%d,\"event\":\"%s\"%s%s}\n",
+                     cached_ts, (unsigned)(e->ts_us % 1000000u), LOG_LEVEL_NAMES[e->level], g_log_pid,
+                     e->event, e->fields[0] ? "," : "", e->fields);
+    if (n <= 0 || (size_t)n >= sizeof(line))
+        return;
+    if (*used + (size_t)n > PIPE_BUF)
+    {
+        log_write(out, *used);
+        *used = 0;
+    }
+    memcpy(out + *used, line, (size_t)n);
+    *used += (size_t)n;
+}
+
+/* Runs on the writer thread only, without g_log_lock, so a stalled
+ * stdout holds up nothing but logging. New rings are only ever pushed in
+ * front of the first one; the rest of the list belongs to this thread. */
+static void log_drain(void)
+{
+    static time_t cached_sec = 0;
+    static char cached_ts[32];
+    char out[PIPE_BUF];
+    size_t used = 0;
+
+    LogRing *prev = NULL;
+    LogRing *ring = atomic_load_explicit(&g_log_rings, memory_order_acquire);
+    while (ring)
+    {
+        LogRing *next = ring->next;
+        bool closed = atomic_load(&ring->closed);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++)
+            log_format(out, &used, &ring->entries[tail % LOG_RING_SIZE], &cached_sec, cached_ts);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        unsigned dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped > 0)
+        {
+            LogEntry e;
+            e.ts_us = realtime_us();
+            e.level = LOG_WARN;
+            snprintf(e.event, sizeof(e.event), "log_dropped");
+            snprintf(e.fields, sizeof(e.fields), "\"count\":%u", dropped);
+            log_format(out, &used, &e, &cached_sec, cached_ts);
+        }
+
+        bool unlinked = false;
+        if (closed && prev)
+        {
+            prev->next = next;
+            unlinked = true;
+        }
+        else if (closed)
+        {
+            /* Fails if a ring was pushed in front meanwhile; the next pass
+             * then finds this one behind it. */
+            LogRing *expected = ring;
+            unlinked = atomic_compare_exchange_strong(&g_log_rings, &expected, next);
+        }
+        if (unlinked)
+            free(ring);
+        else
+            prev = ring;
+        ring = next;
+    }
+
+    if (used > 0)
+        log_write(out, used);
+}
+
+static void *log_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&g_log_lock);
+    while (1)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&g_log_cond, &g_log_lock, &deadline);
+        unsigned requested = g_log_flush_requested;
+        pthread_mutex_unlock(&g_log_lock);
+
+        log_drain();
+
+        pthread_mutex_lock(&g_log_lock);
+        g_log_flush_done = requested;
+        pthread_cond_broadcast(&g_log_cond);
+    }
+    return NULL;
+}
+
+static void log_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0)
+    {
+        perror("log thread");
+        return;
+    }
+    pthread_detach(thread);
+    g_log_pid = (int)getpid();
+    g_log_running = true;
+}
+
+static void log_init(const ServerConfig *cfg)
+{
+    pthread_key_create(&g_log_key, log_thread_exit);
+    atomic_store(&g_log_level, cfg->log_level);
+    atomic_store(&g_log_rate, cfg->log_rate_per_sec);
+    log_start();
+}
+
+/* A forked lobby process inherits copies of the parent's rings but not its
+ * writer thread. */
+static void log_after_fork(void)
+{
+    pthread_mutex_init(&g_log_lock, NULL);
+    pthread_cond_init(&g_log_cond, NULL);
+    for (LogRing *ring = g_log_rings; ring; ring = ring->next)
+        atomic_store(&ring->tail, atomic_load(&ring->head));
+    g_log_flush_requested = 0;
+    g_log_flush_done = 0;
+    log_start();
+}
+
+/* Waits until everything logged so far is written; used before exiting. */
+static void log_flush(void)
+{
+    if (!g_log_running)
+        return;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_mutex_lock(&g_log_lock);
+    unsigned target = ++g_log_flush_requested;
+    pthread_cond_broadcast(&g_log_cond);
+    while ((int)(g_log_flush_done - target) < 0)
+    {
+        if (pthread_cond_timedwait(&g_log_cond, &g_log_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&g_log_lock);
+}
+
+static bool set_nonblocking(int fd, bool enable)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return false;
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+static bool parse_int(const char *value, int *out)
+{
+    char *end = NULL;
+    long v = strtol(value, &end, 10);
+    if (end == value || *end != '\0')
+        return false;
+    if (v < 0 || v > INT32_MAX)
+        return false;
+    *out = (int)v;
+    return true;
+}
+
+/* Parses a CPU list such as "0-3,8,10-11". */
+static bool parse_cpu_list(const char *value, int *out, int *out_count)
+{
+    int count = 0;
+    const char *p = value;
+    while (*p)
+    {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return false;
+            p = end;
+        }
+        for (long c = first; c <= last; c++)
+        {
+            if (count >= MAX_CPU_LIST)
+                return false;
+            out[count++] = (int)c;
+        }
+        while (*p == ',' || isspace((unsigned char)*p))
+            p++;
+    }
+    *out_count = count;
+    return true;
+}
+
+static bool load_config(const char *path, ServerConfig *cfg)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    cfg->host_name[0] = '\0';
+    cfg->lobby_port = 0;
+    cfg->game_port_min = 0;
+    cfg->game_port_max = 0;
+    cfg->max_games = DEFAULT_MAX_GAMES;
+    cfg->max_players_default = DEFAULT_MAX_PLAYERS;
+    cfg->join_timeout_sec = DEFAULT_JOIN_TIMEOUT_SEC;
+    cfg->drop_timeout_sec = DEFAULT_DROP_TIMEOUT_SEC;
+    cfg->idle_timeout_sec = DEFAULT_IDLE_TIMEOUT_SEC;
+    cfg->handshake_timeout_sec = DEFAULT_HANDSHAKE_TIMEOUT_SEC;
+    cfg->forward_batch = false;
+    cfg->coalesce_delay_us = 0;
+    cfg->lobby_cpu_count = 0;
+    cfg->relay_cpu_count = 0;
+    cfg->nic_irq_cpu_count = 0;
+    cfg->lobby_processes = 1;
+    cfg->prewarm_relays = DEFAULT_PREWARM_RELAYS;
+    cfg->upgrade_socket[0] = '\0';
+    cfg->journal_path[0] = '\0';
+    cfg->snapshot_interval_sec = DEFAULT_SNAPSHOT_INTERVAL_SEC;
+    cfg->journal_fsync_ms = DEFAULT_JOURNAL_FSYNC_MS;
+    cfg->log_level = LOG_INFO;
+    cfg->log_rate_per_sec = DEFAULT_LOG_RATE_PER_SEC;
+    cfg->admin_token[0] = '\0';
+    cfg->drain_timeout_sec = DEFAULT_DRAIN_TIMEOUT_SEC;
+    cfg->rate_ip_per_sec = DEFAULT_RATE_IP_PER_SEC;
+    cfg->rate_ip_burst = DEFAULT_RATE_IP_BURST;
+    cfg->rate_client_per_sec = DEFAULT_RATE_CLIENT_PER_SEC;
+    cfg->rate_client_burst = DEFAULT_RATE_CLIENT_BURST;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f))
+    {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        char *key = line;
+        char *value = eq + 1;
+        str_trim(key);
+        str_trim(value);
+        if (*key == '\0' || *value == '\0')
+            continue;
+
+        if (strcmp(key, "host_name") == 0)
+            snprintf(cfg->host_name, sizeof(cfg->host_name), "%s", value);
+        else if (strcmp(key, "lobby_port") == 0)
+            parse_int(value, &cfg->lobby_port);
+        else if (strcmp(key, "game_port_min") == 0)
+            parse_int(value, &cfg->game_port_min);
+        else if (strcmp(key, "game_port_max") == 0)
+            parse_int(value, &cfg->game_port_max);
+        else if (strcmp(key, "max_games") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->max_games = v;
+        }
+        else if (strcmp(key, "max_players_default") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->max_players_default = v;
+        }
+        else if (strcmp(key, "join_timeout_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->join_timeout_sec = v;
+        }
+        else if (strcmp(key, "drop_timeout_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->drop_timeout_sec = v;
+        }
+        else if (strcmp(key, "idle_timeout_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->idle_timeout_sec = v;
+        }
+        else if (strcmp(key, "handshake_timeout_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->handshake_timeout_sec = v;
+        }
+        else if (strcmp(key, "forward_batch") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->forward_batch = v != 0;
+        }
+        else if (strcmp(key, "coalesce_delay_us") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->coalesce_delay_us = v;
+        }
+        else if (strcmp(key, "upgrade_socket") == 0)
+            snprintf(cfg->upgrade_socket, sizeof(cfg->upgrade_socket), "%s", value);
+        else if (strcmp(key, "journal_path") == 0)
+            snprintf(cfg->journal_path, sizeof(cfg->journal_path), "%s", value);
+        else if (strcmp(key, "snapshot_interval_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->snapshot_interval_sec = v;
+        }
+        else if (strcmp(key, "drain_timeout_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->drain_timeout_sec = v;
+        }
+        else if (strcmp(key, "rate_ip_per_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->rate_ip_per_sec = v;
+        }
+        else if (strcmp(key, "rate_ip_burst") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->rate_ip_burst = v;
+        }
+        else if (strcmp(key, "rate_client_per_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->rate_client_per_sec = v;
+        }
+        else if (strcmp(key, "rate_client_burst") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->rate_client_burst = v;
+        }
+        else if (strcmp(key, "admin_token") == 0)
+            snprintf(cfg->admin_token, sizeof(cfg->admin_token), "%s", value);
+        else if (strcmp(key, "log_level") == 0)
+            cfg->log_level = parse_log_level(value);
+        else if (strcmp(key, "log_rate_per_sec") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->log_rate_per_sec = v;
+        }
+        else if (strcmp(key, "journal_fsync_ms") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->journal_fsync_ms = v;
+        }
+        else if (strcmp(key, "lobby_processes") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->lobby_processes = v;
+        }
+        else if (strcmp(key, "prewarm_relays") == 0)
+        {
+            int v = 0;
+            if (parse_int(value, &v))
+                cfg->prewarm_relays = v;
+        }
+        else if (strcmp(key, "lobby_cpus") == 0)
+        {
+            if (!parse_cpu_list(value, cfg->lobby_cpus, &cfg->lobby_cpu_count))
+                cfg->lobby_cpu_count = -1;
+        }
+        else if (strcmp(key, "relay_cpus") == 0)
+        {
+            if (!parse_cpu_list(value, cfg->relay_cpus, &cfg->relay_cpu_count))
+                cfg->relay_cpu_count = -1;
+        }
+        else if (strcmp(key, "nic_irq_cpus") == 0)
+        {
+            if (!parse_cpu_list(value, cfg->nic_irq_cpus, &cfg->nic_irq_cpu_count))
+                cfg->nic_irq_cpu_count = -1;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+static bool validate_config(const ServerConfig *cfg)
+{
+    if (cfg->host_name[0] == '\0')
+        return false;
+    if (cfg->lobby_port <= 0 || cfg->lobby_port > 65535)
+        return false;
+    if (cfg->game_port_min <= 0 || cfg->game_port_min > 65535)
+        return false;
+    if (cfg->game_port_max <= 0 || cfg->game_port_max > 65535)
+        return false;
+    if (cfg->game_port_min > cfg->game_port_max)
+        return false;
+    if (cfg->max_games <= 0 || cfg->max_games > MAX_GAMES_LIMIT)
+        return false;
+    if (cfg->max_players_default <= 0 || cfg->max_players_default > MAX_PLAYERS_LIMIT)
+        return false;
+    if (cfg->join_timeout_sec <= 0)
+        return false;
+    if (cfg->drop_timeout_sec <= 0)
+        return false;
+    if (cfg->idle_timeout_sec <= 0)
+        return false;
+    if (cfg->handshake_timeout_sec <= 0)
+        return false;
+    if (cfg->coalesce_delay_us < 0 || cfg->coalesce_delay_us > MAX_COALESCE_DELAY_US)
+        return false;
+    if (cfg->lobby_cpu_count < 0 || cfg->relay_cpu_count < 0 || cfg->nic_irq_cpu_count < 0)
+        return false;
+    if (cfg->lobby_processes <= 0 || cfg->lobby_processes > MAX_LOBBY_PROCESSES)
+        return false;
+    if (cfg->prewarm_relays < 0 || cfg->prewarm_relays > MAX_PREWARM_RELAYS)
+        return false;
+    if (cfg->upgrade_socket[0] && cfg->lobby_processes > 1)
+        return false;
+    if (cfg->journal_path[0] && cfg->lobby_processes > 1)
+        return false;
+    if (cfg->snapshot_interval_sec <= 0)
+        return false;
+    if (cfg->journal_fsync_ms <= 0 || cfg->journal_fsync_ms > 10000)
+        return false;
+    if (cfg->log_level < 0 || cfg->log_rate_per_sec < 0)
+        return false;
+    if (cfg->drain_timeout_sec < 0)
+        return false;
+    if (cfg->rate_ip_per_sec < 0 || cfg->rate_client_per_sec < 0)
+        return false;
+    if (cfg->rate_ip_burst <= 0 || cfg->rate_ip_burst > RATE_BURST_MAX || cfg->rate_client_burst <= 0 ||
+        cfg->rate_client_burst > RATE_BURST_MAX)
+        return false;
+    return true;
+}
+
+static int cpu_numa_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "node", 4) == 0 && isdigit((unsigned char)ent->d_name[4]))
+        {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/* Records the NUMA node of every relay worker and whether it shares a node
+ * with one of the NIC's IRQ CPUs. */
+static void init_workers(const ServerConfig *cfg)
+{
+    for (int w = 0; w < cfg->relay_cpu_count; w++)
+    {
+        g_worker_node[w] = cpu_numa_node(cfg->relay_cpus[w]);
+        g_worker_near_nic[w] = false;
+        for (int i = 0; i < cfg->nic_irq_cpu_count; i++)
+        {
+            if (cpu_numa_node(cfg->nic_irq_cpus[i]) == g_worker_node[w])
+            {
+                g_worker_near_nic[w] = true;
+                break;
+            }
+        }
+    }
+}
+
+/* Every CPU the system has. Threads without a CPU of their own get this
+ * mask, so they do not inherit the pinning of the lobby thread that
+ * started them. */
+static void all_cpus(cpu_set_t *set)
+{
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+    CPU_ZERO(set);
+    for (long i = 0; i < n && i < CPU_SETSIZE; i++)
+        CPU_SET((int)i, set);
+}
+
+static bool pin_thread(pthread_t thread, const int *cpus, int count)
+{
+    if (count <= 0)
+        return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < count; i++)
+        CPU_SET(cpus[i], &set);
+    /* The error is returned, not left in errno, so copy it for log_errno. */
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0)
+        errno = err;
+    return err == 0;
+}
+
+/* Picks the least loaded relay worker, preferring workers on the same NUMA
+ * node as the NIC's IRQ CPUs. Returns -1 when no relay CPUs are configured. */
+static int pick_worker_locked(void)
+{
+    int best = -1;
+    for (int w = 0; w < g_cfg->relay_cpu_count; w++)
+    {
+        if (best < 0 ||
+            (g_worker_near_nic[w] && !g_worker_near_nic[best]) ||
+            (g_worker_near_nic[w] == g_worker_near_nic[best] && g_worker_games[w] < g_worker_games[best]))
+            best = w;
+    }
+    return best;
+}
+
+/* Returns the lowest free port in [from, to], checking 64 ports per step. */
+static int find_free_port_locked(int from, int to)
+{
+    int port = from;
+    while (port <= to)
+    {
+        int word = port / 64;
+        uint64_t free_bits = ~g_port_bits[word] & (~0ULL << (port % 64));
+        if (to < word * 64 + 63)
+            free_bits &= ~0ULL >> (63 - to % 64);
+        if (free_bits)
+            return word * 64 + __builtin_ctzll(free_bits);
+        port = (word + 1) * 64;
+    }
+    return -1;
+}
+
+/* The pool is indexed by port number, so ports handed out before a reload
+ * narrowed the range are still released correctly. Allocation continues
+ * after the last port handed out, so a just-released port is reused last
+ * and has time to leave TIME_WAIT. */
+static int acquire_game_port(void)
+{
+    int min = g_cfg->game_port_min;
+    int max = g_cfg->game_port_max;
+    int start = g_shared->port_cursor;
+    if (start < min || start > max)
+        start = min;
+
+    int port = find_free_port_locked(start, max);
+    if (port < 0 && start > min)
+        port = find_free_port_locked(min, start - 1);
+    if (port < 0)
+    {
+        g_shared->port_exhausted++;
+        return -1;
+    }
+
+    g_port_bits[port / 64] |= 1ULL << (port % 64);
+    g_shared->ports_in_use++;
+    g_shared->port_cursor = port + 1;
+    return port;
+}
+
+static void mark_game_port_used(int port)
+{
+    if (port <= 0 || port > 65535)
+        return;
+    uint64_t bit = 1ULL << (port % 64);
+    if (!(g_port_bits[port / 64] & bit))
+    {
+        g_port_bits[port / 64] |= bit;
+        g_shared->ports_in_use++;
+    }
+}
+
+static void release_game_port(int port)
+{
+    if (port <= 0 || port > 65535)
+        return;
+    uint64_t bit = 1ULL << (port % 64);
+    if (g_port_bits[port / 64] & bit)
+    {
+        g_port_bits[port / 64] &= ~bit;
+        g_shared->ports_in_use--;
+    }
+}
+
+static uint32_t fnv1a(const void *data, size_t len, uint32_t hash)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t journal_record_check(const JournalRecord *rec)
+{
+    return fnv1a(rec, offsetof(JournalRecord, check), 2166136261u);
+}
+
+/* Queues a lobby mutation for the journal writer. Called with the state lock
+ * held; it only copies into the in-memory ring, never touches the file. */
+static void journal_log_locked(uint8_t op, const Game *game, const LobbyClient *client, const char *token)
+{
+    if (!g_journal_enabled)
+        return;
+
+    uint64_t seq = ++g_journal_seq;
+    uint64_t head = atomic_load_explicit(&g_journal_head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&g_journal_tail, memory_order_acquire);
+    if (head - tail >= JOURNAL_RING_SIZE)
+    {
+        /* The writer fell behind; its next snapshot covers what is lost. */
+        atomic_store(&g_journal_overflow, true);
+        return;
+    }
+
+    JournalRecord *rec = &g_journal_ring[head % JOURNAL_RING_SIZE];
+    memset(rec, 0, sizeof(*rec));
+    rec->seq = seq;
+    rec->time = (int64_t)time(NULL);
+    rec->op = op;
+    if (game)
+    {
+        memcpy(rec->game_id, game->id, sizeof(rec->game_id));
+        memcpy(rec->game_name, game->name, sizeof(rec->game_name));
+        rec->max_players = (uint8_t)game->max_players;
+    }
+    if (client)
+    {
+        memcpy(rec->client_id, client->id, sizeof(rec->client_id));
+        memcpy(rec->client_name, client->name, sizeof(rec->client_name));
+    }
+    if (token)
+        snprintf(rec->token, sizeof(rec->token), "%s", token);
+    rec->check = journal_record_check(rec);
+    atomic_store_explicit(&g_journal_head, head + 1, memory_order_release);
+}
+
+static LobbyClient *find_client_by_id_locked(const char *id)
+{
+    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    {
+        if (g_clients[i].in_use && strcmp(g_clients[i].id, id) == 0)
+            return &g_clients[i];
+    }
+    return NULL;
+}
+
+/* Second at which a timer's game or client expires, or 0 if it no longer
+ * needs a timer. */
+static int64_t expiry_deadline_locked(int timer)
+{
+    if (timer < MAX_GAMES_LIMIT)
+    {
+        const Game *game = &g_games[timer];
+        if (!game->in_use || game->active || game->ended)
+            return 0;
+        return (int64_t)game->created_at + g_cfg->join_timeout_sec + 1;
+    }
+    const LobbyClient *client = &g_clients[timer - MAX_GAMES_LIMIT];
+    if (!client->in_use)
+        return 0;
+    if (client->events_owner)
+        return (int64_t)time(NULL) + CLIENT_EXPIRE_SEC + 1;
+    return (int64_t)client->last_seen + CLIENT_EXPIRE_SEC + 1;
+}
+
+/* Files a timer by its deadline relative to the last processed second.
+ * Deadlines beyond level 1's reach are filed in its furthest slot and
+ * refiled when they come round. */
+static void expiry_add_locked(ExpiryWheel *w, int timer, int64_t deadline)
+{
+    if (deadline <= w->now_sec)
+        deadline = w->now_sec + 1;
+    uint8_t *head;
+    if (deadline - w->now_sec < EXPIRY_SLOTS)
+    {
+        head = &w->slots[0][deadline % EXPIRY_SLOTS];
+    }
+    else
+    {
+        int64_t block = deadline / EXPIRY_SLOTS;
+        if (block - w->now_sec / EXPIRY_SLOTS > EXPIRY_SLOTS)
+            block = w->now_sec / EXPIRY_SLOTS + EXPIRY_SLOTS;
+        head = &w->slots[1][block % EXPIRY_SLOTS];
+    }
+    w->next[timer] = *head;
+    *head = (uint8_t)(timer + 1);
+    w->linked[timer] = true;
+}
+
+/* Starts the timer for a new game or client. A timer still filed for the
+ * slot's previous occupant is reused; it is re-read when it fires. */
+static void expiry_arm_locked(int timer)
+{
+    ExpiryWheel *w = &g_shared->expiry;
+    if (!w->linked[timer])
+        expiry_add_locked(w, timer, expiry_deadline_locked(timer));
+}
+
+static void expire_game_locked(Game *game, const char *reason)
+{
+    char name[GAME_NAME_MAX * 6 + 1];
+    log_event(LOG_INFO, "game_timeout", "\"id\":\"%s\",\"name\":\"%s\",\"reason\":\"%s\"", game->id,
+              json_escape(game->name, name, sizeof(name)), reason);
+    journal_log_locked(JOURNAL_EXPIRE_GAME, game, NULL, NULL);
+    game->in_use = false;
+}
+
+static void expire_client_locked(LobbyClient *client)
+{
+    journal_log_locked(JOURNAL_EXPIRE_CLIENT, NULL, client, NULL);
+    client->in_use = false;
+}
+
+/* Detaches a slot's list and refiles or fires each timer on it. */
+static void expiry_run_slot_locked(ExpiryWheel *w, uint8_t *head, int64_t now)
+{
+    uint8_t link = *head;
+    *head = 0;
+    while (link)
+    {
+        int timer = link - 1;
+        link = w->next[timer];
+        w->linked[timer] = false;
+        int64_t deadline = expiry_deadline_locked(timer);
+        if (deadline == 0)
+            continue;
+        if (deadline <= now)
+        {
+            if (timer < MAX_GAMES_LIMIT)
+                expire_game_locked(&g_games[timer], "join_timeout");
+            else
+                expire_client_locked(&g_clients[timer - MAX_GAMES_LIMIT]);
+            continue;
+        }
+        expiry_add_locked(w, timer, deadline);
+    }
+}
+
+/* Refiles every live timer. Used on first use and whenever the clock jumps
+ * too far, or backwards, to step through. */
+static void expiry_rebuild_locked(ExpiryWheel *w, int64_t now)
+{
+    memset(w, 0, sizeof(*w));
+    w->now_sec = now - 1;
+    for (int timer = 0; timer < EXPIRY_TIMERS; timer++)
+    {
+        int64_t deadline = expiry_deadline_locked(timer);
+        if (deadline != 0)
+            expiry_add_locked(w, timer, deadline);
+    }
+}
+
+/* Processes every second since the last tick. Each timer is touched once
+ * per cascade and once when it fires, so the cost does not depend on how
+ * many games and clients exist. Any lobby process may tick. */
+static void expiry_tick_locked(void)
+{
+    ExpiryWheel *w = &g_shared->expiry;
+    int64_t now = (int64_t)time(NULL);
+    if (now <= w->now_sec)
+    {
+        if (now < w->now_sec)
+            expiry_rebuild_locked(w, now);
+        return;
+    }
+    if (now - w->now_sec > EXPIRY_SLOTS * EXPIRY_SLOTS)
+        expiry_rebuild_locked(w, now);
+
+    while (w->now_sec < now)
+    {
+        /* Advance first, so timers refiled while second t is processed
+         * never land back in the slots being emptied. */
+        int64_t t = ++w->now_sec;
+        if (t % EXPIRY_SLOTS == 0)
+            expiry_run_slot_locked(w, &w->slots[1][(t / EXPIRY_SLOTS) % EXPIRY_SLOTS], t);
+        expiry_run_slot_locked(w, &w->slots[0][t % EXPIRY_SLOTS], t);
+    }
+}
+
+static LobbyClient *create_client_locked(const char *name, uint32_t ip)
+{
+    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    {
+        if (!g_clients[i].in_use)
+        {
+            g_clients[i].in_use = true;
+            gen_id(g_clients[i].id, sizeof(g_clients[i].id));
+            snprintf(g_clients[i].name, sizeof(g_clients[i].name), "%s", name);
+            g_clients[i].ip = ip;
+            g_clients[i].last_seen = time(NULL);
+            g_clients[i].pending_start = false;
+            g_clients[i].start_port = 0;
+            g_clients[i].start_host[0] = '\0';
+            g_clients[i].events_owner = 0;
+            expiry_arm_locked(MAX_GAMES_LIMIT + i);
+            return &g_clients[i];
+        }
+    }
+    return NULL;
+}
+
+/* A repeated /hello from the same address and name, such as a retry after a
+ * lost response, gets the existing client back instead of a new slot. */
+static LobbyClient *find_client_by_hello_locked(const char *name, uint32_t ip)
+{
+    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    {
+        if (g_clients[i].in_use && g_clients[i].ip == ip && strcmp(g_clients[i].name, name) == 0)
+            return &g_clients[i];
+    }
+    return NULL;
+}
+
+static uint64_t rate_client_key(const char *id)
+{
+    uint64_t key = 0;
+    memcpy(&key, id, sizeof(key));
+    return key;
+}
+
+/* Seconds until an untouched bucket is full again, after which it behaves
+ * exactly like a missing one. Client keys never fit in 32 bits. */
+static uint32_t rate_idle_sec(uint64_t key)
+{
+    int per_sec = (key >> 32) ? g_cfg->rate_client_per_sec : g_cfg->rate_ip_per_sec;
+    int burst = (key >> 32) ? g_cfg->rate_client_burst : g_cfg->rate_ip_burst;
+    if (per_sec <= 0)
+        return 0;
+    return (uint32_t)((burst + per_sec - 1) / per_sec);
+}
+
+static void rate_link_locked(RateTable *rt, uint16_t link, uint32_t delay_sec)
+{
+    if (delay_sec < 1)
+        delay_sec = 1;
+    if (delay_sec > RATE_WHEEL_SLOTS - 1)
+        delay_sec = RATE_WHEEL_SLOTS - 1;
+    int slot = (rt->wheel_pos + (int)delay_sec) % RATE_WHEEL_SLOTS;
+    rt->entries[link - 1].next = rt->wheel[slot];
+    rt->wheel[slot] = link;
+}
+
+/* Turns the wheel one slot per elapsed second. Buckets in a slot are
+ * checked lazily: refilled ones are freed, ones touched since they were
+ * filed move to the slot of their new expiry. */
+static void rate_tick_locked(RateTable *rt, uint32_t now_ms)
+{
+    uint32_t steps = (now_ms - rt->tick_ms) / 1000u;
+    if (steps > RATE_WHEEL_SLOTS)
+    {
+        steps = RATE_WHEEL_SLOTS;
+        rt->tick_ms = now_ms;
+    }
+    else
+    {
+        rt->tick_ms += steps * 1000u;
+    }
+    while (steps-- > 0)
+    {
+        rt->wheel_pos = (rt->wheel_pos + 1) % RATE_WHEEL_SLOTS;
+        uint16_t link = rt->wheel[rt->wheel_pos];
+        rt->wheel[rt->wheel_pos] = 0;
+        while (link)
+        {
+            RateEntry *e = &rt->entries[link - 1];
+            uint16_t next = e->next;
+            uint32_t idle_ms = now_ms - e->last_ms;
+            uint32_t expire_ms = rate_idle_sec(e->key) * 1000u;
+            if (idle_ms >= expire_ms)
+                e->key = 0;
+            else
+                rate_link_locked(rt, link, (expire_ms - idle_ms + 999u) / 1000u);
+            link = next;
+        }
+    }
+}
+
+/* Takes one token from the key's bucket, creating a full one on first
+ * use. Returns false if the bucket is empty. When a set is full, the
+ * least recently used bucket in it is reused. */
+static bool rate_allow_locked(uint64_t key, int per_sec, int burst, uint32_t now_ms)
+{
+    if (per_sec <= 0)
+        return true;
+
+    RateTable *rt = &g_shared->rate;
+    rate_tick_locked(rt, now_ms);
+
+    uint32_t set = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 56) % RATE_SETS;
+    RateEntry *ways = &rt->entries[set * RATE_WAYS];
+    RateEntry *e = NULL;
+    RateEntry *victim = NULL;
+    for (int w = 0; w < RATE_WAYS; w++)
+    {
+        if (ways[w].key == key)
+        {
+            e = &ways[w];
+            break;
+        }
+        if (!victim || (victim->key != 0 && (ways[w].key == 0 || (int32_t)(ways[w].last_ms - victim->last_ms) < 0)))
+            victim = &ways[w];
+    }
+
+    uint32_t cap = (uint32_t)burst * 1000u;
+    if (e)
+    {
+        uint64_t tokens = e->tokens + (uint64_t)(now_ms - e->last_ms) * (uint64_t)per_sec;
+        e->tokens = (uint16_t)(tokens < cap ? tokens : cap);
+    }
+    else
+    {
+        /* A reused bucket is already on the wheel. */
+        bool linked = victim->key != 0;
+        e = victim;
+        e->key = key;
+        e->tokens = (uint16_t)cap;
+        if (!linked)
+            rate_link_locked(rt, (uint16_t)(e - rt->entries + 1), rate_idle_sec(key) + 1);
+    }
+    e->last_ms = now_ms;
+
+    if (e->tokens < 1000u)
+    {
+        rt->limited++;
+        return false;
+    }
+    e->tokens = (uint16_t)(e->tokens - 1000u);
+    return true;
+}
+
+static Game *find_game_by_id_locked(const char *id)
+{
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        if (g_games[i].in_use && strcmp(g_games[i].id, id) == 0)
+            return &g_games[i];
+    }
+    return NULL;
+}
+
+static void remove_client_from_game_locked(Game *game, const char *client_id)
+{
+    for (int i = 0; i < game->player_count; i++)
+    {
+        if (strcmp(game->player_ids[i], client_id) == 0)
+        {
+            int last = game->player_count - 1;
+            if (i != last)
+            {
+                memmove(game->player_ids[i], game->player_ids[last], sizeof(game->player_ids[i]));
+                memmove(game->player_names[i], game->player_names[last], sizeof(game->player_names[i]));
+                memmove(game->tokens[i], game->tokens[last], sizeof(game->tokens[i]));
+            }
+            game->player_ids[last][0] = '\0';
+            game->player_names[last][0] = '\0';
+            game->tokens[last][0] = '\0';
+            game->player_count--;
+            return;
+        }
+    }
+}
+
+static void end_game_locked(Game *game)
+{
+    journal_log_locked(JOURNAL_END, game, NULL, NULL);
+    game->in_use = false;
+    game->active = false;
+    game->ended = true;
+    release_game_port(game->port);
+    if (game->worker >= 0)
+    {
+        g_worker_games[game->worker]--;
+        game->worker = -1;
+    }
+}
+
+static void end_game(Game *game)
+{
+    state_lock();
+    end_game_locked(game);
+    state_unlock();
+}
+
+static bool all_slots_connected(const bool *connected, int max_players)
+{
+    for (int s = 0; s < max_players; s++)
+    {
+        if (!connected[s])
+            return false;
+    }
+    return true;
+}
+
+static void close_handshake(PendingHandshake *hs)
+{
+    if (hs->fd >= 0)
+        close(hs->fd);
+    hs->fd = -1;
+    hs->len = 0;
+}
+
+/* Returns 1 once REGISTER has arrived, 0 while more bytes are needed and -1
+ * when the peer closed or sent something else. */
+static int read_handshake(PendingHandshake *hs)
+{
+    while (hs->len < sizeof(hs->buf))
+    {
+        ssize_t r = recv(hs->fd, hs->buf + hs->len, sizeof(hs->buf) - hs->len, 0);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        if (r == 0)
+            return -1;
+        hs->len += (size_t)r;
+    }
+    size_t cmp = hs->len < REGISTER_LEN ? hs->len : REGISTER_LEN;
+    if (strncmp(hs->buf, REGISTER_MSG, cmp) != 0)
+        return -1;
+    return hs->len >= REGISTER_LEN ? 1 : 0;
+}
+
+static void stat_add(atomic_uint_fast64_t *counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static void stat_record_send(SlotStats *st, size_t bytes, uint64_t latency_us)
+{
+    stat_add(&st->bytes_out, bytes);
+    stat_add(&st->sends, 1);
+    stat_add(&st->latency_total_us, latency_us);
+    if (latency_us > atomic_load_explicit(&st->latency_max_us, memory_order_relaxed))
+        atomic_store_explicit(&st->latency_max_us, (uint32_t)latency_us, memory_order_relaxed);
+}
+
+static void drop_slot(RelayState *rs, int slot, uint64_t now_ms)
+{
+    atomic_store_explicit(&rs->stats[slot].connected, false, memory_order_relaxed);
+    atomic_store_explicit(&rs->stats[slot].queue_bytes, 0, memory_order_relaxed);
+    close(rs->fds[slot]);
+    rs->fds[slot] = -1;
+    rs->connected[slot] = false;
+    if (rs->links)
+    {
+        rs->links[slot].len = 0;
+        rs->links[slot].blocked = false;
+    }
+    if (rs->drop_deadline == 0)
+        rs->drop_deadline = now_ms + (uint64_t)rs->cfg->drop_timeout_sec * 1000u;
+}
+
+/* Reads everything the source has queued into the destination link until
+ * EAGAIN or the link is full, adding the byte count to *received. Returns
+ * false if the source went away. */
+static bool drain_into_link(int fd, LinkBuf *link, bool discard, uint64_t now_us, size_t *received)
+{
+    unsigned char scratch[2048];
+    while (1)
+    {
+        unsigned char *dst = scratch;
+        size_t space = sizeof(scratch);
+        if (!discard)
+        {
+            space = sizeof(link->data) - link->len;
+            if (space == 0)
+                return true;
+            dst = link->data + link->len;
+        }
+        ssize_t r = recv(fd, dst, space, 0);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (r == 0)
+            return false;
+        *received += (size_t)r;
+        if (!discard)
+        {
+            if (link->len == 0)
+                link->first_us = now_us;
+            link->len += (size_t)r;
+        }
+    }
+}
+
+/* Writes out a destination's coalesced bytes with a single send. Returns false
+ * if the destination failed. */
+static bool flush_link(int fd, LinkBuf *link)
+{
+    ssize_t sent;
+    do
+    {
+        sent = send(fd, link->data, link->len, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        link->blocked = true;
+        return true;
+    }
+    if ((size_t)sent < link->len)
+        memmove(link->data, link->data + sent, link->len - (size_t)sent);
+    link->len -= (size_t)sent;
+    link->blocked = link->len > 0;
+    return true;
+}
+
+static RelayState *relay_alloc(void)
+{
+    RelayState *rs = calloc(1, sizeof(RelayState));
+    if (!rs)
+        return NULL;
+    rs->listen_fd = -1;
+    for (int i = 0; i < MAX_PLAYERS_LIMIT; i++)
+    {
+        rs->fds[i] = -1;
+        rs->connected[i] = false;
+        rs->pending[i].fd = -1;
+        rs->pending[i].len = 0;
+    }
+    return rs;
+}
+
+static void relay_free(RelayState *rs)
+{
+    for (int i = 0; i < MAX_PLAYERS_LIMIT; i++)
+    {
+        if (rs->fds[i] >= 0)
+            close(rs->fds[i]);
+        close_handshake(&rs->pending[i]);
+    }
+    if (rs->listen_fd >= 0)
+        close(rs->listen_fd);
+    config_release(rs->cfg);
+    free(rs->links);
+    free(rs);
+}
+
+/* Opens a relay listening on port. Takes ownership of the caller's
+ * reference to cfg. */
+static RelayState *relay_open(int port, int backlog, ServerConfig *cfg)
+{
+    RelayState *rs = relay_alloc();
+    if (!rs)
+    {
+        log_errno("game_relay");
+        config_release(cfg);
+        return NULL;
+    }
+    rs->cfg = cfg;
+
+    rs->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (rs->listen_fd < 0)
+    {
+        log_errno("game_socket");
+        relay_free(rs);
+        return NULL;
+    }
+
+    int one = 1;
+    setsockopt(rs->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    if (bind(rs->listen_fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    {
+        log_errno("game_bind");
+        relay_free(rs);
+        return NULL;
+    }
+
+    if (listen(rs->listen_fd, backlog) < 0 || !set_nonblocking(rs->listen_fd, true))
+    {
+        log_errno("game_listen");
+        relay_free(rs);
+        return NULL;
+    }
+
+    rs->drop_deadline = monotonic_ms() + (uint64_t)rs->cfg->drop_timeout_sec * 1000u;
+    rs->last_activity_ms = monotonic_ms();
+    return rs;
+}
+
+/* Brings a relay's link buffers and socket modes in line with the current
+ * forwarding mode. Needed for relays adopted across a hot upgrade, whose
+ * previous binary may have been configured differently. */
+static bool relay_prepare(RelayState *rs, int max_players)
+{
+    bool batch = rs->cfg->forward_batch;
+    if (batch && !rs->links)
+    {
+        rs->links = calloc((size_t)max_players, sizeof(LinkBuf));
+        if (!rs->links)
+        {
+            log_errno("game_link_buffers");
+            return false;
+        }
+    }
+    for (int i = 0; i < max_players; i++)
+    {
+        if (rs->fds[i] < 0)
+            continue;
+        set_nonblocking(rs->fds[i], batch);
+        if (!batch && rs->links && rs->links[i].len > 0)
+        {
+            send(rs->fds[i], rs->links[i].data, rs->links[i].len, MSG_NOSIGNAL);
+            rs->links[i].len = 0;
+        }
+    }
+    if (!batch)
+    {
+        free(rs->links);
+        rs->links = NULL;
+    }
+    return true;
+}
+
+static void relay_register(Game *game, RelayState *rs)
+{
+    pthread_mutex_lock(&g_relay_lock);
+    rs->parked = false;
+    g_relays[game - g_games] = rs;
+    atomic_store(&g_relay_starting[game - g_games], false);
+    pthread_cond_broadcast(&g_relay_cond);
+    pthread_mutex_unlock(&g_relay_lock);
+}
+
+/* A relay thread that will never register. */
+static void relay_start_failed(Game *game)
+{
+    pthread_mutex_lock(&g_relay_lock);
+    atomic_store(&g_relay_starting[game - g_games], false);
+    pthread_cond_broadcast(&g_relay_cond);
+    pthread_mutex_unlock(&g_relay_lock);
+}
+
+static void relay_unregister(Game *game)
+{
+    pthread_mutex_lock(&g_relay_lock);
+    g_relays[game - g_games] = NULL;
+    pthread_cond_broadcast(&g_relay_cond);
+    pthread_mutex_unlock(&g_relay_lock);
+}
+
+/* Runs the ring until the game ends (returns false) or a hot upgrade asks the
+ * relay to park its state for handoff (returns true). */
+static bool relay_loop(Game *game, RelayState *rs)
+{
+    int max_players = game->max_players;
+    bool batch = rs->links != NULL;
+    LinkBuf *links = rs->links;
+    int *fds = rs->fds;
+    bool *connected = rs->connected;
+    PendingHandshake *pending = rs->pending;
+    int sockfd = rs->listen_fd;
+
+    while (1)
+    {
+        /* Pick up a reloaded config. Forwarding mode stays as the game
+         * started; timeouts and coalescing follow the new values. */
+        unsigned generation = atomic_load(&g_cfg_generation);
+        if (generation != rs->cfg_generation)
+        {
+            ServerConfig *cfg = config_acquire();
+            config_release(rs->cfg);
+            rs->cfg = cfg;
+            rs->cfg_generation = generation;
+        }
+        uint64_t coalesce_us = (uint64_t)rs->cfg->coalesce_delay_us;
+
+        fd_set rfds;
+        fd_set wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(sockfd, &rfds);
+        int maxfd = sockfd;
+        uint64_t wait_us = 200000;
+
+        if (g_wake_pipe[0] >= 0)
+        {
+            FD_SET(g_wake_pipe[0], &rfds);
+            if (g_wake_pipe[0] > maxfd)
+                maxfd = g_wake_pipe[0];
+        }
+
+        for (int i = 0; i < max_players; i++)
+        {
+            if (fds[i] < 0)
+                continue;
+            if (batch)
+            {
+                /* A full outbound link stops reads from its source until the
+                 * destination catches up. */
+                LinkBuf *out = &links[(i + 1) % max_players];
+                if (out->len < sizeof(out->data))
+                    FD_SET(fds[i], &rfds);
+                if (links[i].blocked)
+                    FD_SET(fds[i], &wfds);
+                if (links[i].len > 0 && !links[i].blocked)
+                {
+                    uint64_t age = monotonic_us() - links[i].first_us;
+                    uint64_t left = age >= coalesce_us ? 0 : coalesce_us - age;
+                    if (left < wait_us)
+                        wait_us = left;
+                }
+            }
+            else
+            {
+                FD_SET(fds[i], &rfds);
+            }
+            if (fds[i] > maxfd)
+                maxfd = fds[i];
+        }
+        for (int h = 0; h < MAX_PLAYERS_LIMIT; h++)
+        {
+            if (pending[h].fd >= 0)
+            {
+                FD_SET(pending[h].fd, &rfds);
+                if (pending[h].fd > maxfd)
+                    maxfd = pending[h].fd;
+            }
+        }
+
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = (suseconds_t)wait_us;
+        int rv = select(maxfd + 1, &rfds, batch ? &wfds : NULL, NULL, &tv);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_errno("game_select");
+            return false;
+        }
+
+        if (atomic_load(&g_upgrading))
+        {
+            /* Re-checked under the relay lock so an aborted upgrade cannot
+             * miss a relay that parks late. */
+            pthread_mutex_lock(&g_relay_lock);
+            bool park = atomic_load(&g_upgrading);
+            if (park)
+            {
+                rs->parked = true;
+                pthread_cond_broadcast(&g_relay_cond);
+            }
+            pthread_mutex_unlock(&g_relay_lock);
+            if (park)
+                return true;
+        }
+
+        uint64_t now_us = monotonic_us();
+        uint64_t now_ms = now_us / 1000u;
+        if (atomic_load_explicit(&game->end_requested, memory_order_relaxed))
+        {
+            log_event(LOG_INFO, "game_end", "\"id\":\"%s\",\"reason\":\"forced\"", game->id);
+            return false;
+        }
+        if (atomic_load_explicit(&game->kick_mask, memory_order_relaxed))
+        {
+            unsigned kick = atomic_exchange(&game->kick_mask, 0);
+            for (int i = 0; i < max_players; i++)
+            {
+                if ((kick & (1u << i)) && fds[i] >= 0)
+                {
+                    log_event(LOG_INFO, "slot_kicked", "\"id\":\"%s\",\"slot\":%d", game->id, i);
+                    drop_slot(rs, i, now_ms);
+                }
+            }
+        }
+        if (rs->drop_deadline > 0 && now_ms >= rs->drop_deadline)
+        {
+            log_event(LOG_INFO, "game_end", "\"id\":\"%s\",\"reason\":\"drop_timeout\"", game->id);
+            return false;
+        }
+        if (rs->cfg->idle_timeout_sec > 0 &&
+            now_ms - rs->last_activity_ms >= (uint64_t)rs->cfg->idle_timeout_sec * 1000u)
+        {
+            log_event(LOG_INFO, "game_end", "\"id\":\"%s\",\"reason\":\"idle_timeout\"", game->id);
+            return false;
+        }
+
+        for (int h = 0; h < MAX_PLAYERS_LIMIT; h++)
+        {
+            if (pending[h].fd >= 0 && !FD_ISSET(pending[h].fd, &rfds) && now_ms >= pending[h].deadline_ms)
+                close_handshake(&pending[h]);
+        }
+
+        if (rv == 0 && !batch)
+            continue;
+
+        if (FD_ISSET(sockfd, &rfds))
+        {
+            while (1)
+            {
+                struct sockaddr_in cliaddr;
+                socklen_t clilen = sizeof(cliaddr);
+                int client_fd = accept(sockfd, (struct sockaddr *)&cliaddr, &clilen);
+                if (client_fd < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+
+                int h = -1;
+                for (int p = 0; p < MAX_PLAYERS_LIMIT; p++)
+                {
+                    if (pending[p].fd < 0)
+                    {
+                        h = p;
+                        break;
+                    }
+                }
+                if (h < 0 || !set_nonblocking(client_fd, true))
+                {
+                    close(client_fd);
+                    continue;
+                }
+                pending[h].fd = client_fd;
+                pending[h].len = 0;
+                pending[h].deadline_ms = now_ms + (uint64_t)rs->cfg->handshake_timeout_sec * 1000u;
+            }
+        }
+
+        for (int h = 0; h < MAX_PLAYERS_LIMIT; h++)
+        {
+            if (pending[h].fd < 0 || !FD_ISSET(pending[h].fd, &rfds))
+                continue;
+
+            int hs = read_handshake(&pending[h]);
+            if (hs == 0)
+                continue;
+            if (hs < 0)
+            {
+                close_handshake(&pending[h]);
+                continue;
+            }
+
+            int slot = -1;
+            for (int s = 0; s < max_players; s++)
+            {
+                if (!connected[s])
+                {
+                    slot = s;
+                    break;
+                }
+            }
+            /* Without batching, registered players are switched back to
+             * blocking mode so ring forwarding keeps its original send
+             * semantics. */
+            if (slot < 0 || (!batch && !set_nonblocking(pending[h].fd, false)))
+            {
+                close_handshake(&pending[h]);
+                continue;
+            }
+
+            if (fds[slot] >= 0)
+                close(fds[slot]);
+            FD_CLR(pending[h].fd, &rfds);
+            fds[slot] = pending[h].fd;
+            connected[slot] = true;
+            atomic_store_explicit(&rs->stats[slot].connected, true, memory_order_relaxed);
+            atomic_store_explicit(&rs->stats[slot].last_activity_ms, now_ms, memory_order_relaxed);
+            rs->last_activity_ms = now_ms;
+            pending[h].fd = -1;
+            pending[h].len = 0;
+            if (links)
+            {
+                links[slot].len = 0;
+                links[slot].blocked = false;
+            }
+
+            if (all_slots_connected(connected, max_players))
+                rs->drop_deadline = 0;
+        }
+
+        if (batch)
+        {
+            bool ring_up = all_slots_connected(connected, max_players);
+            for (int i = 0; i < max_players; i++)
+            {
+                if (fds[i] < 0 || !FD_ISSET(fds[i], &rfds))
+                    continue;
+                int next = (i + 1) % max_players;
+                size_t received = 0;
+                bool alive = drain_into_link(fds[i], &links[next], !ring_up || fds[next] < 0, now_us, &received);
+                stat_add(&rs->stats[i].bytes_in, received);
+                if (!alive)
+                {
+                    drop_slot(rs, i, now_ms);
+                    ring_up = false;
+                    continue;
+                }
+                atomic_store_explicit(&rs->stats[i].last_activity_ms, now_ms, memory_order_relaxed);
+                rs->last_activity_ms = now_ms;
+            }
+
+            for (int i = 0; i < max_players; i++)
+            {
+                LinkBuf *link = &links[i];
+                if (fds[i] < 0 || link->len == 0)
+                    continue;
+                if (link->blocked && !FD_ISSET(fds[i], &wfds))
+                    continue;
+                if (!link->blocked && link->len < sizeof(link->data) / 2 &&
+                    now_us - link->first_us < coalesce_us)
+                    continue;
+                size_t queued = link->len;
+                uint64_t age_us = now_us - link->first_us;
+                if (!flush_link(fds[i], link))
+                {
+                    drop_slot(rs, i, now_ms);
+                    continue;
+                }
+                if (link->len < queued)
+                    stat_record_send(&rs->stats[i], queued - link->len, age_us);
+                if (link->len > 0)
+                    link->first_us = now_us;
+            }
+            for (int i = 0; i < max_players; i++)
+                atomic_store_explicit(&rs->stats[i].queue_bytes, (uint32_t)links[i].len, memory_order_relaxed);
+            continue;
+        }
+
+        for (int i = 0; i < max_players; i++)
+        {
+            if (fds[i] < 0)
+                continue;
+            if (!FD_ISSET(fds[i], &rfds))
+                continue;
+
+            char buf[2048];
+            ssize_t r = recv(fds[i], buf, sizeof(buf), 0);
+            if (r <= 0)
+            {
+                drop_slot(rs, i, now_ms);
+                continue;
+            }
+            stat_add(&rs->stats[i].bytes_in, (uint64_t)r);
+            atomic_store_explicit(&rs->stats[i].last_activity_ms, now_ms, memory_order_relaxed);
+            rs->last_activity_ms = now_ms;
+
+            if (!all_slots_connected(connected, max_players))
+                continue;
+
+            int next = (i + 1) % max_players;
+            if (fds[next] >= 0)
+            {
+                ssize_t sent = send(fds[next], buf, (size_t)r, 0);
+                if (sent < 0)
+                    drop_slot(rs, next, now_ms);
+                else
+                    stat_record_send(&rs->stats[next], (size_t)sent, monotonic_us() - now_us);
+            }
+        }
+    }
+}
+
+/* Runs a game's relay on the calling thread. Returns true if the relay was
+ * parked for a hot upgrade and now belongs to the handoff. */
+static bool run_relay(Game *game, RelayState *rs)
+{
+    rs->stats = game->stats;
+    for (int i = 0; i < MAX_PLAYERS_LIMIT; i++)
+        atomic_store(&rs->stats[i].connected, rs->connected[i]);
+
+    if (!relay_prepare(rs, game->max_players))
+    {
+        relay_start_failed(game);
+        relay_free(rs);
+        end_game(game);
+        return false;
+    }
+
+    relay_register(game, rs);
+    if (relay_loop(game, rs))
+        return true;
+
+    relay_unregister(game);
+    relay_free(rs);
+    end_game(game);
+    return false;
+}
+
+static void *game_thread(void *arg)
+{
+    GameThreadArgs *args = (GameThreadArgs *)arg;
+    Game *game = args->game;
+    RelayState *rs = args->rs;
+    config_release(rs->cfg);
+    rs->cfg = args->cfg;
+    free(args);
+
+    run_relay(game, rs);
+    return NULL;
+}
+
+static void assign_worker_locked(Game *game)
+{
+    game->owner = getpid();
+    game->worker = pick_worker_locked();
+    if (game->worker >= 0)
+        g_worker_games[game->worker]++;
+}
+
+/* Starts a relay thread on the least loaded relay worker for a relay that is
+ * already listening: freshly bound, or adopted from a hot upgrade. If no
+ * thread can be started, the relay is closed and the game ends. */
+static void spawn_game_thread_locked(Game *game, RelayState *rs)
+{
+    assign_worker_locked(game);
+
+    GameThreadArgs *args = calloc(1, sizeof(GameThreadArgs));
+    if (!args)
+    {
+        log_errno("game_thread");
+        relay_free(rs);
+        end_game_locked(game);
+        return;
+    }
+    args->game = game;
+    args->cfg = config_acquire_locked();
+    args->rs = rs;
+
+    /* Pinning before the thread starts keeps its stack and link buffers on
+     * the worker's local NUMA node via first-touch allocation. A game with
+     * no relay CPU may run anywhere, not just on the lobby's CPUs. */
+    cpu_set_t set;
+    if (game->worker >= 0)
+    {
+        CPU_ZERO(&set);
+        CPU_SET(g_cfg->relay_cpus[game->worker], &set);
+    }
+    else
+    {
+        all_cpus(&set);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    atomic_store(&g_relay_starting[game - g_games], true);
+    int err = pthread_create(&game->thread, &attr, game_thread, args);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        /* pthread_create returns its error instead of setting errno. */
+        errno = err;
+        log_errno("game_affinity");
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&game->thread, &attr, game_thread, args);
+        pthread_attr_destroy(&attr);
+    }
+    if (err != 0)
+    {
+        errno = err;
+        log_errno("game_thread");
+        /* No waiter yet: upgrades park relays only after this returns,
+         * and resume_parked_relays calls this with the relay lock held. */
+        atomic_store(&g_relay_starting[game - g_games], false);
+        config_release(args->cfg);
+        free(args);
+        relay_free(rs);
+        end_game_locked(game);
+    }
+}
+
+static void reserve_prewarm_port_locked(int port)
+{
+    for (int i = 0; i < MAX_LOBBY_PROCESSES * MAX_PREWARM_RELAYS; i++)
+    {
+        PrewarmPort *p = &g_shared->prewarm_ports[i];
+        if (p->owner == 0)
+        {
+            p->owner = getpid();
+            p->port = port;
+            return;
+        }
+    }
+}
+
+static void unreserve_prewarm_port_locked(int port)
+{
+    for (int i = 0; i < MAX_LOBBY_PROCESSES * MAX_PREWARM_RELAYS; i++)
+    {
+        PrewarmPort *p = &g_shared->prewarm_ports[i];
+        if (p->owner == getpid() && p->port == port)
+        {
+            p->owner = 0;
+            return;
+        }
+    }
+}
+
+static void *prewarm_thread(void *arg);
+
+/* Prewarm threads may run on any CPU until a game picks their worker. */
+static bool start_prewarm_thread(PrewarmSlot *slot)
+{
+    cpu_set_t set;
+    all_cpus(&set);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, prewarm_thread, slot);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+        errno = err;
+        log_errno("prewarm_thread");
+        return false;
+    }
+    return true;
+}
+
+/* Binds a game listener and waits for start_game_locked to hand it a game.
+ * Once claimed, it starts its own replacement and becomes the game's relay
+ * thread, so thread creation and bind() stay off the lobby's path. */
+static void *prewarm_thread(void *arg)
+{
+    PrewarmSlot *slot = (PrewarmSlot *)arg;
+    RelayState *rs = NULL;
+    int port = -1;
+    while (!rs)
+    {
+        state_lock();
+        ServerConfig *cfg = config_acquire_locked();
+        port = acquire_game_port();
+        if (port >= 0)
+            reserve_prewarm_port_locked(port);
+        state_unlock();
+
+        if (port < 0)
+            config_release(cfg);
+        else
+            rs = relay_open(port, MAX_PLAYERS_LIMIT, cfg);
+        if (!rs)
+        {
+            if (port >= 0)
+            {
+                state_lock();
+                unreserve_prewarm_port_locked(port);
+                release_game_port(port);
+                state_unlock();
+            }
+            sleep(PREWARM_RETRY_SEC);
+        }
+    }
+
+    pthread_mutex_lock(&g_prewarm_lock);
+    slot->thread = pthread_self();
+    slot->rs = rs;
+    slot->port = port;
+    slot->idle = true;
+    while (!slot->game)
+        pthread_cond_wait(&slot->cond, &g_prewarm_lock);
+    Game *game = slot->game;
+    int cpu = slot->cpu;
+    config_release(rs->cfg);
+    rs->cfg = slot->cfg;
+    slot->game = NULL;
+    slot->cfg = NULL;
+    slot->rs = NULL;
+    pthread_mutex_unlock(&g_prewarm_lock);
+
+    start_prewarm_thread(slot);
+    if (cpu >= 0)
+    {
+        if (!pin_thread(pthread_self(), &cpu, 1))
+            log_errno("game_affinity");
+        /* The relay state was allocated before the worker was known. A copy
+         * made after pinning is first touched from the worker's CPU. */
+        RelayState *local = malloc(sizeof(*local));
+        if (local)
+        {
+            memcpy(local, rs, sizeof(*local));
+            free(rs);
+            rs = local;
+        }
+    }
+    rs->drop_deadline = monotonic_ms() + (uint64_t)rs->cfg->drop_timeout_sec * 1000u;
+    rs->last_activity_ms = monotonic_ms();
+    run_relay(game, rs);
+    return NULL;
+}
+
+static void start_prewarm_relays(void)
+{
+    for (int i = 0; i < g_cfg->prewarm_relays; i++)
+    {
+        pthread_cond_init(&g_prewarm[i].cond, NULL);
+        if (!start_prewarm_thread(&g_prewarm[i]))
+            return;
+        g_prewarm_count++;
+    }
+}
+
+/* Hands the game to an idle prewarmed relay. Returns false if none is
+ * ready. */
+static bool claim_prewarmed_relay_locked(Game *game)
+{
+    bool claimed = false;
+    pthread_mutex_lock(&g_prewarm_lock);
+    for (int i = 0; i < g_prewarm_count; i++)
+    {
+        PrewarmSlot *slot = &g_prewarm[i];
+        if (!slot->idle)
+            continue;
+        slot->idle = false;
+        unreserve_prewarm_port_locked(slot->port);
+        game->port = slot->port;
+        game->active = true;
+        assign_worker_locked(game);
+        game->thread = slot->thread;
+        atomic_store(&g_relay_starting[game - g_games], true);
+        slot->cpu = game->worker >= 0 ? g_cfg->relay_cpus[game->worker] : -1;
+        slot->cfg = config_acquire_locked();
+        slot->game = game;
+        pthread_cond_signal(&slot->cond);
+        claimed = true;
+        break;
+    }
+    pthread_mutex_unlock(&g_prewarm_lock);
+    return claimed;
+}
+
+static void start_game_locked(Game *game)
+{
+    uint64_t started_us = monotonic_us();
+    journal_log_locked(JOURNAL_START, game, NULL, NULL);
+    bool prewarmed = claim_prewarmed_relay_locked(game);
+    if (!prewarmed)
+    {
+        int port = acquire_game_port();
+        if (port < 0)
+        {
+            log_event(LOG_WARN, "ports_exhausted", "\"in_use\":%d,\"exhausted\":%lu", g_shared->ports_in_use,
+                      g_shared->port_exhausted);
+            game->in_use = false;
+            return;
+        }
+
+        /* Bind before /wait can report the port, so early connects are
+         * never refused. */
+        RelayState *rs = relay_open(port, game->max_players, config_acquire_locked());
+        if (!rs)
+        {
+            release_game_port(port);
+            game->in_use = false;
+            return;
+        }
+        game->port = port;
+        game->active = true;
+        spawn_game_thread_locked(game, rs);
+    }
+    uint64_t listen_us = monotonic_us() - started_us;
+
+    {
+        char name[GAME_NAME_MAX * 6 + 1];
+        char names[MAX_PLAYERS_LIMIT * (PLAYER_NAME_MAX + 3) + 1];
+        size_t used = 0;
+        names[0] = '\0';
+        for (int i = 0; i < game->player_count; i++)
+            used += (size_t)snprintf(names + used, sizeof(names) - used, "%s\"%s\"", i > 0 ? "," : "",
+                                     game->player_names[i]);
+        int cpu = game->worker >= 0 ? g_cfg->relay_cpus[game->worker] : -1;
+        int node = game->worker >= 0 ? g_worker_node[game->worker] : -1;
+        int worker_games = game->worker >= 0 ? g_worker_games[game->worker] : 0;
+        log_event(LOG_INFO, "game_start",
+                  "\"id\":\"%s\",\"name\":\"%s\",\"port\":%d,\"players\":%d,\"names\":[%s],\"cpu\":%d,"
+                  "\"node\":%d,\"worker_games\":%d,\"listen_us\":%llu,\"prewarmed\":%s",
+                  game->id, json_escape(game->name, name, sizeof(name)), game->port, game->player_count, names, cpu,
+                  node, worker_games, (unsigned long long)listen_us, prewarmed ? "true" : "false");
+    }
+
+    for (int i = 0; i < game->player_count; i++)
+    {
+        LobbyClient *client = find_client_by_id_locked(game->player_ids[i]);
+        if (client)
+        {
+            client->pending_start = true;
+            client->start_port = game->port;
+            snprintf(client->start_host, sizeof(client->start_host), "%s", g_cfg->host_name);
+        }
+    }
+    g_shared->starts++;
+
+    for (int i = 0; i < game->player_count; i++)
+    {
+        for (int gi = 0; gi < MAX_GAMES_LIMIT; gi++)
+        {
+            if (!g_games[gi].in_use || &g_games[gi] == game)
+                continue;
+            remove_client_from_game_locked(&g_games[gi], game->player_ids[i]);
+        }
+    }
+}
+
+/* Drops every pending game once the lobby is shutting down and they can no
+ * longer fill. */
+static void expire_all_pending_games_locked(void)
+{
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        Game *game = &g_games[i];
+        if (game->in_use && !game->active && !game->ended)
+            expire_game_locked(game, "shutdown");
+    }
+}
+
+static void send_http(int fd, const char *body)
+{
+    if (g_http_batch)
+    {
+        HttpBatch *batch = g_http_batch;
+        int n = snprintf(batch->buf + batch->used, sizeof(batch->buf) - batch->used, "%s%s",
+                         batch->used > 1 ? "," : "", body);
+        /* Leaves room for handle_batch's closing bracket and terminator. */
+        if (n > 0 && batch->used + (size_t)n + 1 < sizeof(batch->buf))
+            batch->used += (size_t)n;
+        return;
+    }
+
+    char header[128];
+    int len = (int)strlen(body);
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+             len, g_http_keep_alive ? "keep-alive" : "close");
+    /* One send, so a keep-alive reply does not sit behind Nagle waiting
+     * for the ACK of its header. */
+    struct iovec iov[2] = {{header, strlen(header)}, {(void *)body, (size_t)len}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+static bool view_eq(StrView v, const char *s)
+{
+    size_t n = strlen(s);
+    return v.len == n && memcmp(v.ptr, s, n) == 0;
+}
+
+static bool view_starts_with(StrView v, const char *s)
+{
+    size_t n = strlen(s);
+    return v.len >= n && memcmp(v.ptr, s, n) == 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Splits the request line into method, path and query parameters in one
+ * pass over line[0..len). */
+static HttpParseResult http_parse_request_line(const char *line, size_t len, HttpRequest *req)
+{
+    req->param_count = 0;
+    size_t i = 0;
+    req->method.ptr = line;
+    while (i < len && line[i] != ' ')
+        i++;
+    req->method.len = i;
+    if (i == 0 || i == len)
+        return HTTP_BAD;
+    i++;
+
+    req->path.ptr = line + i;
+    while (i < len && line[i] != ' ' && line[i] != '?')
+        i++;
+    req->path.len = (size_t)(line + i - req->path.ptr);
+    if (req->path.len == 0 || req->path.ptr[0] != '/')
+        return HTTP_BAD;
+
+    if (i < len && line[i] == '?')
+    {
+        i++;
+        while (i < len && line[i] != ' ')
+        {
+            size_t start = i;
+            while (i < len && line[i] != ' ' && line[i] != '&' && line[i] != '=')
+                i++;
+            StrView key = {line + start, i - start};
+            StrView value = {line + i, 0};
+            if (i < len && line[i] == '=')
+            {
+                value.ptr = line + ++i;
+                while (i < len && line[i] != ' ' && line[i] != '&')
+                    i++;
+                value.len = (size_t)(line + i - value.ptr);
+            }
+            if (key.len > 0 && req->param_count < MAX_QUERY_PARAMS)
+            {
+                req->keys[req->param_count] = key;
+                req->values[req->param_count] = value;
+                req->param_count++;
+            }
+            if (i < len && line[i] == '&')
+                i++;
+        }
+    }
+    return HTTP_COMPLETE;
+}
+
+/* Parses a request as it arrives. Resumes the search for the blank line
+ * ending the headers at *scanned, so each byte is examined once, then
+ * parses the request line. */
+static HttpParseResult http_parse(const char *buf, size_t len, size_t *scanned, HttpRequest *req)
+{
+    size_t i = *scanned;
+    const char *nl;
+    while ((nl = memchr(buf + i, '\n', len - i)) != NULL)
+    {
+        i = (size_t)(nl - buf);
+        if ((i >= 1 && buf[i - 1] == '\n') || (i >= 2 && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
+            break;
+        i++;
+    }
+    if (!nl)
+    {
+        *scanned = len;
+        return len >= REQ_BUF ? HTTP_BAD : HTTP_INCOMPLETE;
+    }
+    *scanned = i + 1;
+
+    const char *eol = memchr(buf, '\n', i + 1);
+    size_t line_len = (size_t)(eol - buf);
+    if (line_len > 0 && buf[line_len - 1] == '\r')
+        line_len--;
+    return http_parse_request_line(buf, line_len, req);
+}
+
+/* Returns true if the headers in buf[0..end) carry "Connection:
+ * keep-alive". Only requests that ask get a persistent connection, so
+ * clients that expect the server to close keep working. */
+static bool http_keep_alive(const char *buf, size_t end)
+{
+    static const char name[] = "connection:";
+    const char *line = memchr(buf, '\n', end);
+    while (line && (size_t)(++line - buf) < end)
+    {
+        const char *eol = memchr(line, '\n', end - (size_t)(line - buf));
+        size_t len = eol ? (size_t)(eol - line) : end - (size_t)(line - buf);
+        if (len > sizeof(name) - 1 && strncasecmp(line, name, sizeof(name) - 1) == 0)
+        {
+            for (size_t i = sizeof(name) - 1; i + 10 <= len; i++)
+            {
+                if (strncasecmp(line + i, "keep-alive", 10) == 0)
+                    return true;
+            }
+            return false;
+        }
+        line = eol;
+    }
+    return false;
+}
+
+/* Copies the first value for key into out, percent-decoding it and
+ * truncating to fit. out is empty if the key is absent. */
+static void http_param(const HttpRequest *req, const char *key, char *out, size_t out_len)
+{
+    out[0] = '\0';
+    for (int k = 0; k < req->param_count; k++)
+    {
+        if (!view_eq(req->keys[k], key))
+            continue;
+        const char *p = req->values[k].ptr;
+        const char *end = p + req->values[k].len;
+        size_t o = 0;
+        while (p < end && o + 1 < out_len)
+        {
+            int hi = 0;
+            int lo = 0;
+            if (*p == '%' && end - p >= 3 && (hi = hex_value(p[1])) >= 0 && (lo = hex_value(p[2])) >= 0)
+            {
+                out[o++] = (char)(hi * 16 + lo);
+                p += 3;
+            }
+            else
+            {
+                out[o++] = *p == '+' ? ' ' : *p;
+                p++;
+            }
+        }
+        out[o] = '\0';
+        return;
+    }
+}
+
+/* Appends to a response buffer, stopping cleanly when it is full. */
+static void buf_append(char *buf, size_t cap, size_t *used, const char *fmt, ...)
+{
+    if (*used + 1 >= cap)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *used, cap - *used, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *used = *used + (size_t)n < cap ? *used + (size_t)n : cap - 1;
+}
+
+static bool admin_authorized(const HttpRequest *req)
+{
+    char token[ADMIN_TOKEN_MAX + 1];
+    http_param(req, "token", token, sizeof(token));
+    const char *expect = g_cfg->admin_token;
+    size_t len = strlen(expect);
+    if (len == 0 || strlen(token) != len)
+        return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++)
+        diff |= (unsigned char)(token[i] ^ expect[i]);
+    return diff == 0;
+}
+
+static void admin_list_games(int fd)
+{
+    char *out = malloc(ADMIN_BUF);
+    if (!out)
+    {
+        send_http(fd, "{\"ok\":false,\"error\":\"no_memory\"}");
+        return;
+    }
+    size_t used = 0;
+    uint64_t now_ms = monotonic_ms();
+    time_t now = time(NULL);
+
+    state_lock();
+    buf_append(out, ADMIN_BUF, &used,
+               "{\"ok\":true,\"draining\":%s,\"ports_in_use\":%d,\"ports_exhausted\":%lu,\"rate_limited\":%lu,",
+               g_shared->draining ? "true" : "false", g_shared->ports_in_use, g_shared->port_exhausted,
+               g_shared->rate.limited);
+    buf_append(out, ADMIN_BUF, &used, "\"workers\":[");
+    for (int w = 0; w < g_cfg->relay_cpu_count; w++)
+        buf_append(out, ADMIN_BUF, &used, "%s{\"cpu\":%d,\"node\":%d,\"games\":%d}", w > 0 ? "," : "",
+                   g_cfg->relay_cpus[w], g_worker_node[w], g_worker_games[w]);
+    buf_append(out, ADMIN_BUF, &used, "],\"games\":[");
+    bool first = true;
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        Game *g = &g_games[i];
+        if (!g->in_use)
+            continue;
+        char name[GAME_NAME_MAX * 6 + 1];
+        buf_append(out, ADMIN_BUF, &used,
+                   "%s{\"id\":\"%s\",\"name\":\"%s\",\"state\":\"%s\",\"port\":%d,\"players\":%d,\"max\":%d,"
+                   "\"age_sec\":%lld,\"owner_pid\":%d,\"worker\":%d,\"names\":[",
+                   first ? "" : ",", g->id, json_escape(g->name, name, sizeof(name)),
+                   g->active ? "active" : "waiting", g->active ? g->port : 0, g->player_count, g->max_players,
+                   (long long)(now - g->created_at), (int)g->owner, g->worker);
+        first = false;
+        for (int p = 0; p < g->player_count; p++)
+        {
+            char player[PLAYER_NAME_MAX * 6 + 1];
+            buf_append(out, ADMIN_BUF, &used, "%s\"%s\"", p > 0 ? "," : "",
+                       json_escape(g->player_names[p], player, sizeof(player)));
+        }
+        buf_append(out, ADMIN_BUF, &used, "],\"slots\":[");
+        for (int s = 0; g->active && s < g->max_players; s++)
+        {
+            SlotStats *st = &g->stats[s];
+            uint64_t sends = atomic_load_explicit(&st->sends, memory_order_relaxed);
+            uint64_t last = atomic_load_explicit(&st->last_activity_ms, memory_order_relaxed);
+            buf_append(out, ADMIN_BUF, &used,
+                       "%s{\"slot\":%d,\"connected\":%s,\"bytes_in\":%llu,\"bytes_out\":%llu,\"idle_ms\":%lld,"
+                       "\"queue_bytes\":%u,\"sends\":%llu,\"latency_avg_us\":%llu,\"latency_max_us\":%u}",
+                       s > 0 ? "," : "", s,
+                       atomic_load_explicit(&st->connected, memory_order_relaxed) ? "true" : "false",
+                       (unsigned long long)atomic_load_explicit(&st->bytes_in, memory_order_relaxed),
+                       (unsigned long long)atomic_load_explicit(&st->bytes_out, memory_order_relaxed),
+                       last ? (long long)(now_ms - last) : -1LL,
+                       (unsigned)atomic_load_explicit(&st->queue_bytes, memory_order_relaxed),
+                       (unsigned long long)sends,
+                       (unsigned long long)(sends ? atomic_load_explicit(&st->latency_total_us, memory_order_relaxed) /
+                                                        sends
+                                                  : 0),
+                       (unsigned)atomic_load_explicit(&st->latency_max_us, memory_order_relaxed));
+        }
+        buf_append(out, ADMIN_BUF, &used, "]}");
+    }
+    state_unlock();
+    buf_append(out, ADMIN_BUF, &used, "]}");
+
+    send_http(fd, out);
+    free(out);
+}
+
+/* Admin endpoints, enabled by setting admin_token. Every request must carry
+ * token=<admin_token>. */
+static void handle_admin_request(int fd, const HttpRequest *req)
+{
+    char game_id[GAME_ID_LEN + 1];
+    char value[16];
+
+    if (!admin_authorized(req))
+    {
+        send_http(fd, "{\"ok\":false,\"error\":\"forbidden\"}");
+        return;
+    }
+
+    if (view_eq(req->path, "/admin/games"))
+    {
+        admin_list_games(fd);
+        return;
+    }
+
+    if (view_eq(req->path, "/admin/drain"))
+    {
+        http_param(req, "enable", value, sizeof(value));
+        bool enable = strcmp(value, "0") != 0;
+        state_lock();
+        g_shared->draining = enable;
+        state_unlock();
+        log_event(LOG_WARN, "admin_drain", "\"enable\":%s", enable ? "true" : "false");
+        send_http(fd, "{\"ok\":true}");
+        return;
+    }
+
+    if (view_eq(req->path, "/admin/shutdown"))
+    {
+        /* Same as SIGTERM; with several lobby processes the supervisor
+         * passes it on to all of them. */
+        log_event(LOG_WARN, "admin_shutdown", "");
+        kill(g_cfg->lobby_processes > 1 ? getppid() : getpid(), SIGTERM);
+        send_http(fd, "{\"ok\":true}");
+        return;
+    }
+
+    http_param(req, "game_id", game_id, sizeof(game_id));
+    if (view_eq(req->path, "/admin/end"))
+    {
+        state_lock();
+        Game *game = find_game_by_id_locked(game_id);
+        if (game && game->active)
+        {
+            atomic_store(&game->end_requested, true);
+        }
+        else if (game)
+        {
+            journal_log_locked(JOURNAL_EXPIRE_GAME, game, NULL, NULL);
+            game->in_use = false;
+        }
+        state_unlock();
+        if (!game)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
+            return;
+        }
+        log_event(LOG_WARN, "admin_end", "\"id\":\"%s\"", game_id);
+        send_http(fd, "{\"ok\":true}");
+        return;
+    }
+
+    if (view_eq(req->path, "/admin/kick"))
+    {
+        int slot = -1;
+        http_param(req, "slot", value, sizeof(value));
+        parse_int(value, &slot);
+        state_lock();
+        Game *game = find_game_by_id_locked(game_id);
+        bool ok = game && game->active && slot >= 0 && slot < game->max_players;
+        if (ok)
+            atomic_fetch_or(&game->kick_mask, 1u << slot);
+        state_unlock();
+        if (!ok)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
+            return;
+        }
+        log_event(LOG_WARN, "admin_kick", "\"id\":\"%s\",\"slot\":%d", game_id, slot);
+        send_http(fd, "{\"ok\":true}");
+        return;
+    }
+
+    send_http(fd, "{\"ok\":false,\"error\":\"unknown_command\"}");
+}
+
+static void events_copy_games_locked(EventGame *out)
+{
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        const Game *g = &g_games[i];
+        EventGame *e = &out[i];
+        memset(e, 0, sizeof(*e));
+        e->in_use = g->in_use;
+        if (!g->in_use)
+            continue;
+        e->active = g->active;
+        memcpy(e->id, g->id, sizeof(e->id));
+        memcpy(e->name, g->name, sizeof(e->name));
+        e->players = g->player_count;
+        e->max_players = g->max_players;
+    }
+}
+
+static void events_game_line(char *buf, size_t cap, size_t *used, const EventGame *e)
+{
+    char name[GAME_NAME_MAX * 6 + 1];
+    buf_append(buf, cap, used, "{\"cmd\":\"game\",\"id\":\"%s\",\"name\":\"%s\",\"players\":%d,\"max\":%d,\"active\":%s}\n",
+               e->id, json_escape(e->name, name, sizeof(name)), e->players, e->max_players,
+               e->active ? "true" : "false");
+}
+
+static bool events_send(const EventSub *sub, const char *buf, size_t len)
+{
+    return len == 0 || send(sub->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len;
+}
+
+/* Closes a stream. The client expires as usual from now on. */
+static void events_drop(int index)
+{
+    EventSub *sub = &g_event_subs[index];
+    state_lock();
+    LobbyClient *client = &g_clients[sub->client];
+    if (client->in_use && strcmp(client->id, sub->client_id) == 0 && client->events_owner == getpid())
+    {
+        client->events_owner = 0;
+        client->last_seen = time(NULL);
+    }
+    state_unlock();
+    close(sub->fd);
+    *sub = g_event_subs[--g_event_sub_count];
+}
+
+/* Sends a subscriber its start command, if its game has started. The
+ * command is consumed as /wait would, unless it could not be sent. */
+static void events_push_start(int index)
+{
+    EventSub *sub = &g_event_subs[index];
+    char line[EVENT_LINE_MAX];
+    line[0] = '\0';
+    state_lock();
+    LobbyClient *client = &g_clients[sub->client];
+    if (client->in_use && client->pending_start && strcmp(client->id, sub->client_id) == 0)
+    {
+        client->pending_start = false;
+        snprintf(line, sizeof(line), "{\"cmd\":\"start\",\"host\":\"%s\",\"port\":%d,\"token\":\"\"}\n",
+                 client->start_host, client->start_port);
+    }
+    state_unlock();
+    if (!line[0] || events_send(sub, line, strlen(line)))
+        return;
+    state_lock();
+    if (client->in_use && strcmp(client->id, sub->client_id) == 0)
+        client->pending_start = true;
+    state_unlock();
+    events_drop(index);
+}
+
+/* Pushes what changed since the last call to every subscriber: new or
+ * changed games, player counts, removed games and start commands. It
+ * compares the game table with the copy last sent, so nothing is done
+ * for subscribers while the lobby is quiet, and changes made by other
+ * lobby processes or relay threads show up by the next tick. */
+static void events_pump(void)
+{
+    if (g_event_sub_count == 0)
+        return;
+    EventGame now[MAX_GAMES_LIMIT];
+    state_lock();
+    events_copy_games_locked(now);
+    unsigned long starts = g_shared->starts;
+    state_unlock();
+
+    static char out[MAX_GAMES_LIMIT * EVENT_LINE_MAX];
+    size_t used = 0;
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        const EventGame *was = &g_event_games[i];
+        const EventGame *is = &now[i];
+        bool same_game = was->in_use && is->in_use && strcmp(was->id, is->id) == 0;
+        if (was->in_use && !same_game)
+            buf_append(out, sizeof(out), &used, "{\"cmd\":\"gone\",\"id\":\"%s\"}\n", was->id);
+        if (is->in_use && (!same_game || was->active != is->active || was->max_players != is->max_players ||
+                           strcmp(was->name, is->name) != 0))
+            events_game_line(out, sizeof(out), &used, is);
+        else if (same_game && was->players != is->players)
+            buf_append(out, sizeof(out), &used, "{\"cmd\":\"players\",\"id\":\"%s\",\"players\":%d,\"max\":%d}\n",
+                       is->id, is->players, is->max_players);
+    }
+    memcpy(g_event_games, now, sizeof(now));
+
+    for (int s = g_event_sub_count - 1; s >= 0; s--)
+    {
+        if (!events_send(&g_event_subs[s], out, used))
+            events_drop(s);
+    }
+    if (starts != g_event_starts)
+    {
+        g_event_starts = starts;
+        for (int s = g_event_sub_count - 1; s >= 0; s--)
+            events_push_start(s);
+    }
+}
+
+/* Turns the connection into an /events stream for client: a header,
+ * every current game, a "synced" line, then changes as they happen. */
+static void events_subscribe(int fd, LobbyClient *client)
+{
+    g_http_keep_alive = false;
+    if (g_event_sub_count == 0)
+    {
+        state_lock();
+        events_copy_games_locked(g_event_games);
+        g_event_starts = g_shared->starts;
+        state_unlock();
+    }
+    else
+    {
+        events_pump();
+    }
+
+    int index = (int)(client - g_clients);
+    for (int s = g_event_sub_count - 1; s >= 0; s--)
+    {
+        if (g_event_subs[s].client == index)
+            events_drop(s);
+    }
+    if (g_event_sub_count >= MAX_CLIENTS_LIMIT)
+    {
+        send_http(fd, "{\"ok\":false,\"error\":\"server_full\"}");
+        return;
+    }
+
+    static char out[MAX_GAMES_LIMIT * EVENT_LINE_MAX];
+    size_t used = 0;
+    buf_append(out, sizeof(out), &used,
+               "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\nConnection: close\r\n\r\n");
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        if (g_event_games[i].in_use)
+            events_game_line(out, sizeof(out), &used, &g_event_games[i]);
+    }
+    buf_append(out, sizeof(out), &used, "{\"cmd\":\"synced\"}\n");
+    if (send(fd, out, used, MSG_NOSIGNAL) != (ssize_t)used || !set_nonblocking(fd, true))
+        return;
+
+    EventSub *sub = &g_event_subs[g_event_sub_count++];
+    sub->fd = fd;
+    sub->client = index;
+    memcpy(sub->client_id, client->id, sizeof(sub->client_id));
+    state_lock();
+    client->events_owner = getpid();
+    state_unlock();
+    g_http_detached = true;
+    events_push_start(g_event_sub_count - 1);
+}
+
+/* ip is the peer's IPv4 address in network byte order. */
+static void handle_request(int fd, uint32_t ip, const HttpRequest *req)
+{
+    char name[PLAYER_NAME_MAX + 1];
+    char client_id[GAME_ID_LEN + 1];
+    char game_id[GAME_ID_LEN + 1];
+    char game_name[GAME_NAME_MAX + 1];
+    char max_players_str[8];
+    int max_players = 0;
+    uint32_t now_ms = (uint32_t)monotonic_ms();
+
+    state_lock();
+    bool allowed = rate_allow_locked(ip, g_cfg->rate_ip_per_sec, g_cfg->rate_ip_burst, now_ms);
+    state_unlock();
+    if (!allowed)
+    {
+        char addr[INET_ADDRSTRLEN];
+        struct in_addr in = {ip};
+        log_event(LOG_DEBUG, "rate_limited", "\"ip\":\"%s\"", inet_ntop(AF_INET, &in, addr, sizeof(addr)));
+        send_http(fd, "{\"ok\":false,\"error\":\"rate_limited\"}");
+        return;
+    }
+
+    if (view_starts_with(req->path, "/admin/"))
+    {
+        handle_admin_request(fd, req);
+        return;
+    }
+
+    if (view_eq(req->path, "/hello"))
+    {
+        http_param(req, "name", name, sizeof(name));
+        if (!is_alnum_str(name) || strlen(name) > PLAYER_NAME_MAX)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"invalid_name\"}");
+            return;
+        }
+        state_lock();
+        LobbyClient *client = find_client_by_hello_locked(name, ip);
+        if (client)
+        {
+            client->last_seen = time(NULL);
+        }
+        else
+        {
+            client = create_client_locked(name, ip);
+            if (client)
+                journal_log_locked(JOURNAL_HELLO, NULL, client, NULL);
+        }
+        state_unlock();
+        if (!client)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"server_full\"}");
+            return;
+        }
+        char body[LINE_BUF];
+        snprintf(body, sizeof(body), "{\"ok\":true,\"client_id\":\"%s\",\"name\":\"%s\"}",
+                 client->id, client->name);
+        if (g_http_batch)
+            memcpy(g_http_batch->client_id, client->id, sizeof(g_http_batch->client_id));
+        send_http(fd, body);
+        return;
+    }
+
+    http_param(req, "client_id", client_id, sizeof(client_id));
+    state_lock();
+    LobbyClient *client = find_client_by_id_locked(client_id);
+    if (client)
+    {
+        client->last_seen = time(NULL);
+        allowed = rate_allow_locked(rate_client_key(client->id), g_cfg->rate_client_per_sec,
+                                    g_cfg->rate_client_burst, now_ms);
+    }
+    state_unlock();
+
+    if (!client)
+    {
+        send_http(fd, "{\"ok\":false,\"error\":\"bad_client\"}");
+        return;
+    }
+    if (!allowed)
+    {
+        log_event(LOG_DEBUG, "rate_limited", "\"client_id\":\"%s\"", client_id);
+        send_http(fd, "{\"ok\":false,\"error\":\"rate_limited\"}");
+        return;
+    }
+
+    if (view_eq(req->path, "/list"))
+    {
+        /* The body grows with the games but stops at LIST_BODY_MAX, or at
+         * what is left of a /batch reply; a game that does not fit ends
+         * the list rather than being cut off mid-entry. */
+        static const char tail[] = "]}";
+        size_t cap = LIST_BODY_MAX;
+        if (g_http_batch && sizeof(g_http_batch->buf) - 3 - g_http_batch->used < cap)
+            cap = sizeof(g_http_batch->buf) - 3 - g_http_batch->used;
+        size_t size = cap < LINE_BUF ? cap : LINE_BUF;
+        char *out = malloc(size);
+        if (!out)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"no_memory\"}");
+            return;
+        }
+        size_t used = (size_t)snprintf(out, size, "{\"ok\":true,\"games\":[");
+        bool first = true;
+        bool truncated = false;
+        state_lock();
+        for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+        {
+            if (!g_games[i].in_use)
+                continue;
+            char name[GAME_NAME_MAX * 6 + 1];
+            char entry[LINE_BUF];
+            int n = snprintf(entry, sizeof(entry),
+                             "%s{\"id\":\"%s\",\"name\":\"%s\",\"players\":%d,\"max\":%d,\"active\":%s}",
+                             first ? "" : ",", g_games[i].id, json_escape(g_games[i].name, name, sizeof(name)),
+                             g_games[i].player_count, g_games[i].max_players,
+                             g_games[i].active ? "true" : "false");
+            size_t need = used + (size_t)n + sizeof(tail);
+            if (need > cap)
+            {
+                truncated = true;
+                break;
+            }
+            if (need > size)
+            {
+                size_t grown = size * 2 < need ? need : size * 2;
+                char *p = realloc(out, grown < cap ? grown : cap);
+                if (!p)
+                {
+                    truncated = true;
+                    break;
+                }
+                out = p;
+                size = grown < cap ? grown : cap;
+            }
+            memcpy(out + used, entry, (size_t)n);
+            used += (size_t)n;
+            first = false;
+        }
+        state_unlock();
+        memcpy(out + used, tail, sizeof(tail));
+        if (truncated)
+            log_event(LOG_WARN, "list_truncated", "\"bytes\":%zu", used + sizeof(tail) - 1);
+        send_http(fd, out);
+        free(out);
+        return;
+    }
+
+    if (view_eq(req->path, "/create"))
+    {
+        http_param(req, "name", game_name, sizeof(game_name));
+        http_param(req, "max_players", max_players_str, sizeof(max_players_str));
+        if (!parse_int(max_players_str, &max_players) || max_players <= 0 || max_players > MAX_PLAYERS_LIMIT)
+            max_players = g_cfg->max_players_default;
+
+        state_lock();
+        if (g_shared->draining)
+        {
+            state_unlock();
+            send_http(fd, "{\"ok\":false,\"error\":\"draining\"}");
+            return;
+        }
+        int slot = -1;
+        int in_use = 0;
+        for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+        {
+            if (g_games[i].in_use)
+                in_use++;
+            else if (slot < 0)
+                slot = i;
+        }
+        if (in_use >= g_cfg->max_games || slot < 0)
+        {
+            state_unlock();
+            send_http(fd, "{\"ok\":false,\"error\":\"max_games\"}");
+            return;
+        }
+
+        Game *game = &g_games[slot];
+        memset(game, 0, sizeof(*game));
+        game->in_use = true;
+        game->active = false;
+        game->ended = false;
+        game->max_players = max_players;
+        game->player_count = 0;
+        game->created_at = time(NULL);
+        game->worker = -1;
+        game->owner = 0;
+        snprintf(game->name, sizeof(game->name), "%s", game_name[0] ? game_name : "Game");
+        gen_id(game->id, sizeof(game->id));
+        expiry_arm_locked(slot);
+
+        snprintf(game->player_ids[0], sizeof(game->player_ids[0]), "%s", client->id);
+        snprintf(game->player_names[0], sizeof(game->player_names[0]), "%s", client->name);
+        gen_id(game->tokens[0], sizeof(game->tokens[0]));
+        game->player_count = 1;
+        journal_log_locked(JOURNAL_CREATE, game, client, game->tokens[0]);
+
+        state_unlock();
+
+        char body[LINE_BUF];
+        snprintf(body, sizeof(body), "{\"ok\":true,\"game_id\":\"%s\",\"status\":\"waiting\"}", game->id);
+        send_http(fd, body);
+        return;
+    }
+
+    if (view_eq(req->path, "/join"))
+    {
+        http_param(req, "game_id", game_id, sizeof(game_id));
+        state_lock();
+        if (g_shared->draining)
+        {
+            state_unlock();
+            send_http(fd, "{\"ok\":false,\"error\":\"draining\"}");
+            return;
+        }
+        Game *game = find_game_by_id_locked(game_id);
+        if (!game || game->active)
+        {
+            state_unlock();
+            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
+            return;
+        }
+        if (game->player_count >= game->max_players)
+        {
+            state_unlock();
+            send_http(fd, "{\"ok\":false,\"error\":\"full\"}");
+            return;
+        }
+
+        int idx = game->player_count++;
+        snprintf(game->player_ids[idx], sizeof(game->player_ids[idx]), "%s", client->id);
+        snprintf(game->player_names[idx], sizeof(game->player_names[idx]), "%s", client->name);
+        gen_id(game->tokens[idx], sizeof(game->tokens[idx]));
+        journal_log_locked(JOURNAL_JOIN, game, client, game->tokens[idx]);
+
+        if (game->player_count >= game->max_players)
+            start_game_locked(game);
+
+        state_unlock();
+
+        send_http(fd, "{\"ok\":true,\"status\":\"waiting\"}");
+        return;
+    }
+
+    if (view_eq(req->path, "/leave"))
+    {
+        http_param(req, "game_id", game_id, sizeof(game_id));
+        state_lock();
+        Game *game = find_game_by_id_locked(game_id);
+        if (!game || game->active)
+        {
+            state_unlock();
+            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
+            return;
+        }
+        remove_client_from_game_locked(game, client->id);
+        journal_log_locked(JOURNAL_LEAVE, game, client, NULL);
+        state_unlock();
+        send_http(fd, "{\"ok\":true}");
+        return;
+    }
+
+    if (view_eq(req->path, "/wait"))
+    {
+        http_param(req, "game_id", game_id, sizeof(game_id));
+        /* The start command is taken under the lock, so a start that
+         * another process or an /events stream is delivering goes out
+         * once, with a whole host name. */
+        char body[LINE_BUF];
+        state_lock();
+        Game *game = game_id[0] ? find_game_by_id_locked(game_id) : NULL;
+        if (game_id[0] && !game)
+        {
+            snprintf(body, sizeof(body), "{\"ok\":false,\"error\":\"not_found\"}");
+        }
+        else if (client->pending_start)
+        {
+            client->pending_start = false;
+            snprintf(body, sizeof(body),
+                     "{\"cmd\":\"start\",\"host\":\"%s\",\"port\":%d,\"token\":\"%s\"}",
+                     client->start_host, client->start_port, "");
+        }
+        else
+        {
+            snprintf(body, sizeof(body),
+                     "{\"ok\":true,\"status\":\"waiting\",\"players\":%d,\"max\":%d}",
+                     game ? game->player_count : 0, game ? game->max_players : 0);
+        }
+        state_unlock();
+        send_http(fd, body);
+        return;
+    }
+
+    if (view_eq(req->path, "/ping"))
+    {
+        send_http(fd, "{\"ok\":true}");
+        return;
+    }
+
+    if (view_eq(req->path, "/events"))
+    {
+        events_subscribe(fd, client);
+        return;
+    }
+
+    send_http(fd, "{\"ok\":false,\"error\":\"unknown\"}");
+}
+
+/* Runs each operation named in ops= as a request of its own with the
+ * same parameters, and replies with their results as one JSON array. The
+ * client_id from a hello op is used by the ops after it, so a client can
+ * say hello and list the games in one round trip. */
+static void handle_batch(int fd, uint32_t ip, const HttpRequest *req)
+{
+    static const char *const allowed[] = {"hello", "list", "create", "join", "leave", "wait", "ping"};
+    static HttpBatch batch;
+    char names[64];
+    char *ops[BATCH_MAX_OPS];
+    int op_count = 0;
+    char *save = NULL;
+
+    http_param(req, "ops", names, sizeof(names));
+    for (char *op = strtok_r(names, ",", &save); op; op = strtok_r(NULL, ",", &save))
+    {
+        if (op_count == BATCH_MAX_OPS)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"bad_request\"}");
+            return;
+        }
+        ops[op_count++] = op;
+    }
+    if (op_count == 0)
+    {
+        send_http(fd, "{\"ok\":false,\"error\":\"bad_request\"}");
+        return;
+    }
+
+    HttpRequest sub = *req;
+    int id_param = -1;
+    for (int k = 0; k < sub.param_count; k++)
+    {
+        if (view_eq(sub.keys[k], "client_id"))
+            id_param = k;
+    }
+    if (id_param < 0 && sub.param_count < MAX_QUERY_PARAMS)
+    {
+        id_param = sub.param_count++;
+        sub.keys[id_param] = (StrView){"client_id", 9};
+        sub.values[id_param] = (StrView){"", 0};
+    }
+
+    batch.used = 0;
+    batch.client_id[0] = '\0';
+    batch.buf[batch.used++] = '[';
+    g_http_batch = &batch;
+    for (int i = 0; i < op_count; i++)
+    {
+        bool known = false;
+        for (size_t a = 0; a < sizeof(allowed) / sizeof(allowed[0]); a++)
+            known = known || strcmp(ops[i], allowed[a]) == 0;
+        if (!known)
+        {
+            send_http(fd, "{\"ok\":false,\"error\":\"unknown\"}");
+            continue;
+        }
+        char path[16];
+        snprintf(path, sizeof(path), "/%s", ops[i]);
+        sub.path = (StrView){path, strlen(path)};
+        if (batch.client_id[0] && id_param >= 0)
+            sub.values[id_param] = (StrView){batch.client_id, strlen(batch.client_id)};
+        handle_request(fd, ip, &sub);
+    }
+    g_http_batch = NULL;
+    batch.buf[batch.used++] = ']';
+    batch.buf[batch.used] = '\0';
+    send_http(fd, batch.buf);
+}
+
+static bool send_with_fds(int sock, const void *buf, size_t len, const int *fds, int nfds)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)nfds);
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+static bool recv_with_fds(int sock, void *buf, size_t len, int *fds, int *nfds)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } ctrl;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    *nfds = 0;
+    ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (size_t)*nfds);
+        }
+    }
+    if (r != (ssize_t)len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+        for (int i = 0; i < *nfds; i++)
+            close(fds[i]);
+        *nfds = 0;
+        return false;
+    }
+    return true;
+}
+
+static void init_wake_pipe(void)
+{
+    if (pipe(g_wake_pipe) < 0)
+    {
+        log_errno("wake_pipe");
+        g_wake_pipe[0] = g_wake_pipe[1] = -1;
+        return;
+    }
+    set_nonblocking(g_wake_pipe[0], true);
+    set_nonblocking(g_wake_pipe[1], true);
+}
+
+static bool wait_relays_parked(void)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_PARK_TIMEOUT_SEC;
+
+    pthread_mutex_lock(&g_relay_lock);
+    while (1)
+    {
+        /* A game handed to a relay thread that has not registered yet
+         * would otherwise be shipped as running with no sockets. */
+        bool all_parked = true;
+        for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+        {
+            if (g_relays[i] ? !g_relays[i]->parked : atomic_load(&g_relay_starting[i]))
+                all_parked = false;
+        }
+        if (all_parked)
+            break;
+        if (pthread_cond_timedwait(&g_relay_cond, &g_relay_lock, &deadline) == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&g_relay_lock);
+            return false;
+        }
+    }
+    pthread_mutex_unlock(&g_relay_lock);
+    return true;
+}
+
+/* Restarts relays parked for an upgrade that did not go through. */
+static void resume_parked_relays(void)
+{
+    state_lock();
+    pthread_mutex_lock(&g_relay_lock);
+    atomic_store(&g_upgrading, false);
+    char drain[64];
+    while (read(g_wake_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        RelayState *rs = g_relays[i];
+        if (!rs || !rs->parked)
+            continue;
+        g_relays[i] = NULL;
+        if (g_games[i].worker >= 0)
+            g_worker_games[g_games[i].worker]--;
+        spawn_game_thread_locked(&g_games[i], rs);
+    }
+    pthread_mutex_unlock(&g_relay_lock);
+    state_unlock();
+}
+
+static bool send_handoff(int conn, int lobby_fd)
+{
+    HandoffClient *clients = calloc(MAX_CLIENTS_LIMIT, sizeof(HandoffClient));
+    HandoffGame *games = calloc(MAX_GAMES_LIMIT, sizeof(HandoffGame));
+    HandoffHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = HANDOFF_MAGIC;
+    hdr.version = HANDOFF_VERSION;
+    if (!clients || !games)
+    {
+        free(clients);
+        free(games);
+        return false;
+    }
+
+    state_lock();
+    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    {
+        const LobbyClient *c = &g_clients[i];
+        if (!c->in_use)
+            continue;
+        HandoffClient *out = &clients[hdr.client_count++];
+        memcpy(out->id, c->id, sizeof(out->id));
+        memcpy(out->name, c->name, sizeof(out->name));
+        out->last_seen = (int64_t)c->last_seen;
+        out->pending_start = c->pending_start;
+        out->start_port = c->start_port;
+        memcpy(out->start_host, c->start_host, sizeof(out->start_host));
+    }
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        const Game *g = &g_games[i];
+        if (!g->in_use)
+            continue;
+        HandoffGame *out = &games[hdr.game_count++];
+        out->slot = (uint32_t)i;
+        out->active = g->active;
+        memcpy(out->id, g->id, sizeof(out->id));
+        memcpy(out->name, g->name, sizeof(out->name));
+        out->max_players = g->max_players;
+        out->player_count = g->player_count;
+        out->port = g->port;
+        out->created_at = (int64_t)g->created_at;
+        memcpy(out->player_ids, g->player_ids, sizeof(out->player_ids));
+        memcpy(out->player_names, g->player_names, sizeof(out->player_names));
+        memcpy(out->tokens, g->tokens, sizeof(out->tokens));
+        if (g_relays[i])
+            hdr.relay_count++;
+    }
+    state_unlock();
+
+    bool ok = send_with_fds(conn, &hdr, sizeof(hdr), &lobby_fd, 1);
+    if (ok && hdr.client_count > 0)
+        ok = send_with_fds(conn, clients, hdr.client_count * sizeof(HandoffClient), NULL, 0);
+    if (ok && hdr.game_count > 0)
+        ok = send_with_fds(conn, games, hdr.game_count * sizeof(HandoffGame), NULL, 0);
+    free(clients);
+    free(games);
+
+    for (int i = 0; ok && i < MAX_GAMES_LIMIT; i++)
+    {
+        RelayState *rs = g_relays[i];
+        if (!rs || !g_games[i].in_use)
+            continue;
+
+        HandoffRelay rel;
+        int fds[HANDOFF_MAX_FDS];
+        int nfds = 0;
+        memset(&rel, 0, sizeof(rel));
+        rel.slot = (uint32_t)i;
+        rel.drop_deadline = rs->drop_deadline;
+        rel.last_activity_ms = rs->last_activity_ms;
+        fds[nfds++] = rs->listen_fd;
+        for (int p = 0; p < MAX_PLAYERS_LIMIT; p++)
+        {
+            if (rs->fds[p] >= 0)
+            {
+                rel.player_mask |= 1u << p;
+                fds[nfds++] = rs->fds[p];
+                if (rs->links)
+                    rel.link_len[p] = (uint32_t)rs->links[p].len;
+            }
+        }
+        for (int h = 0; h < MAX_PLAYERS_LIMIT; h++)
+        {
+            if (rs->pending[h].fd >= 0)
+            {
+                rel.pending_mask |= 1u << h;
+                fds[nfds++] = rs->pending[h].fd;
+                rel.pending_deadline[h] = rs->pending[h].deadline_ms;
+                rel.pending_len[h] = (uint32_t)rs->pending[h].len;
+                memcpy(rel.pending_buf[h], rs->pending[h].buf, sizeof(rel.pending_buf[h]));
+            }
+        }
+        ok = send_with_fds(conn, &rel, sizeof(rel), fds, nfds);
+        for (int p = 0; ok && p < MAX_PLAYERS_LIMIT; p++)
+        {
+            if (rel.link_len[p] > 0)
+                ok = send_with_fds(conn, rs->links[p].data, rel.link_len[p], NULL, 0);
+        }
+    }
+    return ok;
+}
+
+/* Runs in the old process when a new binary connects to upgrade_socket:
+ * parks every relay, ships the lobby state and all sockets, then exits once
+ * the new process acknowledges. On any failure the relays resume here. */
+static void serve_upgrade(int upgrade_fd, int lobby_fd)
+{
+    int conn = accept(upgrade_fd, NULL, NULL);
+    if (conn < 0)
+        return;
+
+    uint64_t started_us = monotonic_us();
+    atomic_store(&g_upgrading, true);
+    if (write(g_wake_pipe[1], "u", 1) < 0 && errno != EAGAIN)
+        log_errno("wake_pipe");
+
+    bool ok = wait_relays_parked() && send_handoff(conn, lobby_fd);
+    if (ok)
+    {
+        char ack = 0;
+        struct timeval tv;
+        tv.tv_sec = HANDOFF_ACK_TIMEOUT_SEC;
+        tv.tv_usec = 0;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ok = recv(conn, &ack, 1, 0) == 1 && ack == 'K';
+    }
+
+    if (ok)
+    {
+        /* Free the idle listeners' ports before the new process, which waits
+         * for this connection to close, starts prewarming its own. */
+        pthread_mutex_lock(&g_prewarm_lock);
+        for (int i = 0; i < g_prewarm_count; i++)
+        {
+            if (g_prewarm[i].idle)
+                close(g_prewarm[i].rs->listen_fd);
+        }
+        close(conn);
+        log_event(LOG_INFO, "upgrade_handoff", "\"us\":%llu", (unsigned long long)(monotonic_us() - started_us));
+        log_flush();
+        _exit(0);
+    }
+    close(conn);
+    log_event(LOG_WARN, "upgrade_failed", "");
+    resume_parked_relays();
+}
+
+static void close_fds(int *fds, int nfds)
+{
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+}
+
+/* Runs in the new process started with --upgrade. Adopts the old process's
+ * lobby listener, lobby state and running rings. Returns the lobby listener,
+ * or -1 if the handoff failed (the old process then keeps running). */
+static int receive_handoff(void)
+{
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0)
+    {
+        log_errno("upgrade_socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_cfg->upgrade_socket);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        log_errno("upgrade_connect");
+        close(sock);
+        return -1;
+    }
+
+    HandoffHeader hdr;
+    int fds[HANDOFF_MAX_FDS];
+    int nfds = 0;
+    if (!recv_with_fds(sock, &hdr, sizeof(hdr), fds, &nfds) || nfds != 1 ||
+        hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+        hdr.client_count > MAX_CLIENTS_LIMIT || hdr.game_count > MAX_GAMES_LIMIT ||
+        hdr.relay_count > hdr.game_count)
+    {
+        log_event(LOG_ERROR, "handoff_bad_header", "");
+        close_fds(fds, nfds);
+        close(sock);
+        return -1;
+    }
+    int lobby_fd = fds[0];
+
+    HandoffClient *clients = calloc(MAX_CLIENTS_LIMIT, sizeof(HandoffClient));
+    HandoffGame *games = calloc(MAX_GAMES_LIMIT, sizeof(HandoffGame));
+    RelayState *relays[MAX_GAMES_LIMIT];
+    int relay_slots[MAX_GAMES_LIMIT];
+    uint32_t relay_count = 0;
+    bool ok = clients && games;
+    if (ok && hdr.client_count > 0)
+        ok = recv_with_fds(sock, clients, hdr.client_count * sizeof(HandoffClient), fds, &nfds) && nfds == 0;
+    if (ok && hdr.game_count > 0)
+        ok = recv_with_fds(sock, games, hdr.game_count * sizeof(HandoffGame), fds, &nfds) && nfds == 0;
+
+    for (uint32_t r = 0; ok && r < hdr.relay_count; r++)
+    {
+        HandoffRelay rel;
+        ok = recv_with_fds(sock, &rel, sizeof(rel), fds, &nfds) && rel.slot < MAX_GAMES_LIMIT;
+        if (!ok)
+            break;
+
+        int max_players = 0;
+        for (uint32_t g = 0; g < hdr.game_count; g++)
+        {
+            if (games[g].slot == rel.slot)
+                max_players = games[g].max_players;
+        }
+        int expected = 1 + __builtin_popcount(rel.player_mask) + __builtin_popcount(rel.pending_mask);
+        RelayState *rs = relay_alloc();
+        if (!rs || nfds != expected || max_players <= 0 || max_players > MAX_PLAYERS_LIMIT ||
+            (rel.player_mask >> max_players) != 0)
+        {
+            close_fds(fds, nfds);
+            free(rs);
+            ok = false;
+            break;
+        }
+
+        int f = 0;
+        rs->listen_fd = fds[f++];
+        rs->drop_deadline = rel.drop_deadline;
+        rs->last_activity_ms = rel.last_activity_ms;
+        for (int p = 0; p < MAX_PLAYERS_LIMIT; p++)
+        {
+            if (rel.player_mask & (1u << p))
+            {
+                rs->fds[p] = fds[f++];
+                rs->connected[p] = true;
+            }
+        }
+        for (int h = 0; h < MAX_PLAYERS_LIMIT; h++)
+        {
+            if (rel.pending_mask & (1u << h))
+            {
+                rs->pending[h].fd = fds[f++];
+                rs->pending[h].deadline_ms = rel.pending_deadline[h];
+                rs->pending[h].len = rel.pending_len[h] < HANDSHAKE_BUF ? rel.pending_len[h] : HANDSHAKE_BUF;
+                memcpy(rs->pending[h].buf, rel.pending_buf[h], sizeof(rs->pending[h].buf));
+            }
+        }
+        relays[relay_count] = rs;
+        relay_slots[relay_count] = (int)rel.slot;
+        relay_count++;
+
+        for (int p = 0; ok && p < max_players; p++)
+        {
+            if (rel.link_len[p] == 0)
+                continue;
+            if (!rs->links)
+                rs->links = calloc((size_t)max_players, sizeof(LinkBuf));
+            ok = rs->links && rel.link_len[p] <= LINK_BUF_SIZE &&
+                 recv_with_fds(sock, rs->links[p].data, rel.link_len[p], fds, &nfds) && nfds == 0;
+            if (ok)
+            {
+                rs->links[p].len = rel.link_len[p];
+                rs->links[p].first_us = monotonic_us();
+            }
+        }
+    }
+
+    if (ok)
+    {
+        state_lock();
+        for (uint32_t i = 0; i < hdr.client_count; i++)
+        {
+            LobbyClient *c = &g_clients[i];
+            const HandoffClient *in = &clients[i];
+            memset(c, 0, sizeof(*c));
+            c->in_use = true;
+            memcpy(c->id, in->id, sizeof(c->id));
+            memcpy(c->name, in->name, sizeof(c->name));
+            c->id[GAME_ID_LEN] = '\0';
+            c->name[PLAYER_NAME_MAX] = '\0';
+            c->last_seen = (time_t)in->last_seen;
+            c->pending_start = in->pending_start != 0;
+            c->start_port = in->start_port;
+            memcpy(c->start_host, in->start_host, sizeof(c->start_host));
+            c->start_host[sizeof(c->start_host) - 1] = '\0';
+        }
+        for (uint32_t i = 0; i < hdr.game_count; i++)
+        {
+            const HandoffGame *in = &games[i];
+            if (in->slot >= MAX_GAMES_LIMIT || in->max_players <= 0 || in->max_players > MAX_PLAYERS_LIMIT ||
+                in->player_count < 0 || in->player_count > in->max_players)
+                continue;
+            Game *g = &g_games[in->slot];
+            memset(g, 0, sizeof(*g));
+            g->in_use = true;
+            g->active = in->active != 0;
+            memcpy(g->id, in->id, sizeof(g->id));
+            memcpy(g->name, in->name, sizeof(g->name));
+            g->id[GAME_ID_LEN] = '\0';
+            g->name[GAME_NAME_MAX] = '\0';
+            g->max_players = in->max_players;
+            g->player_count = in->player_count;
+            g->port = in->port;
+            g->created_at = (time_t)in->created_at;
+            memcpy(g->player_ids, in->player_ids, sizeof(g->player_ids));
+            memcpy(g->player_names, in->player_names, sizeof(g->player_names));
+            memcpy(g->tokens, in->tokens, sizeof(g->tokens));
+            g->worker = -1;
+            if (g->active)
+                mark_game_port_used(g->port);
+        }
+        state_unlock();
+
+        char ack = 'K';
+        ok = send(sock, &ack, 1, MSG_NOSIGNAL) == 1;
+        if (ok)
+        {
+            /* The old process closes the connection just before it exits. */
+            struct timeval tv;
+            tv.tv_sec = HANDOFF_ACK_TIMEOUT_SEC;
+            tv.tv_usec = 0;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            recv(sock, &ack, 1, 0);
+        }
+    }
+
+    if (ok)
+    {
+        state_lock();
+        for (uint32_t r = 0; r < relay_count; r++)
+            spawn_game_thread_locked(&g_games[relay_slots[r]], relays[r]);
+        state_unlock();
+    }
+    else
+    {
+        log_event(LOG_ERROR, "handoff_failed", "");
+        for (uint32_t r = 0; r < relay_count; r++)
+            relay_free(relays[r]);
+        close(lobby_fd);
+        lobby_fd = -1;
+    }
+
+    free(clients);
+    free(games);
+    close(sock);
+    return lobby_fd;
+}
+
+static int open_upgrade_listener(void)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0)
+    {
+        log_errno("upgrade_socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", g_cfg->upgrade_socket);
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+    {
+        log_errno("upgrade_bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void journal_path_snapshot(const ServerConfig *cfg, char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s.snap", cfg->journal_path);
+}
+
+static bool journal_open(const ServerConfig *cfg, bool wait_for_lock)
+{
+    g_journal_fd = open(cfg->journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (g_journal_fd < 0)
+    {
+        log_errno("journal_open");
+        return false;
+    }
+    if (flock(g_journal_fd, LOCK_EX | (wait_for_lock ? 0 : LOCK_NB)) < 0)
+    {
+        log_errno("journal_lock");
+        close(g_journal_fd);
+        g_journal_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t w = write(fd, p, len);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += w;
+        len -= (size_t)w;
+    }
+    return true;
+}
+
+/* Writes a compacted snapshot of the lobby and truncates the journal. Every
+ * record already in the journal file has a seq at or below the snapshot's,
+ * so nothing newer is lost by the truncation. */
+static bool journal_write_snapshot(const ServerConfig *cfg)
+{
+    HandoffClient *clients = calloc(MAX_CLIENTS_LIMIT, sizeof(HandoffClient));
+    HandoffGame *games = calloc(MAX_GAMES_LIMIT, sizeof(HandoffGame));
+    if (!clients || !games)
+    {
+        free(clients);
+        free(games);
+        return false;
+    }
+
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+
+    atomic_store(&g_journal_overflow, false);
+    state_lock();
+    hdr.seq = g_journal_seq;
+    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    {
+        const LobbyClient *c = &g_clients[i];
+        if (!c->in_use)
+            continue;
+        HandoffClient *out = &clients[hdr.client_count++];
+        memcpy(out->id, c->id, sizeof(out->id));
+        memcpy(out->name, c->name, sizeof(out->name));
+        out->last_seen = (int64_t)c->last_seen;
+    }
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+    {
+        const Game *g = &g_games[i];
+        if (!g->in_use || g->active)
+            continue;
+        HandoffGame *out = &games[hdr.game_count++];
+        out->slot = (uint32_t)i;
+        memcpy(out->id, g->id, sizeof(out->id));
+        memcpy(out->name, g->name, sizeof(out->name));
+        out->max_players = g->max_players;
+        out->player_count = g->player_count;
+        out->created_at = (int64_t)g->created_at;
+        memcpy(out->player_ids, g->player_ids, sizeof(out->player_ids));
+        memcpy(out->player_names, g->player_names, sizeof(out->player_names));
+        memcpy(out->tokens, g->tokens, sizeof(out->tokens));
+    }
+    state_unlock();
+
+    uint32_t check = fnv1a(&hdr, sizeof(hdr), 2166136261u);
+    check = fnv1a(clients, hdr.client_count * sizeof(HandoffClient), check);
+    check = fnv1a(games, hdr.game_count * sizeof(HandoffGame), check);
+
+    char path[sizeof(g_cfg->journal_path) + 8];
+    char tmp[sizeof(path) + 4];
+    journal_path_snapshot(cfg, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    bool ok = false;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0)
+    {
+        ok = write_all(fd, &hdr, sizeof(hdr)) &&
+             write_all(fd, clients, hdr.client_count * sizeof(HandoffClient)) &&
+             write_all(fd, games, hdr.game_count * sizeof(HandoffGame)) &&
+             write_all(fd, &check, sizeof(check)) && fsync(fd) == 0;
+        close(fd);
+    }
+    free(clients);
+    free(games);
+
+    if (!ok || rename(tmp, path) < 0)
+    {
+        log_errno("journal_snapshot");
+        unlink(tmp);
+        return false;
+    }
+    if (ftruncate(g_journal_fd, 0) < 0)
+        log_errno("journal_truncate");
+    return true;
+}
+
+static void journal_apply_locked(const JournalRecord *rec, time_t now)
+{
+    Game *game = rec->game_id[0] ? find_game_by_id_locked(rec->game_id) : NULL;
+
+    switch (rec->op)
+    {
+    case JOURNAL_HELLO:
+        for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+        {
+            LobbyClient *c = &g_clients[i];
+            if (c->in_use)
+                continue;
+            memset(c, 0, sizeof(*c));
+            c->in_use = true;
+            memcpy(c->id, rec->client_id, sizeof(c->id));
+            memcpy(c->name, rec->client_name, sizeof(c->name));
+            c->last_seen = now;
+            break;
         }
+        break;
+    case JOURNAL_EXPIRE_CLIENT:
+    {
+        LobbyClient *c = find_client_by_id_locked(rec->client_id);
+        if (c)
+            c->in_use = false;
+        break;
+    }
+    case JOURNAL_CREATE:
+        for (int i = 0; i < MAX_GAMES_LIMIT; i++)
+        {
+            Game *g = &g_games[i];
+            if (g->in_use)
+                continue;
+            memset(g, 0, sizeof(*g));
+            g->in_use = true;
+            g->max_players = rec->max_players;
+            g->created_at = (time_t)rec->time;
+            g->worker = -1;
+            memcpy(g->id, rec->game_id, sizeof(g->id));
+            memcpy(g->name, rec->game_name, sizeof(g->name));
+            memcpy(g->player_ids[0], rec->client_id, sizeof(g->player_ids[0]));
+            memcpy(g->player_names[0], rec->client_name, sizeof(g->player_names[0]));
+            memcpy(g->tokens[0], rec->token, sizeof(g->tokens[0]));
+            g->player_count = 1;
+            break;
+        }
+        break;
+    case JOURNAL_JOIN:
+        if (game && game->player_count < game->max_players && game->player_count < MAX_PLAYERS_LIMIT)
+        {
+            int idx = game->player_count++;
+            memcpy(game->player_ids[idx], rec->client_id, sizeof(game->player_ids[idx]));
+            memcpy(game->player_names[idx], rec->client_name, sizeof(game->player_names[idx]));
+            memcpy(game->tokens[idx], rec->token, sizeof(game->tokens[idx]));
+        }
+        break;
+    case JOURNAL_LEAVE:
+        if (game)
+            remove_client_from_game_locked(game, rec->client_id);
+        break;
+    case JOURNAL_START:
+        /* The ring itself died with the old process; its players are free
+         * again, exactly as they were left by start_game_locked. */
+        if (game)
+        {
+            for (int p = 0; p < game->player_count; p++)
+            {
+                for (int gi = 0; gi < MAX_GAMES_LIMIT; gi++)
+                {
+                    if (g_games[gi].in_use && &g_games[gi] != game)
+                        remove_client_from_game_locked(&g_games[gi], game->player_ids[p]);
+                }
+            }
+            game->in_use = false;
+        }
+        break;
+    case JOURNAL_EXPIRE_GAME:
+    case JOURNAL_END:
+        if (game)
+            game->in_use = false;
+        break;
+    default:
+        break;
     }
-    return NULL;
 }
 
-static Game *find_game_by_id_locked(const char *id)
+/* Rebuilds the lobby from the last snapshot plus the journal tail. Stops at
+ * the first torn or corrupt record, which can only be the last one written
+ * before a crash. */
+static void journal_replay(void)
 {
-    for (int i = 0; i < g_cfg.max_games; i++)
+    uint64_t started_us = monotonic_us();
+    time_t now = time(NULL);
+    uint64_t snap_seq = 0;
+    int clients_loaded = 0;
+    int games_loaded = 0;
+    int records = 0;
+
+    char path[sizeof(g_cfg->journal_path) + 8];
+    journal_path_snapshot(g_cfg, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (f)
     {
-        if (g_games[i].in_use && strcmp(g_games[i].id, id) == 0)
-            return &g_games[i];
+        SnapshotHeader hdr;
+        HandoffClient *clients = calloc(MAX_CLIENTS_LIMIT, sizeof(HandoffClient));
+        HandoffGame *games = calloc(MAX_GAMES_LIMIT, sizeof(HandoffGame));
+        uint32_t check = 0;
+        bool ok = clients && games && fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+                  hdr.magic == SNAPSHOT_MAGIC && hdr.version == SNAPSHOT_VERSION &&
+                  hdr.client_count <= MAX_CLIENTS_LIMIT && hdr.game_count <= MAX_GAMES_LIMIT &&
+                  fread(clients, sizeof(HandoffClient), hdr.client_count, f) == hdr.client_count &&
+                  fread(games, sizeof(HandoffGame), hdr.game_count, f) == hdr.game_count &&
+                  fread(&check, sizeof(check), 1, f) == 1;
+        if (ok)
+        {
+            uint32_t expect = fnv1a(&hdr, sizeof(hdr), 2166136261u);
+            expect = fnv1a(clients, hdr.client_count * sizeof(HandoffClient), expect);
+            expect = fnv1a(games, hdr.game_count * sizeof(HandoffGame), expect);
+            ok = expect == check;
+        }
+        if (ok)
+        {
+            state_lock();
+            for (uint32_t i = 0; i < hdr.client_count; i++)
+            {
+                LobbyClient *c = &g_clients[i];
+                memset(c, 0, sizeof(*c));
+                c->in_use = true;
+                memcpy(c->id, clients[i].id, sizeof(c->id));
+                memcpy(c->name, clients[i].name, sizeof(c->name));
+                c->id[GAME_ID_LEN] = '\0';
+                c->name[PLAYER_NAME_MAX] = '\0';
+                c->last_seen = now;
+                clients_loaded++;
+            }
+            for (uint32_t i = 0; i < hdr.game_count; i++)
+            {
+                const HandoffGame *in = &games[i];
+                if (in->slot >= MAX_GAMES_LIMIT || in->max_players <= 0 || in->max_players > MAX_PLAYERS_LIMIT ||
+                    in->player_count < 0 || in->player_count > in->max_players)
+                    continue;
+                Game *g = &g_games[in->slot];
+                memset(g, 0, sizeof(*g));
+                g->in_use = true;
+                memcpy(g->id, in->id, sizeof(g->id));
+                memcpy(g->name, in->name, sizeof(g->name));
+                g->id[GAME_ID_LEN] = '\0';
+                g->name[GAME_NAME_MAX] = '\0';
+                g->max_players = in->max_players;
+                g->player_count = in->player_count;
+                g->created_at = (time_t)in->created_at;
+                g->worker = -1;
+                memcpy(g->player_ids, in->player_ids, sizeof(g->player_ids));
+                memcpy(g->player_names, in->player_names, sizeof(g->player_names));
+                memcpy(g->tokens, in->tokens, sizeof(g->tokens));
+                games_loaded++;
+            }
+            state_unlock();
+            snap_seq = hdr.seq;
+        }
+        else
+        {
+            char escaped[sizeof(path) * 6];
+            log_event(LOG_WARN, "journal_snapshot_unreadable", "\"path\":\"%s\"",
+                      json_escape(path, escaped, sizeof(escaped)));
+        }
+        free(clients);
+        free(games);
+        fclose(f);
     }
-    return NULL;
+
+    g_journal_seq = snap_seq;
+    f = fopen(g_cfg->journal_path, "rb");
+    if (f)
+    {
+        JournalRecord rec;
+        state_lock();
+        while (fread(&rec, sizeof(rec), 1, f) == 1)
+        {
+            if (rec.check != journal_record_check(&rec))
+                break;
+            if (rec.seq <= snap_seq)
+                continue;
+            rec.client_id[GAME_ID_LEN] = '\0';
+            rec.client_name[PLAYER_NAME_MAX] = '\0';
+            rec.game_id[GAME_ID_LEN] = '\0';
+            rec.game_name[GAME_NAME_MAX] = '\0';
+            rec.token[TOKEN_LEN] = '\0';
+            journal_apply_locked(&rec, now);
+            if (rec.seq > g_journal_seq)
+                g_journal_seq = rec.seq;
+            records++;
+        }
+        state_unlock();
+        fclose(f);
+    }
+
+    log_event(LOG_INFO, "journal_replay", "\"clients\":%d,\"games\":%d,\"records\":%d,\"us\":%llu",
+              clients_loaded, games_loaded, records, (unsigned long long)(monotonic_us() - started_us));
 }
 
-static void remove_client_from_game_locked(Game *game, const char *client_id)
+static void *journal_thread(void *arg)
 {
-    for (int i = 0; i < game->player_count; i++)
+    bool upgrade = arg != NULL;
+    ServerConfig *cfg = config_acquire();
+    if (upgrade && !journal_open(cfg, true))
     {
-        if (strcmp(game->player_ids[i], client_id) == 0)
+        config_release(cfg);
+        return NULL;
+    }
+    journal_write_snapshot(cfg);
+    config_release(cfg);
+
+    JournalRecord batch[JOURNAL_BATCH];
+    uint64_t last_snapshot_ms = monotonic_ms();
+    bool dirty = false;
+
+    while (1)
+    {
+        cfg = config_acquire();
+        struct timespec pause;
+        pause.tv_sec = cfg->journal_fsync_ms / 1000;
+        pause.tv_nsec = (long)(cfg->journal_fsync_ms % 1000) * 1000000L;
+        nanosleep(&pause, NULL);
+
+        bool stop = atomic_load(&g_journal_stop);
+        bool wrote = false;
+        while (1)
         {
-            int last = game->player_count - 1;
-            if (i != last)
+            uint64_t tail = atomic_load_explicit(&g_journal_tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&g_journal_head, memory_order_acquire);
+            size_t n = 0;
+            while (tail + n < head && n < JOURNAL_BATCH)
             {
-                memmove(game->player_ids[i], game->player_ids[last], sizeof(game->player_ids[i]));
-                memmove(game->player_names[i], game->player_names[last], sizeof(game->player_names[i]));
-                memmove(game->tokens[i], game->tokens[last], sizeof(game->tokens[i]));
+                batch[n] = g_journal_ring[(tail + n) % JOURNAL_RING_SIZE];
+                n++;
             }
-            game->player_ids[last][0] = '\0';
-            game->player_names[last][0] = '\0';
-            game->tokens[last][0] = '\0';
-            game->player_count--;
-            return;
+            if (n == 0)
+                break;
+            atomic_store_explicit(&g_journal_tail, tail + n, memory_order_release);
+            if (!write_all(g_journal_fd, batch, n * sizeof(JournalRecord)))
+                log_errno("journal_write");
+            wrote = true;
+        }
+        if (wrote)
+        {
+            if (fdatasync(g_journal_fd) < 0)
+                log_errno("journal_fsync");
+            dirty = true;
+        }
+        if (stop)
+        {
+            journal_write_snapshot(cfg);
+            config_release(cfg);
+            atomic_store(&g_journal_stopped, true);
+            return NULL;
+        }
+
+        uint64_t now_ms = monotonic_ms();
+        if (atomic_load(&g_journal_overflow) ||
+            (dirty && now_ms - last_snapshot_ms >= (uint64_t)cfg->snapshot_interval_sec * 1000u))
+        {
+            if (journal_write_snapshot(cfg))
+                dirty = false;
+            last_snapshot_ms = now_ms;
         }
+        config_release(cfg);
     }
+    return NULL;
 }
 
-static void end_game(Game *game)
+/* Restores the lobby from disk (unless it was just handed over by a hot
+ * upgrade) and starts the journal writer. */
+static bool journal_start(bool upgrade)
 {
-    pthread_mutex_lock(&g_lock);
-    game->in_use = false;
-    game->active = false;
-    game->ended = true;
-    release_game_port(game->port);
-    pthread_mutex_unlock(&g_lock);
+    if (!upgrade)
+    {
+        if (!journal_open(g_cfg, false))
+            return false;
+        journal_replay();
+    }
+    g_journal_enabled = true;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, journal_thread, upgrade ? (void *)1 : NULL) != 0)
+    {
+        log_errno("journal_thread");
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
 }
 
-static void *game_thread(void *arg)
+/* Has the writer flush what is queued and leave a final snapshot, so a clean
+ * exit replays nothing stale. */
+static void journal_stop(void)
 {
-    GameThreadArgs *args = (GameThreadArgs *)arg;
-    Game *game = args->game;
-    int max_players = game->max_players;
+    if (!g_journal_enabled)
+        return;
+    atomic_store(&g_journal_stop, true);
+    uint64_t deadline = monotonic_ms() + JOURNAL_STOP_TIMEOUT_MS;
+    while (!atomic_load(&g_journal_stopped) && monotonic_ms() < deadline)
+    {
+        struct timespec pause = {0, 10 * 1000000L};
+        nanosleep(&pause, NULL);
+    }
+    if (!atomic_load(&g_journal_stopped))
+        log_event(LOG_WARN, "journal_stop_timeout", "");
+}
+
+static bool create_shared_state(void)
+{
+    void *mem = mmap(NULL, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return false;
+    g_shared = (SharedState *)mem;
 
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&g_shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0)
+        return false;
+
+    g_games = g_shared->games;
+    g_clients = g_shared->clients;
+    g_worker_games = g_shared->worker_games;
+    g_port_bits = g_shared->port_bits;
+    return true;
+}
+
+static int open_lobby_listener(void)
+{
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0)
     {
-        perror("game socket");
-        end_game(game);
-        free(args);
-        return NULL;
+        log_errno("lobby_socket");
+        return -1;
     }
 
     int one = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (g_cfg->lobby_processes > 1 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        log_errno("lobby_reuseport");
+        close(sockfd);
+        return -1;
+    }
 
     struct sockaddr_in servaddr;
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(game->port);
+    servaddr.sin_port = htons(g_cfg->lobby_port);
 
     if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
     {
-        perror("game bind");
+        log_errno("lobby_bind");
         close(sockfd);
-        end_game(game);
-        free(args);
-        return NULL;
+        return -1;
     }
 
-    if (listen(sockfd, max_players) < 0)
+    if (listen(sockfd, 16) < 0)
     {
-        perror("game listen");
+        log_errno("lobby_listen");
         close(sockfd);
-        end_game(game);
-        free(args);
-        return NULL;
+        return -1;
     }
+    return sockfd;
+}
 
-    int fds[MAX_PLAYERS_LIMIT];
-    bool connected[MAX_PLAYERS_LIMIT];
-    for (int i = 0; i < max_players; i++)
+static void handle_sighup(int sig)
+{
+    (void)sig;
+    int saved = errno;
+    g_reload_requested = 1;
+    if (g_reload_pipe[1] >= 0)
     {
-        fds[i] = -1;
-        connected[i] = false;
+        ssize_t w = write(g_reload_pipe[1], "r", 1);
+        (void)w;
     }
+    errno = saved;
+}
 
-    uint64_t drop_deadline = (uint64_t)time(NULL) * 1000u + (uint64_t)g_cfg.drop_timeout_sec * 1000u;
-    uint64_t last_activity_ms = (uint64_t)time(NULL) * 1000u;
-
-    while (1)
+static void handle_sigterm(int sig)
+{
+    (void)sig;
+    int saved = errno;
+    g_shutdown_requested++;
+    if (g_reload_pipe[1] >= 0)
     {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(sockfd, &rfds);
-        int maxfd = sockfd;
-
-        for (int i = 0; i < max_players; i++)
-        {
-            if (fds[i] >= 0)
-            {
-                FD_SET(fds[i], &rfds);
-                if (fds[i] > maxfd)
-                    maxfd = fds[i];
-            }
-        }
-
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;
-        int rv = select(maxfd + 1, &rfds, NULL, NULL, &tv);
-        if (rv < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            perror("game select");
-            break;
-        }
-
-        uint64_t now_ms = (uint64_t)time(NULL) * 1000u;
-        if (drop_deadline > 0 && now_ms >= drop_deadline)
-        {
-            printf("Game %s ended due to drop timeout\n", game->id);
-            break;
-        }
-        if (g_cfg.idle_timeout_sec > 0 &&
-            now_ms - last_activity_ms >= (uint64_t)g_cfg.idle_timeout_sec * 1000u)
-        {
-            printf("Game %s ended due to idle timeout\n", game->id);
-            break;
-        }
-
-        if (rv == 0)
-            continue;
-
-        if (FD_ISSET(sockfd, &rfds))
-        {
-            struct sockaddr_in cliaddr;
-            socklen_t clilen = sizeof(cliaddr);
-            int client_fd = accept(sockfd, (struct sockaddr *)&cliaddr, &clilen);
-            if (client_fd >= 0)
-            {
-                char buf[32];
-                ssize_t r = recv(client_fd, buf, sizeof(buf), 0);
-                if (r <= 0 || strncmp(buf, "REGISTER", 8) != 0)
-                {
-                    close(client_fd);
-                }
-                else
-                {
-                    int slot = -1;
-                    for (int s = 0; s < max_players; s++)
-                    {
-                        if (!connected[s])
-                        {
-                            slot = s;
-                            break;
-                        }
-                    }
-                    if (slot < 0)
-                    {
-                        close(client_fd);
-                    }
-                    else
-                    {
-                        if (fds[slot] >= 0)
-                            close(fds[slot]);
-                        fds[slot] = client_fd;
-                        connected[slot] = true;
-                        last_activity_ms = now_ms;
-
-                        bool all_connected = true;
-                        for (int s = 0; s < max_players; s++)
-                        {
-                            if (!connected[s])
-                            {
-                                all_connected = false;
-                                break;
-                            }
-                        }
-                        if (all_connected)
-                            drop_deadline = 0;
-                    }
-                }
-            }
-        }
-
-        for (int i = 0; i < max_players; i++)
-        {
-            if (fds[i] < 0)
-                continue;
-            if (!FD_ISSET(fds[i], &rfds))
-                continue;
-
-            char buf[2048];
-            ssize_t r = recv(fds[i], buf, sizeof(buf), 0);
-            if (r <= 0)
-            {
-                close(fds[i]);
-                fds[i] = -1;
-                connected[i] = false;
-                if (drop_deadline == 0)
-                    drop_deadline = now_ms + (uint64_t)g_cfg.drop_timeout_sec * 1000u;
-                continue;
-            }
-            last_activity_ms = now_ms;
-
-            bool all_connected = true;
-            for (int s = 0; s < max_players; s++)
-            {
-                if (!connected[s])
-                {
-                    all_connected = false;
-                    break;
-                }
-            }
-            if (!all_connected)
-                continue;
-
-            int next = (i + 1) % max_players;
-            if (fds[next] >= 0)
-            {
-                ssize_t sent = send(fds[next], buf, (size_t)r, 0);
-                if (sent < 0)
-                {
-                    close(fds[next]);
-                    fds[next] = -1;
-                    connected[next] = false;
-                    if (drop_deadline == 0)
-                        drop_deadline = now_ms + (uint64_t)g_cfg.drop_timeout_sec * 1000u;
-                }
-            }
-        }
+        ssize_t w = write(g_reload_pipe[1], "t", 1);
+        (void)w;
     }
+    errno = saved;
+}
 
-    for (int i = 0; i < max_players; i++)
+/* The supervisor wants SIGHUP and SIGTERM to interrupt waitpid(); lobby
+ * processes restart their calls and pick them up from the pipe instead. */
+static void init_signals(bool restart)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sighup;
+    sa.sa_flags = restart ? SA_RESTART : 0;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = handle_sigterm;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
+
+/* The signal may land on any thread, so the lobby loop watches a pipe the
+ * handler writes to rather than relying on poll() being interrupted. */
+static void init_reload_pipe(void)
+{
+    if (pipe(g_reload_pipe) < 0)
     {
-        if (fds[i] >= 0)
-            close(fds[i]);
+        log_errno("reload_pipe");
+        return;
     }
-    close(sockfd);
+    fcntl(g_reload_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(g_reload_pipe[1], F_SETFD, FD_CLOEXEC);
+    set_nonblocking(g_reload_pipe[0], true);
+    set_nonblocking(g_reload_pipe[1], true);
+}
 
-    end_game(game);
-    free(args);
-    return NULL;
+/* Keys that size or bind process-wide resources only take effect on
+ * restart. Returns true if any of them changed. */
+static bool keep_restart_only_keys(ServerConfig *next, const ServerConfig *cur)
+{
+    bool changed = next->lobby_port != cur->lobby_port || next->lobby_processes != cur->lobby_processes ||
+                   next->prewarm_relays != cur->prewarm_relays ||
+                   next->lobby_cpu_count != cur->lobby_cpu_count || next->relay_cpu_count != cur->relay_cpu_count ||
+                   next->nic_irq_cpu_count != cur->nic_irq_cpu_count ||
+                   memcmp(next->lobby_cpus, cur->lobby_cpus, sizeof(cur->lobby_cpus)) != 0 ||
+                   memcmp(next->relay_cpus, cur->relay_cpus, sizeof(cur->relay_cpus)) != 0 ||
+                   memcmp(next->nic_irq_cpus, cur->nic_irq_cpus, sizeof(cur->nic_irq_cpus)) != 0 ||
+                   strcmp(next->upgrade_socket, cur->upgrade_socket) != 0 ||
+                   strcmp(next->journal_path, cur->journal_path) != 0;
+
+    next->lobby_port = cur->lobby_port;
+    next->lobby_processes = cur->lobby_processes;
+    next->prewarm_relays = cur->prewarm_relays;
+    memcpy(next->lobby_cpus, cur->lobby_cpus, sizeof(next->lobby_cpus));
+    next->lobby_cpu_count = cur->lobby_cpu_count;
+    memcpy(next->relay_cpus, cur->relay_cpus, sizeof(next->relay_cpus));
+    next->relay_cpu_count = cur->relay_cpu_count;
+    memcpy(next->nic_irq_cpus, cur->nic_irq_cpus, sizeof(next->nic_irq_cpus));
+    next->nic_irq_cpu_count = cur->nic_irq_cpu_count;
+    memcpy(next->upgrade_socket, cur->upgrade_socket, sizeof(next->upgrade_socket));
+    memcpy(next->journal_path, cur->journal_path, sizeof(next->journal_path));
+    return changed;
 }
 
-static void start_game_locked(Game *game)
+/* Re-reads the config file and publishes it. Running games keep their port
+ * and slot; a smaller max_games or port range only limits new games. */
+static void reload_config(void)
 {
-    int port = acquire_game_port();
-    if (port < 0)
+    ServerConfig *next = calloc(1, sizeof(ServerConfig));
+    if (!next || !load_config(g_config_path, next) || !validate_config(next))
     {
-        printf("No available game ports\n");
-        game->in_use = false;
+        char escaped[PATH_MAX * 6];
+        log_event(LOG_ERROR, "config_reload_failed", "\"path\":\"%s\"",
+                  json_escape(g_config_path, escaped, sizeof(escaped)));
+        free(next);
         return;
     }
+    if (keep_restart_only_keys(next, g_cfg))
+        log_event(LOG_WARN, "config_restart_required",
+                  "\"keys\":[\"lobby_port\",\"lobby_processes\",\"prewarm_relays\",\"lobby_cpus\",\"relay_cpus\","
+                  "\"nic_irq_cpus\",\"upgrade_socket\",\"journal_path\"]");
+    atomic_init(&next->refs, 1);
 
-    game->port = port;
-    game->active = true;
+    state_lock();
+    ServerConfig *old = g_cfg;
+    g_cfg = next;
+    atomic_fetch_add(&g_cfg_generation, 1);
+    /* join_timeout_sec may have changed every pending deadline. */
+    expiry_rebuild_locked(&g_shared->expiry, (int64_t)time(NULL));
+    state_unlock();
+    config_release(old);
+
+    atomic_store(&g_log_level, next->log_level);
+    atomic_store(&g_log_rate, next->log_rate_per_sec);
+    log_event(LOG_INFO, "config_reloaded", "\"max_games\":%d,\"port_min\":%d,\"port_max\":%d", next->max_games,
+              next->game_port_min, next->game_port_max);
+}
 
+static void drain_reload_pipe(void)
+{
+    char buf[32];
+    while (read(g_reload_pipe[0], buf, sizeof(buf)) > 0)
     {
-        char ts[32];
-        time_t now = time(NULL);
-        struct tm tm_now;
-        localtime_r(&now, &tm_now);
-        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm_now);
-        printf("%s Game start id=%s name=\"%s\" port=%d players=%d names=",
-               ts, game->id, game->name, game->port, game->player_count);
-        for (int i = 0; i < game->player_count; i++)
-        {
-            if (i > 0)
-                printf(",");
-            printf("%s", game->player_names[i]);
-        }
-        printf("\n");
     }
+}
 
-    GameThreadArgs *args = calloc(1, sizeof(GameThreadArgs));
-    args->game = game;
-    args->cfg = &g_cfg;
-    pthread_create(&game->thread, NULL, game_thread, args);
-
-    for (int i = 0; i < game->player_count; i++)
+/* Reads what has arrived on a lobby connection and serves each request
+ * once it is complete. A keep-alive connection stays open for the next
+ * one. Returns false when the connection is done with. */
+static bool serve_lobby_conn(LobbyConn *conn)
+{
+    bool eof = false;
+    while (conn->len < sizeof(conn->buf))
     {
-        LobbyClient *client = find_client_by_id_locked(game->player_ids[i]);
-        if (client)
+        ssize_t r = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, 0);
+        if (r > 0)
         {
-            client->pending_start = true;
-            client->start_port = game->port;
-            snprintf(client->start_host, sizeof(client->start_host), "%s", g_cfg.host_name);
+            conn->len += (size_t)r;
+            continue;
         }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        eof = true;
+        break;
     }
 
-    for (int i = 0; i < game->player_count; i++)
+    while (1)
     {
-        for (int gi = 0; gi < g_cfg.max_games; gi++)
+        HttpRequest req;
+        HttpParseResult rc = http_parse(conn->buf, conn->len, &conn->scanned, &req);
+        if (rc == HTTP_INCOMPLETE)
+            return !eof;
+        bool get = rc == HTTP_COMPLETE && view_eq(req.method, "GET");
+        g_http_keep_alive = get && !eof && http_keep_alive(conn->buf, conn->scanned);
+        /* Responses are written with blocking sends, as before. */
+        set_nonblocking(conn->fd, false);
+        if (rc == HTTP_BAD)
+            send_http(conn->fd, "{\"ok\":false,\"error\":\"bad_request\"}");
+        else if (get && view_eq(req.path, "/batch"))
+            handle_batch(conn->fd, conn->ip, &req);
+        else if (get)
+            handle_request(conn->fd, conn->ip, &req);
+        if (g_http_detached)
         {
-            if (!g_games[gi].in_use || &g_games[gi] == game)
-                continue;
-            remove_client_from_game_locked(&g_games[gi], game->player_ids[i]);
+            g_http_detached = false;
+            conn->fd = -1;
+            return false;
         }
+        if (!g_http_keep_alive)
+            return false;
+        g_http_keep_alive = false;
+        set_nonblocking(conn->fd, true);
+
+        /* Anything past this request is the start of the next one. */
+        conn->len -= conn->scanned;
+        memmove(conn->buf, conn->buf + conn->scanned, conn->len);
+        conn->scanned = 0;
+        conn->deadline_ms = monotonic_ms() + LOBBY_KEEPALIVE_IDLE_MS;
     }
 }
 
-static void expire_pending_games(void)
+static int count_own_games_locked(void)
 {
-    time_t now = time(NULL);
-    for (int i = 0; i < g_cfg.max_games; i++)
+    int n = 0;
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
     {
-        Game *game = &g_games[i];
-        if (!game->in_use || game->active || game->ended)
-            continue;
-        if ((now - game->created_at) > g_cfg.join_timeout_sec)
-        {
-            char ts[32];
-            struct tm tm_now;
-            localtime_r(&now, &tm_now);
-            strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm_now);
-            printf("%s Game timeout id=%s name=\"%s\"\n", ts, game->id, game->name);
-            game->in_use = false;
-        }
+        if (g_games[i].in_use && g_games[i].active && g_games[i].owner == getpid())
+            n++;
     }
+    return n;
 }
 
-static void expire_clients(void)
+/* Closes the idle prewarmed listeners and returns their ports to the pool.
+ * Claimed relays are left to finish their games. */
+static void release_prewarm_relays(void)
 {
-    time_t now = time(NULL);
-    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
+    state_lock();
+    pthread_mutex_lock(&g_prewarm_lock);
+    for (int i = 0; i < g_prewarm_count; i++)
     {
-        if (!g_clients[i].in_use)
+        PrewarmSlot *slot = &g_prewarm[i];
+        if (!slot->idle)
             continue;
-        if ((now - g_clients[i].last_seen) > 3600)
-            g_clients[i].in_use = false;
+        slot->idle = false;
+        close(slot->rs->listen_fd);
+        unreserve_prewarm_port_locked(slot->port);
+        release_game_port(slot->port);
     }
+    pthread_mutex_unlock(&g_prewarm_lock);
+    state_unlock();
 }
 
-static void send_http(int fd, const char *body)
+/* Stops taking new games for a shutdown. Running rings get until the
+ * returned deadline to finish on their own. */
+static uint64_t begin_shutdown(void)
 {
-    char header[128];
-    int len = (int)strlen(body);
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n",
-             len);
-    send(fd, header, strlen(header), 0);
-    send(fd, body, len, 0);
+    state_lock();
+    g_shared->draining = true;
+    expire_all_pending_games_locked();
+    int running = count_own_games_locked();
+    int timeout = g_cfg->drain_timeout_sec;
+    state_unlock();
+    release_prewarm_relays();
+    log_event(LOG_WARN, "shutdown_draining", "\"running_games\":%d,\"timeout_sec\":%d", running, timeout);
+    return monotonic_ms() + (uint64_t)timeout * 1000u;
 }
 
-static void get_query_param(const char *query, const char *key, char *out, size_t out_len)
+/* Returns true once this process has no running games left. Past the
+ * deadline, the remaining ones are told to end. */
+static bool shutdown_drained(uint64_t deadline_ms, bool *forced)
 {
-    out[0] = '\0';
-    if (!query || !*query)
-        return;
-    size_t key_len = strlen(key);
-    const char *p = query;
-    while (*p)
+    state_lock();
+    int running = count_own_games_locked();
+    if (running > 0 && !*forced && monotonic_ms() >= deadline_ms)
     {
-        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=')
+        for (int i = 0; i < MAX_GAMES_LIMIT; i++)
         {
-            p += key_len + 1;
-            size_t i = 0;
-            while (*p && *p != '&' && i + 1 < out_len)
-            {
-                out[i++] = *p++;
-            }
-            out[i] = '\0';
-            return;
+            Game *game = &g_games[i];
+            if (game->in_use && game->active && game->owner == getpid())
+                atomic_store(&game->end_requested, true);
         }
-        p = strchr(p, '&');
-        if (!p)
-            break;
-        p++;
+        *forced = true;
+        log_event(LOG_WARN, "shutdown_deadline", "\"running_games\":%d", running);
     }
+    state_unlock();
+    return running == 0;
 }
 
-static void url_decode(char *s)
+/* Serves the lobby on sockfd, or on a freshly bound listener when sockfd is
+ * -1. */
+static int run_lobby(int sockfd)
 {
-    char *o = s;
-    char *p = s;
-    while (*p)
+    if (!pin_thread(pthread_self(), g_cfg->lobby_cpus, g_cfg->lobby_cpu_count))
+        log_errno("lobby_affinity");
+
+    if (sockfd < 0)
+        sockfd = open_lobby_listener();
+    if (sockfd < 0)
+        return 1;
+
+    int upgrade_fd = -1;
+    if (g_cfg->upgrade_socket[0])
+        upgrade_fd = open_upgrade_listener();
+    init_reload_pipe();
+    start_prewarm_relays();
+
+    {
+        char host[sizeof(g_cfg->host_name) * 6];
+        log_event(LOG_INFO, "lobby_listening", "\"port\":%d,\"host\":\"%s\"", g_cfg->lobby_port,
+                  json_escape(g_cfg->host_name, host, sizeof(host)));
+    }
+
+    bool shutting_down = false;
+    bool forced = false;
+    uint64_t drain_deadline_ms = 0;
+    while (1)
     {
-        if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2]))
+        state_lock();
+        expiry_tick_locked();
+        state_unlock();
+        if (g_reload_requested)
         {
-            char hex[3] = {p[1], p[2], 0};
-            *o++ = (char)strtol(hex, NULL, 16);
-            p += 3;
+            g_reload_requested = 0;
+            reload_config();
         }
-        else if (*p == '+')
+        if (g_shutdown_requested && !shutting_down)
         {
-            *o++ = ' ';
-            p++;
+            shutting_down = true;
+            drain_deadline_ms = begin_shutdown();
         }
-        else
+        else if (g_shutdown_requested > 1 && !forced)
         {
-            *o++ = *p++;
+            /* A second signal stops waiting for the rings. */
+            drain_deadline_ms = 0;
         }
-    }
-    *o = '\0';
-}
+        if (shutting_down && shutdown_drained(drain_deadline_ms, &forced))
+            break;
+        events_pump();
 
-static void handle_request(int fd, const char *path, const char *query)
-{
-    char name[NAME_MAX + 1];
-    char client_id[GAME_ID_LEN + 1];
-    char game_id[GAME_ID_LEN + 1];
-    char game_name[GAME_NAME_MAX + 1];
-    char max_players_str[8];
-    int max_players = 0;
+        struct pollfd pfds[3 + LOBBY_MAX_CONNS + MAX_CLIENTS_LIMIT];
+        pfds[0].fd = g_lobby_conn_count < LOBBY_MAX_CONNS ? sockfd : -1;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = g_reload_pipe[0];
+        pfds[1].events = POLLIN;
+        pfds[2].fd = shutting_down ? -1 : upgrade_fd;
+        pfds[2].events = POLLIN;
+        for (int c = 0; c < g_lobby_conn_count; c++)
+        {
+            pfds[3 + c].fd = g_lobby_conns[c].fd;
+            pfds[3 + c].events = POLLIN;
+            pfds[3 + c].revents = 0;
+        }
+        struct pollfd *sub_pfds = &pfds[3 + g_lobby_conn_count];
+        for (int s = 0; s < g_event_sub_count; s++)
+        {
+            sub_pfds[s].fd = g_event_subs[s].fd;
+            sub_pfds[s].events = POLLIN;
+            sub_pfds[s].revents = 0;
+        }
+        if (poll(pfds, (nfds_t)(3 + g_lobby_conn_count + g_event_sub_count),
+                 shutting_down ? DRAIN_POLL_MS : EXPIRY_TICK_MS) < 0)
+            continue;
+        if (pfds[1].revents & POLLIN)
+        {
+            drain_reload_pipe();
+            continue;
+        }
+        if (upgrade_fd >= 0 && (pfds[2].revents & POLLIN))
+            serve_upgrade(upgrade_fd, sockfd);
 
-    if (strcmp(path, "/hello") == 0)
-    {
-        get_query_param(query, "name", name, sizeof(name));
-        url_decode(name);
-        if (!is_alnum_str(name) || strlen(name) > NAME_MAX)
+        /* Subscribers have nothing to say; any input is discarded, and
+         * end of file or an error closes the stream. */
+        for (int s = g_event_sub_count - 1; s >= 0; s--)
         {
-            send_http(fd, "{\"ok\":false,\"error\":\"invalid_name\"}");
-            return;
+            if (!sub_pfds[s].revents)
+                continue;
+            char scratch[256];
+            ssize_t r = recv(g_event_subs[s].fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                events_drop(s);
         }
-        pthread_mutex_lock(&g_lock);
-        LobbyClient *client = create_client_locked(name);
-        pthread_mutex_unlock(&g_lock);
-        if (!client)
+
+        /* Walk backwards so removing a connection only moves one that has
+         * already been handled. */
+        uint64_t now_ms = monotonic_ms();
+        for (int c = g_lobby_conn_count - 1; c >= 0; c--)
         {
-            send_http(fd, "{\"ok\":false,\"error\":\"server_full\"}");
-            return;
+            LobbyConn *conn = &g_lobby_conns[c];
+            bool keep = now_ms < conn->deadline_ms;
+            if (keep && pfds[3 + c].revents)
+                keep = serve_lobby_conn(conn);
+            if (!keep)
+            {
+                if (conn->fd >= 0)
+                    close(conn->fd);
+                *conn = g_lobby_conns[--g_lobby_conn_count];
+            }
         }
-        char body[LINE_BUF];
-        snprintf(body, sizeof(body), "{\"ok\":true,\"client_id\":\"%s\",\"name\":\"%s\"}",
-                 client->id, client->name);
-        send_http(fd, body);
-        return;
-    }
 
-    get_query_param(query, "client_id", client_id, sizeof(client_id));
-    pthread_mutex_lock(&g_lock);
-    LobbyClient *client = find_client_by_id_locked(client_id);
-    if (client)
-        client->last_seen = time(NULL);
-    pthread_mutex_unlock(&g_lock);
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int client_fd = accept4(sockfd, (struct sockaddr *)&cliaddr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+            continue;
+        LobbyConn *conn = &g_lobby_conns[g_lobby_conn_count];
+        conn->fd = client_fd;
+        conn->ip = cliaddr.sin_addr.s_addr;
+        conn->deadline_ms = now_ms + LOBBY_REQUEST_TIMEOUT_MS;
+        conn->len = 0;
+        conn->scanned = 0;
+        /* The request usually arrives with the connection. */
+        if (serve_lobby_conn(conn))
+            g_lobby_conn_count++;
+        else if (conn->fd >= 0)
+            close(client_fd);
+    }
 
-    if (!client)
+    for (int c = 0; c < g_lobby_conn_count; c++)
+        close(g_lobby_conns[c].fd);
+    while (g_event_sub_count > 0)
+        events_drop(g_event_sub_count - 1);
+    close(sockfd);
+    if (upgrade_fd >= 0)
     {
-        send_http(fd, "{\"ok\":false,\"error\":\"bad_client\"}");
-        return;
+        close(upgrade_fd);
+        unlink(g_cfg->upgrade_socket);
     }
+    journal_stop();
+    log_event(LOG_INFO, "shutdown_complete", "");
+    return 0;
+}
 
-    if (strcmp(path, "/list") == 0)
+/* Marks the games a dead lobby process was relaying as ended so their slots
+ * and ports return to the pool, along with its prewarmed listeners' ports. */
+static void reclaim_process_locked(pid_t pid)
+{
+    for (int i = 0; i < MAX_CLIENTS_LIMIT; i++)
     {
-        pthread_mutex_lock(&g_lock);
-        char out[LINE_BUF];
-        size_t used = 0;
-        used += (size_t)snprintf(out + used, sizeof(out) - used, "{\"ok\":true,\"games\":[");
-        bool first = true;
-        for (int i = 0; i < g_cfg.max_games; i++)
+        LobbyClient *client = &g_clients[i];
+        if (client->in_use && client->events_owner == pid)
         {
-            if (!g_games[i].in_use)
-                continue;
-            if (!first)
-                used += (size_t)snprintf(out + used, sizeof(out) - used, ",");
-            first = false;
-            used += (size_t)snprintf(out + used, sizeof(out) - used,
-                                     "{\"id\":\"%s\",\"name\":\"%s\",\"players\":%d,\"max\":%d,\"active\":%s}",
-                                     g_games[i].id, g_games[i].name, g_games[i].player_count,
-                                     g_games[i].max_players, g_games[i].active ? "true" : "false");
+            client->events_owner = 0;
+            client->last_seen = time(NULL);
         }
-        used += (size_t)snprintf(out + used, sizeof(out) - used, "]}");
-        pthread_mutex_unlock(&g_lock);
-        send_http(fd, out);
-        return;
     }
-
-    if (strcmp(path, "/create") == 0)
+    for (int i = 0; i < MAX_LOBBY_PROCESSES * MAX_PREWARM_RELAYS; i++)
     {
-        get_query_param(query, "name", game_name, sizeof(game_name));
-        url_decode(game_name);
-        get_query_param(query, "max_players", max_players_str, sizeof(max_players_str));
-        if (!parse_int(max_players_str, &max_players) || max_players <= 0 || max_players > MAX_PLAYERS_LIMIT)
-            max_players = g_cfg.max_players_default;
-
-        pthread_mutex_lock(&g_lock);
-        int slot = -1;
-        int in_use = 0;
-        for (int i = 0; i < g_cfg.max_games; i++)
-        {
-            if (g_games[i].in_use)
-                in_use++;
-            else if (slot < 0)
-                slot = i;
-        }
-        if (in_use >= g_cfg.max_games || slot < 0)
+        PrewarmPort *p = &g_shared->prewarm_ports[i];
+        if (p->owner == pid)
         {
-            pthread_mutex_unlock(&g_lock);
-            send_http(fd, "{\"ok\":false,\"error\":\"max_games\"}");
-            return;
+            release_game_port(p->port);
+            p->owner = 0;
         }
-
-        Game *game = &g_games[slot];
-        memset(game, 0, sizeof(*game));
-        game->in_use = true;
-        game->active = false;
-        game->ended = false;
-        game->max_players = max_players;
-        game->player_count = 0;
-        game->created_at = time(NULL);
-        snprintf(game->name, sizeof(game->name), "%s", game_name[0] ? game_name : "Game");
-        gen_id(game->id, sizeof(game->id));
-
-        snprintf(game->player_ids[0], sizeof(game->player_ids[0]), "%s", client->id);
-        snprintf(game->player_names[0], sizeof(game->player_names[0]), "%s", client->name);
-        gen_id(game->tokens[0], sizeof(game->tokens[0]));
-        game->player_count = 1;
-
-        pthread_mutex_unlock(&g_lock);
-
-        char body[LINE_BUF];
-        snprintf(body, sizeof(body), "{\"ok\":true,\"game_id\":\"%s\",\"status\":\"waiting\"}", game->id);
-        send_http(fd, body);
-        return;
     }
-
-    if (strcmp(path, "/join") == 0)
+    for (int i = 0; i < MAX_GAMES_LIMIT; i++)
     {
-        get_query_param(query, "game_id", game_id, sizeof(game_id));
-        pthread_mutex_lock(&g_lock);
-        Game *game = find_game_by_id_locked(game_id);
-        if (!game || game->active)
-        {
-            pthread_mutex_unlock(&g_lock);
-            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
-            return;
-        }
-        if (game->player_count >= game->max_players)
+        Game *game = &g_games[i];
+        if (!game->in_use || !game->active || game->owner != pid)
+            continue;
+        log_event(LOG_WARN, "game_dropped", "\"id\":\"%s\",\"lobby_pid\":%d", game->id, (int)pid);
+        game->in_use = false;
+        game->active = false;
+        game->ended = true;
+        release_game_port(game->port);
+        if (game->worker >= 0)
         {
-            pthread_mutex_unlock(&g_lock);
-            send_http(fd, "{\"ok\":false,\"error\":\"full\"}");
-            return;
+            g_worker_games[game->worker]--;
+            game->worker = -1;
         }
+    }
+}
 
-        int idx = game->player_count++;
-        snprintf(game->player_ids[idx], sizeof(game->player_ids[idx]), "%s", client->id);
-        snprintf(game->player_names[idx], sizeof(game->player_names[idx]), "%s", client->name);
-        gen_id(game->tokens[idx], sizeof(game->tokens[idx]));
-
-        if (game->player_count >= game->max_players)
-            start_game_locked(game);
+static pid_t spawn_lobby_process(void)
+{
+    pid_t parent = getpid();
+    log_flush();
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
 
-        pthread_mutex_unlock(&g_lock);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        _exit(1);
+    log_after_fork();
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    init_signals(true);
+    int rc = run_lobby(-1);
+    log_flush();
+    _exit(rc);
+}
 
-        send_http(fd, "{\"ok\":true,\"status\":\"waiting\"}");
-        return;
-    }
+/* Keeps lobby_processes lobby processes running on the shared SO_REUSEPORT
+ * port. Any one of them can be killed and is replaced while the others keep
+ * the port bound. */
+static int run_supervisor(void)
+{
+    pid_t pids[MAX_LOBBY_PROCESSES];
+    time_t started[MAX_LOBBY_PROCESSES];
 
-    if (strcmp(path, "/leave") == 0)
+    for (int i = 0; i < g_cfg->lobby_processes; i++)
     {
-        get_query_param(query, "game_id", game_id, sizeof(game_id));
-        pthread_mutex_lock(&g_lock);
-        Game *game = find_game_by_id_locked(game_id);
-        if (!game || game->active)
+        pids[i] = spawn_lobby_process();
+        started[i] = time(NULL);
+        if (pids[i] < 0)
         {
-            pthread_mutex_unlock(&g_lock);
-            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
-            return;
+            log_errno("fork");
+            return 1;
         }
-        remove_client_from_game_locked(game, client->id);
-        pthread_mutex_unlock(&g_lock);
-        send_http(fd, "{\"ok\":true}");
-        return;
     }
 
-    if (strcmp(path, "/wait") == 0)
+    int forwarded_shutdown = 0;
+    while (1)
     {
-        get_query_param(query, "game_id", game_id, sizeof(game_id));
-        Game *game = NULL;
-        if (game_id[0])
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (g_reload_requested)
         {
-            pthread_mutex_lock(&g_lock);
-            game = find_game_by_id_locked(game_id);
-            pthread_mutex_unlock(&g_lock);
+            g_reload_requested = 0;
+            reload_config();
+            for (int i = 0; i < g_cfg->lobby_processes; i++)
+            {
+                if (pids[i] > 0)
+                    kill(pids[i], SIGHUP);
+            }
         }
-        if (game_id[0] && !game)
+        if (g_shutdown_requested > forwarded_shutdown)
         {
-            send_http(fd, "{\"ok\":false,\"error\":\"not_found\"}");
-            return;
+            forwarded_shutdown = g_shutdown_requested;
+            log_event(LOG_WARN, "shutdown_requested", "\"signals\":%d", forwarded_shutdown);
+            for (int i = 0; i < g_cfg->lobby_processes; i++)
+            {
+                if (pids[i] > 0)
+                    kill(pids[i], SIGTERM);
+            }
         }
-        if (client->pending_start)
+        if (pid < 0)
         {
-            client->pending_start = false;
-            char body[LINE_BUF];
-            snprintf(body, sizeof(body),
-                     "{\"cmd\":\"start\",\"host\":\"%s\",\"port\":%d,\"token\":\"%s\"}",
-                     client->start_host, client->start_port, "");
-            send_http(fd, body);
-            return;
+            if (errno == EINTR)
+                continue;
+            log_errno("waitpid");
+            return 1;
         }
-        if (game)
+
+        int idx = -1;
+        for (int i = 0; i < g_cfg->lobby_processes; i++)
         {
-            char body[LINE_BUF];
-            snprintf(body, sizeof(body),
-                     "{\"ok\":true,\"status\":\"waiting\",\"players\":%d,\"max\":%d}",
-                     game->player_count, game->max_players);
-            send_http(fd, body);
-            return;
+            if (pids[i] == pid)
+            {
+                idx = i;
+                break;
+            }
         }
-        send_http(fd, "{\"ok\":true,\"status\":\"waiting\",\"players\":0,\"max\":0}");
-        return;
-    }
+        if (idx < 0)
+            continue;
 
-    if (strcmp(path, "/ping") == 0)
-    {
-        send_http(fd, "{\"ok\":true}");
-        return;
-    }
+        state_lock();
+        reclaim_process_locked(pid);
+        state_unlock();
+        log_event(LOG_WARN, "lobby_process_exited", "\"lobby_pid\":%d,\"status\":%d", (int)pid, status);
 
-    send_http(fd, "{\"ok\":false,\"error\":\"unknown\"}");
+        if (forwarded_shutdown > 0)
+        {
+            pids[idx] = 0;
+            bool any = false;
+            for (int i = 0; i < g_cfg->lobby_processes; i++)
+                any = any || pids[i] > 0;
+            if (!any)
+            {
+                log_event(LOG_INFO, "shutdown_complete", "");
+                return 0;
+            }
+            continue;
+        }
+
+        if (time(NULL) - started[idx] < RESPAWN_BACKOFF_SEC)
+            sleep(RESPAWN_BACKOFF_SEC);
+        pids[idx] = spawn_lobby_process();
+        started[idx] = time(NULL);
+        if (pids[idx] < 0)
+        {
+            log_errno("fork");
+            return 1;
+        }
+    }
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    bool upgrade = argc == 3 && strcmp(argv[1], "--upgrade") == 0;
+    if (argc != 2 && !upgrade)
     {
-        fprintf(stderr, "Usage: %s <config_file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--upgrade] <config_file>\n", argv[0]);
         return 1;
     }
+    const char *config_path = argv[argc - 1];
 
-    if (!load_config(argv[1], &g_cfg))
+    g_config_path = config_path;
+    g_cfg = calloc(1, sizeof(ServerConfig));
+    if (!g_cfg || !load_config(config_path, g_cfg))
     {
-        fprintf(stderr, "Failed to load config: %s\n", argv[1]);
+        fprintf(stderr, "Failed to load config: %s\n", config_path);
         return 1;
     }
-    if (!validate_config(&g_cfg))
+    atomic_init(&g_cfg->refs, 1);
+    if (!validate_config(g_cfg))
     {
         fprintf(stderr, "Invalid config\n");
         return 1;
     }
 
-    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
-
-    g_port_range = g_cfg.game_port_max - g_cfg.game_port_min + 1;
-    g_port_used = calloc((size_t)g_port_range, sizeof(bool));
-    if (!g_port_used)
-    {
-        fprintf(stderr, "Failed to allocate port map\n");
-        return 1;
-    }
-
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-    {
-        perror("socket");
-        return 1;
-    }
-
-    int one = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-
-    struct sockaddr_in servaddr;
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(g_cfg.lobby_port);
-
-    if (bind(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+    log_init(g_cfg);
+    init_workers(g_cfg);
+    if (!create_shared_state())
     {
-        perror("bind");
-        close(sockfd);
+        fprintf(stderr, "Failed to allocate shared lobby state\n");
         return 1;
     }
 
-    if (listen(sockfd, 16) < 0)
+    init_signals(g_cfg->lobby_processes == 1);
+    if (g_cfg->lobby_processes > 1)
     {
-        perror("listen");
-        close(sockfd);
-        return 1;
+        int rc = run_supervisor();
+        log_flush();
+        return rc;
     }
 
-    printf("Lobby HTTP listening on port %d, host %s\n", g_cfg.lobby_port, g_cfg.host_name);
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    if (g_cfg->upgrade_socket[0])
+        init_wake_pipe();
 
-    while (1)
+    int lobby_fd = -1;
+    if (upgrade)
     {
-        expire_pending_games();
-        expire_clients();
-
-        struct sockaddr_in cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
-        int client_fd = accept(sockfd, (struct sockaddr *)&cliaddr, &clilen);
-        if (client_fd < 0)
-            continue;
-
-        char req[REQ_BUF + 1];
-        ssize_t r = recv(client_fd, req, REQ_BUF, 0);
-        if (r <= 0)
-        {
-            close(client_fd);
-            continue;
-        }
-        req[r] = '\0';
-
-        char method[8];
-        char url[256];
-        if (sscanf(req, "%7s %255s", method, url) != 2)
-        {
-            close(client_fd);
-            continue;
-        }
-        if (strcmp(method, "GET") != 0)
+        if (!g_cfg->upgrade_socket[0])
         {
-            close(client_fd);
-            continue;
+            fprintf(stderr, "--upgrade requires upgrade_socket in the config\n");
+            return 1;
         }
-
-        char *query = strchr(url, '?');
-        if (query)
+        lobby_fd = receive_handoff();
+        if (lobby_fd < 0)
         {
-            *query = '\0';
-            query++;
+            log_flush();
+            return 1;
         }
-
-        handle_request(client_fd, url, query);
-        close(client_fd);
+        log_event(LOG_INFO, "upgrade_adopted", "");
     }
-
-    return 0;
+    if (g_cfg->journal_path[0] && !journal_start(upgrade))
+    {
+        log_flush();
+        fprintf(stderr, "Failed to open journal: %s\n", g_cfg->journal_path);
+        return 1;
+    }
+    int rc = run_lobby(lobby_fd);
+    log_flush();
+    return rc;
 }
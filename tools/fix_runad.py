@@ -1,4 +1,19 @@
 #!/usr/bin/env python3
+"""Post-process an Atari XEX built by cc65.
+
+By default the last RUNAD segment is turned into an INITAD segment, so the
+program runs while the file loads and returns to the loader. Optional
+passes shrink the file, which is what sets the load time over SIO:
+
+  --merge      join segments whose address ranges are contiguous
+  --zero-fill  drop runs of at least --zero-run zero bytes and clear them
+               at load time with a small init stub instead
+  --compress   pack each group of data segments into an LZ image that a
+               small 6502 decompressor unpacks at load time; the LZ pass
+               already shrinks zero runs, so it excludes --zero-fill
+
+Sizes and estimated load times at standard SIO speed are reported.
+"""
 import argparse
 import os
 import struct
@@ -11,6 +26,37 @@ INITAD_START = 0x02E2
 INITAD_END = 0x02E3
 XEX_MARKER = 0xFFFF
 
+DEFAULT_STUB_ADDR = 0x0600
+DEFAULT_PACK_TOP = 0xBC00
+DEFAULT_ZERO_RUN = 64
+MAX_CLEAR_REGIONS = 63
+
+LZ_MIN_MATCH = 4
+LZ_MAX_MATCH = 130
+LZ_MAX_LITERALS = 127
+LZ_WINDOW = 4096
+
+# Standard SIO: 19200 baud, 10 bits per byte, 128-byte data frames, each
+# with a 5-byte command frame, ACK, COMPLETE and checksum around it.
+SIO_BYTES_PER_SEC = 19200 / 10
+SIO_FRAME_DATA = 128
+SIO_FRAME_OVERHEAD = 5 + 1 + 1 + 1
+# CPU cycles per second left over with the display on.
+CPU_CYCLES_PER_SEC = 1250000
+
+
+class Segment:
+    def __init__(self, start, data):
+        self.start = start
+        self.data = bytearray(data)
+
+    @property
+    def end(self):
+        return self.start + len(self.data) - 1
+
+    def is_vector(self):
+        return self.start <= INITAD_END and self.end >= RUNAD_START
+
 
 def parse_segments(data):
     offset = 0
@@ -34,33 +80,461 @@ def parse_segments(data):
         offset += 4 + seg_len
 
 
-def fix_runad(path):
-    with open(path, "rb") as f:
-        data = bytearray(f.read())
-
-    matches = []
+def read_segments(data):
+    segments = []
     for header_off, start, end in parse_segments(data):
-        if start == RUNAD_START and end == RUNAD_END:
-            matches.append(header_off)
+        body = data[header_off + 4:header_off + 4 + end - start + 1]
+        if len(body) != end - start + 1:
+            raise ValueError("Segment at $%04X is truncated" % start)
+        segments.append(Segment(start, body))
+    return segments
+
+
+def write_segments(segments):
+    out = bytearray(struct.pack("<H", XEX_MARKER))
+    for seg in segments:
+        out += struct.pack("<HH", seg.start, seg.end)
+        out += seg.data
+    return out
+
 
+def fix_runad(segments):
+    matches = [seg for seg in segments if seg.start == RUNAD_START and seg.end == RUNAD_END]
     if not matches:
         raise ValueError("No RUNAD segment found")
+    matches[-1].start = INITAD_START
+
+
+def groups(segments):
+    """Splits segments into runs of data segments between vector segments.
+    Segments within a run may be reordered or rewritten freely, since no
+    init routine runs while they load."""
+    run = []
+    for seg in segments:
+        if seg.is_vector():
+            if run:
+                yield False, run
+                run = []
+            yield True, [seg]
+        else:
+            run.append(seg)
+    if run:
+        yield False, run
+
+
+def merge_segments(segments):
+    out = []
+    for seg in segments:
+        prev = out[-1] if out else None
+        if prev and not prev.is_vector() and not seg.is_vector() and prev.end + 1 == seg.start:
+            prev.data += seg.data
+        else:
+            out.append(Segment(seg.start, seg.data))
+    return out
+
+
+def zero_runs(seg, min_run):
+    pos = 0
+    while True:
+        zero = seg.data.find(bytes(min_run), pos)
+        if zero < 0:
+            return
+        pos = zero
+        while pos < len(seg.data) and seg.data[pos] == 0:
+            pos += 1
+        yield zero, pos - zero
+
+
+def cut_runs(seg, runs):
+    pos = 0
+    for zero, length in runs:
+        if zero > pos:
+            yield Segment(seg.start + pos, seg.data[pos:zero])
+        pos = zero + length
+    if pos < len(seg.data):
+        yield Segment(seg.start + pos, seg.data[pos:])
+
+
+class Assembler:
+    """Just enough of a 6502 assembler for the load-time stubs."""
+
+    def __init__(self, origin):
+        self.origin = origin
+        self.code = bytearray()
+        self.labels = {}
+        self.fixups = []
+
+    @property
+    def pc(self):
+        return self.origin + len(self.code)
+
+    def label(self, name):
+        self.labels[name] = self.pc
+
+    def op(self, opcode, *operand):
+        self.code.append(opcode)
+        self.code += bytes(operand)
+
+    def abs(self, opcode, target, offset=0):
+        self.code.append(opcode)
+        self.fixups.append((len(self.code), target, offset, "abs"))
+        self.code += b"\0\0"
+
+    def branch(self, opcode, target):
+        self.code.append(opcode)
+        self.fixups.append((len(self.code), target, 0, "rel"))
+        self.code.append(0)
+
+    def assemble(self):
+        for pos, target, offset, kind in self.fixups:
+            addr = (self.labels[target] if isinstance(target, str) else target) + offset
+            if kind == "abs":
+                struct.pack_into("<H", self.code, pos, addr & 0xFFFF)
+            else:
+                rel = addr - (self.origin + pos + 1)
+                if not -128 <= rel <= 127:
+                    raise ValueError("Branch to %s out of range" % target)
+                self.code[pos] = rel & 0xFF
+        return bytes(self.code)
+
+
+LDA_IMM, LDA_ABS_X, STA_ABS, ORA_IMM, ORA_ABS = 0xA9, 0xBD, 0x8D, 0x09, 0x0D
+LDY_ABS, INC_ABS, DEC_ABS, INX, DEX, TAX = 0xAC, 0xEE, 0xCE, 0xE8, 0xCA, 0xAA
+AND_IMM, ADC_IMM, CLC, LDX_IMM, LDA_ABS = 0x29, 0x69, 0x18, 0xA2, 0xAD
+BEQ, BNE, BMI, JMP, JSR, RTS = 0xF0, 0xD0, 0x30, 0x4C, 0x20, 0x60
+
+
+def clear_stub(addr, regions):
+    """Init routine that zeroes each (start, length) region. The table of
+    regions follows the code and ends with a zero length."""
+    a = Assembler(addr)
+    a.op(LDX_IMM, 0)
+    a.label("next")
+    a.abs(LDA_ABS_X, "table", 0)
+    a.abs(STA_ABS, "store", 1)
+    a.abs(LDA_ABS_X, "table", 1)
+    a.abs(STA_ABS, "store", 2)
+    a.abs(LDA_ABS_X, "table", 2)
+    a.abs(STA_ABS, "count", 0)
+    a.abs(LDA_ABS_X, "table", 3)
+    a.abs(STA_ABS, "count", 1)
+    a.abs(ORA_ABS, "count", 0)
+    a.branch(BEQ, "done")
+    a.op(LDA_IMM, 0)
+    a.label("store")
+    a.abs(STA_ABS, 0xFFFF)
+    a.abs(INC_ABS, "store", 1)
+    a.branch(BNE, "counted")
+    a.abs(INC_ABS, "store", 2)
+    a.label("counted")
+    a.abs(LDY_ABS, "count", 0)
+    a.branch(BNE, "low")
+    a.abs(DEC_ABS, "count", 1)
+    a.label("low")
+    a.abs(DEC_ABS, "count", 0)
+    a.branch(BNE, "store")
+    a.abs(LDY_ABS, "count", 1)
+    a.branch(BNE, "store")
+    a.op(INX)
+    a.op(INX)
+    a.op(INX)
+    a.op(INX)
+    a.abs(JMP, "next")
+    a.label("done")
+    a.op(RTS)
+    a.label("count")
+    a.op(0, 0)
+    a.label("table")
+    for start, length in regions:
+        a.op(*struct.pack("<HH", start, length))
+    a.op(0, 0, 0, 0)
+    return a.assemble()
+
 
-    header_off = matches[-1]
-    struct.pack_into("<HH", data, header_off, INITAD_START, INITAD_END)
+def unpack_stub(addr, image_addr):
+    """Init routine that unpacks the image built by pack_image()."""
+    a = Assembler(addr)
+    a.label("stream")
+    a.abs(JSR, "get")
+    a.abs(STA_ABS, "put", 1)
+    a.abs(JSR, "get")
+    a.branch(BEQ, "done")
+    a.abs(STA_ABS, "put", 2)
+    a.label("token")
+    a.abs(JSR, "get")
+    a.branch(BEQ, "stream")
+    a.branch(BMI, "match")
+    a.op(TAX)
+    a.label("literal")
+    a.abs(JSR, "get")
+    a.abs(JSR, "put")
+    a.op(DEX)
+    a.branch(BNE, "literal")
+    a.branch(BEQ, "token")
+    a.label("match")
+    a.op(AND_IMM, 0x7F)
+    a.op(CLC)
+    a.op(ADC_IMM, LZ_MIN_MATCH - 1)
+    a.op(TAX)
+    a.abs(JSR, "get")
+    a.abs(STA_ABS, "from", 1)
+    a.abs(JSR, "get")
+    a.abs(STA_ABS, "from", 2)
+    a.label("from")
+    a.abs(LDA_ABS, 0xFFFF)
+    a.abs(JSR, "put")
+    a.abs(INC_ABS, "from", 1)
+    a.branch(BNE, "copied")
+    a.abs(INC_ABS, "from", 2)
+    a.label("copied")
+    a.op(DEX)
+    a.branch(BNE, "from")
+    a.branch(BEQ, "token")
+    a.label("done")
+    a.op(RTS)
+    a.label("get")
+    a.abs(LDA_ABS, image_addr)
+    a.abs(INC_ABS, "get", 1)
+    a.branch(BNE, "got")
+    a.abs(INC_ABS, "get", 2)
+    a.label("got")
+    a.op(ORA_IMM, 0)
+    a.op(RTS)
+    a.label("put")
+    a.abs(STA_ABS, 0xFFFF)
+    a.abs(INC_ABS, "put", 1)
+    a.branch(BNE, "stored")
+    a.abs(INC_ABS, "put", 2)
+    a.label("stored")
+    a.op(RTS)
+    return a.assemble()
 
+
+# Approximate cycles the unpacker spends per token and per output byte.
+UNPACK_TOKEN_CYCLES = 60
+UNPACK_LITERAL_CYCLES = 57
+UNPACK_MATCH_CYCLES = 43
+
+
+def lz_compress(seg):
+    """Greedy LZ77 over one segment. Tokens: 0x01-0x7F n literal bytes,
+    0x80-0xFF a match of (c & 0x7F) + 3 bytes copied from the absolute
+    address that follows, 0x00 end of stream. Returns the token stream
+    and its estimated unpack cycles."""
+    data = bytes(seg.data)
+    out = bytearray()
+    literals = bytearray()
+    heads = {}
+    cycles = 0
+    pos = 0
+
+    def flush():
+        nonlocal cycles
+        while literals:
+            chunk = literals[:LZ_MAX_LITERALS]
+            del literals[:LZ_MAX_LITERALS]
+            out.append(len(chunk))
+            out.extend(chunk)
+            cycles += UNPACK_TOKEN_CYCLES + UNPACK_LITERAL_CYCLES * len(chunk)
+
+    while pos < len(data):
+        best_len = 0
+        best_src = 0
+        key = data[pos:pos + LZ_MIN_MATCH]
+        if len(key) == LZ_MIN_MATCH:
+            for cand in reversed(heads.get(key, [])[-32:]):
+                if pos - cand > LZ_WINDOW:
+                    break
+                length = 0
+                limit = min(LZ_MAX_MATCH, len(data) - pos)
+                while length < limit and data[cand + length] == data[pos + length]:
+                    length += 1
+                if length > best_len:
+                    best_len = length
+                    best_src = cand
+                    if length == limit:
+                        break
+        step = best_len if best_len >= LZ_MIN_MATCH else 1
+        for i in range(pos, pos + step):
+            heads.setdefault(data[i:i + LZ_MIN_MATCH], []).append(i)
+        if best_len >= LZ_MIN_MATCH:
+            flush()
+            out.append(0x80 | (best_len - (LZ_MIN_MATCH - 1)))
+            out += struct.pack("<H", seg.start + best_src)
+            cycles += UNPACK_TOKEN_CYCLES + UNPACK_MATCH_CYCLES * best_len
+        else:
+            literals.append(data[pos])
+        pos += step
+    flush()
+    out.append(0)
+    return out, cycles
+
+
+def pack_image(segments):
+    """Each segment becomes its load address, its token stream and a zero;
+    a zero high address byte ends the image."""
+    image = bytearray()
+    cycles = 0
+    for seg in segments:
+        if seg.start < 0x0100:
+            raise ValueError("Cannot pack a segment in zero page ($%04X)" % seg.start)
+        tokens, seg_cycles = lz_compress(seg)
+        image += struct.pack("<H", seg.start)
+        image += tokens
+        cycles += seg_cycles
+    image += b"\0\0"
+    return image, cycles
+
+
+def overlaps(a_start, a_end, b_start, b_end):
+    return a_start <= b_end and b_start <= a_end
+
+
+def check_free(segments, start, end, what):
+    for seg in segments:
+        if overlaps(start, end, seg.start, seg.end):
+            raise ValueError("%s at $%04X-$%04X overlaps segment $%04X-$%04X"
+                             % (what, start, end, seg.start, seg.end))
+
+
+def init_segment(addr):
+    return Segment(INITAD_START, struct.pack("<H", addr))
+
+
+def clear_zero_runs(segments, min_run, stub_addr):
+    """Cuts zero runs of at least min_run bytes out of each group of data
+    segments, and clears them with a stub run at the end of the group
+    when that makes the file smaller."""
+    out = []
+    for vector, run in groups(segments):
+        if vector:
+            out.extend(run)
+            continue
+        found = []
+        for i, seg in enumerate(run):
+            for zero, length in zero_runs(seg, min_run):
+                start = seg.start + zero
+                # Leave bytes that a later segment of the group overwrites.
+                if not any(overlaps(start, start + length - 1, later.start, later.end) for later in run[i + 1:]):
+                    found.append((i, zero, length))
+        found = sorted(sorted(found, key=lambda r: -r[2])[:MAX_CLEAR_REGIONS])
+        if not found:
+            out.extend(run)
+            continue
+
+        kept = []
+        for i, seg in enumerate(run):
+            kept.extend(cut_runs(seg, [(zero, length) for j, zero, length in found if j == i]))
+        regions = [(run[i].start + zero, length) for i, zero, length in found]
+        stub = clear_stub(stub_addr, regions)
+        check_free(segments, stub_addr, stub_addr + len(stub) - 1, "Clear stub")
+        cleared = kept + [Segment(stub_addr, stub), init_segment(stub_addr)]
+        if len(write_segments(cleared)) < len(write_segments(run)):
+            out.extend(cleared)
+        else:
+            out.extend(run)
+    return out
+
+
+def compress_segments(segments, stub_addr, pack_top):
+    """Replaces each group of data segments with the unpacker and its
+    image when that is smaller. Returns the new segments and the estimated
+    unpack cycles."""
+    out = []
+    total_cycles = 0
+    for vector, run in groups(segments):
+        if vector:
+            out.extend(run)
+            continue
+        image, cycles = pack_image(run)
+        image_addr = pack_top - len(image)
+        stub = unpack_stub(stub_addr, image_addr)
+        raw = sum(4 + len(seg.data) for seg in run)
+        packed = 4 + len(stub) + 4 + len(image) + 4 + 2
+        if packed >= raw:
+            out.extend(run)
+            continue
+        check_free(segments, image_addr, pack_top - 1, "Packed image")
+        check_free(segments, stub_addr, stub_addr + len(stub) - 1, "Unpack stub")
+        if overlaps(image_addr, pack_top - 1, stub_addr, stub_addr + len(stub) - 1):
+            raise ValueError("Packed image overlaps the unpack stub; lower --stub-addr or raise --pack-top")
+        out += [Segment(stub_addr, stub), Segment(image_addr, image), init_segment(stub_addr)]
+        total_cycles += cycles
+    return out, total_cycles
+
+
+def sio_seconds(size):
+    frames = (size + SIO_FRAME_DATA - 1) // SIO_FRAME_DATA
+    return (size + frames * SIO_FRAME_OVERHEAD) / SIO_BYTES_PER_SEC
+
+
+def report(path, before, after, seg_before, seg_after, unpack_cycles):
+    name = os.path.basename(path)
+    unpack = unpack_cycles / CPU_CYCLES_PER_SEC
+    print("%s: %d -> %d bytes (%+.1f%%), %d -> %d segments"
+          % (name, before, after, 100.0 * (after - before) / before, seg_before, seg_after))
+    line = "%s: est. load at 19200 baud SIO: %.1fs -> %.1fs" % (name, sio_seconds(before), sio_seconds(after))
+    if unpack_cycles:
+        line += " + %.1fs unpack" % unpack
+    print(line)
+
+
+def process(path, merge=False, zero_fill=False, compress=False, zero_run=DEFAULT_ZERO_RUN,
+            stub_addr=DEFAULT_STUB_ADDR, pack_top=DEFAULT_PACK_TOP, quiet=False):
+    if zero_fill and compress:
+        raise ValueError("--zero-fill and --compress cannot be combined")
+    if zero_run < 1:
+        raise ValueError("--zero-run must be at least 1")
+
+    with open(path, "rb") as f:
+        data = f.read()
+
+    segments = read_segments(data)
+    seg_before = len(segments)
+    fix_runad(segments)
+    if merge:
+        segments = merge_segments(segments)
+
+    unpack_cycles = 0
+    if compress:
+        segments, unpack_cycles = compress_segments(segments, stub_addr, pack_top)
+    elif zero_fill:
+        segments = clear_zero_runs(segments, zero_run, stub_addr)
+
+    out = write_segments(segments)
     tmp_path = path + ".tmp"
     with open(tmp_path, "wb") as f:
-        f.write(data)
+        f.write(out)
     os.replace(tmp_path, path)
 
+    if not quiet:
+        report(path, len(data), len(out), seg_before, len(segments), unpack_cycles)
+
+
+def parse_addr(text):
+    text = text.strip()
+    if text.startswith("$"):
+        return int(text[1:], 16)
+    return int(text, 0)
+
 
 def main():
-    parser = argparse.ArgumentParser(description="Convert RUNAD to INITAD in XEX file.")
+    parser = argparse.ArgumentParser(description="Convert RUNAD to INITAD in XEX file and optionally shrink it.")
     parser.add_argument("xex", help="Path to XEX file to modify in place")
+    parser.add_argument("--merge", action="store_true", help="merge segments with contiguous addresses")
+    parser.add_argument("--zero-fill", action="store_true", help="clear zero runs with an init stub")
+    parser.add_argument("--compress", action="store_true", help="pack data segments behind a 6502 unpacker")
+    parser.add_argument("--zero-run", type=int, default=DEFAULT_ZERO_RUN, metavar="N",
+                        help="shortest zero run --zero-fill drops (default %d)" % DEFAULT_ZERO_RUN)
+    parser.add_argument("--stub-addr", type=parse_addr, default=DEFAULT_STUB_ADDR,
+                        help="load address of the init stubs (default $%04X)" % DEFAULT_STUB_ADDR)
+    parser.add_argument("--pack-top", type=parse_addr, default=DEFAULT_PACK_TOP,
+                        help="end of the packed image in memory (default $%04X)" % DEFAULT_PACK_TOP)
+    parser.add_argument("--quiet", action="store_true", help="do not print the size report")
     args = parser.parse_args()
     try:
-        fix_runad(args.xex)
+        process(args.xex, args.merge, args.zero_fill, args.compress, args.zero_run, args.stub_addr, args.pack_top,
+                args.quiet)
     except Exception as exc:
         print(f"fix_runad.py: {exc}", file=sys.stderr)
         return 1